@@ -0,0 +1,527 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+
+#include "PostProcess.h"
+#include "SolarGL.h"
+#include "parallel.h"
+#include "simd.h"
+
+
+
+//辉光缓冲相对画布的缩小倍数
+static const int GLOW_SCALE = 4;
+//12 位查找表的定点单位：8 位输入乘 4 即可对齐，1020 对应线性值 1，整张表覆盖约 [0, 4)
+static const int LUT12_ONE = 1020;
+static const int LUT12_SIZE = 4096;
+//每个任务处理的行数
+static const int ROWS = 16;
+//合成时辉光纵向插值权重的定点位数，GLOW_SCALE 为 4 时像素中心的权重恰好是 1/8 的倍数
+static const int LERP_BITS = 3;
+
+//FXAA 参数，亮度按 [0,255]
+static const int FXAA_EDGE_MIN = 21;            //局部对比度低于它时不处理（约 1/12）
+static const int FXAA_EDGE_SHIFT = 3;           //或低于局部最大亮度的 1/8 时不处理
+static const float FXAA_REDUCE_MIN = 1.f / 128.f;
+static const float FXAA_REDUCE_MUL = 1.f / 8.f;
+static const float FXAA_SPAN_MAX = 8.f;
+
+
+static float toneMap(float x, ToneMap curve)
+{
+    switch (curve)
+    {
+        case ToneMap::Reinhard: return x / (1.f + x);
+        case ToneMap::ACES:     return std::min(std::max(x * (2.51f * x + .03f) / (x * (2.43f * x + .59f) + .14f), 0.f), 1.f);
+        default:                return std::min(x, 1.f);
+    }
+}
+
+static float srgbEncode(float x)
+{
+    return x <= .0031308f ? 12.92f * x : 1.055f * std::pow(x, 1.f / 2.4f) - .055f;
+}
+
+void PostProcessor::resize(int w, int h)
+{
+    if (w == width && h == height) return;
+    width = w;
+    height = h;
+    qw = (w + GLOW_SCALE - 1) / GLOW_SCALE;
+    qh = (h + GLOW_SCALE - 1) / GLOW_SCALE;
+    glow.assign((size_t)qw * qh * 3, 0.f);
+    blur.assign((size_t)qw * qh * 3, 0.f);
+    ldr.assign((size_t)w * h * 3, 0);
+    luma.assign((size_t)w * h, 0);
+    wide.assign((size_t)qh * w * 3, 0);
+
+    //第 x 列像素中心在辉光缓冲中的横坐标，合成时两列之间线性插值
+    col_a.resize(w);
+    col_b.resize(w);
+    col_t.resize(w);
+    for (int x = 0; x < w; x++)
+    {
+        float fx = std::min(std::max((x + .5f) / GLOW_SCALE - .5f, 0.f), qw - 1.f);
+        col_a[x] = (int)fx;
+        col_b[x] = std::min(col_a[x] + 1, qw - 1);
+        col_t[x] = fx - col_a[x];
+    }
+}
+
+//曝光、色调映射与 sRGB 编码合成一张表，参数不变时不重建
+void PostProcessor::buildLut(const PostOptions &options)
+{
+    if (!lut12.empty() && lut_exposure == options.exposure && lut_tone_map == options.tone_map && lut_srgb == options.srgb) return;
+    lut_exposure = options.exposure;
+    lut_tone_map = options.tone_map;
+    lut_srgb = options.srgb;
+
+    auto map = [&options](float x)
+    {
+        float y = toneMap(x * options.exposure, options.tone_map);
+        if (options.srgb) y = srgbEncode(y);
+        return (unsigned char)(std::min(std::max(y, 0.f), 1.f) * 255.f + .5f);
+    };
+    for (int i = 0; i < 256; i++) lut8[i] = map(i / 255.f);
+    lut12.resize(LUT12_SIZE);
+    for (int i = 0; i < LUT12_SIZE; i++) lut12[i] = map((float)i / LUT12_ONE);
+}
+
+//HDR 渲染目标的线性颜色乘 LUT12_ONE 四舍五入成 12 位查表单位，负值与 NaN 为 0，超出表的部分取表尾。
+//一次转换 4 个像素，丢掉 alpha 后按 BGR 交错写出
+void PostProcessor::loadHdr(const HdrBuffer &hdr)
+{
+    hdr12.resize((size_t)width * height * 3);
+    const float top = (LUT12_SIZE - 1.f) / LUT12_ONE;
+    parallel_for(0, height, ROWS, [&](int y0, int y1)
+    {
+        std::vector<float> scratch((size_t)width * 4);
+        for (int y = y0; y < y1; y++)
+        {
+            const float* c = hdr.row(y, scratch.data());
+            uint16_t* d = hdr12.data() + (size_t)y * width * 3;
+            int x = 0;
+#ifdef SIMD_SSE2
+            const __m128 zero = _mm_setzero_ps(), hi = _mm_set1_ps(top), unit = _mm_set1_ps((float)LUT12_ONE), half = _mm_set1_ps(.5f);
+            auto quantize = [&](const float* p) { return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(p), zero), hi), unit), half)); };
+            for (; x + 4 <= width; x += 4)
+            {
+                alignas(16) uint16_t t[16];
+                const float* p = c + 4 * x;
+                _mm_store_si128((__m128i*)t, _mm_packs_epi32(quantize(p), quantize(p + 4)));
+                _mm_store_si128((__m128i*)(t + 8), _mm_packs_epi32(quantize(p + 8), quantize(p + 12)));
+                for (int k = 0; k < 4; k++) memcpy(d + 3 * (x + k), t + 4 * k, 3 * sizeof(uint16_t));
+            }
+#endif
+            for (; x < width; x++)
+                for (int k = 0; k < 3; k++)
+                {
+                    float v = c[4 * x + k];
+                    d[3 * x + k] = (uint16_t)((v > 0.f ? std::min(v, top) : 0.f) * LUT12_ONE + .5f);
+                }
+        }
+    });
+}
+
+//亮部提取与 4x4 降采样融合为一遍。8 位输入：4 行先两两求平均，再用 SAD 把每 4 个像素的同一通道加起来；
+//12 位输入：4 行直接相加（最大 4 * 4095，不会溢出 16 位），再用 madd 按通道挑出并横向求和
+template <class T>
+void PostProcessor::brightPass(const T* src, float threshold)
+{
+    const int row_elems = width * 3;
+    const float unit = sizeof(T) == 1 ? 255.f : (float)LUT12_ONE;
+    const size_t plane = (size_t)qw * qh;
+    parallel_for(0, qh, ROWS, [&](int qy0, int qy1)
+    {
+#ifdef SIMD_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i channel[3] = {_mm_setr_epi8(-1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, 0, 0, 0, 0),
+                                    _mm_setr_epi8(0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, 0, 0, 0),
+                                    _mm_setr_epi8(0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, 0, 0)};
+        //12 个 16 位分量分在前 8 个与后 8 个中，第 c 个通道在位置 c、c + 3、c + 6、c + 9
+        const __m128i pick[3][2] = {{_mm_setr_epi16(1, 0, 0, 1, 0, 0, 1, 0), _mm_setr_epi16(0, 1, 0, 0, 0, 0, 0, 0)},
+                                    {_mm_setr_epi16(0, 1, 0, 0, 1, 0, 0, 1), _mm_setr_epi16(0, 0, 1, 0, 0, 0, 0, 0)},
+                                    {_mm_setr_epi16(0, 0, 1, 0, 0, 1, 0, 0), _mm_setr_epi16(1, 0, 0, 1, 0, 0, 0, 0)}};
+#endif
+        for (int qy = qy0; qy < qy1; qy++)
+        {
+            const T* rows[GLOW_SCALE];
+            for (int k = 0; k < GLOW_SCALE; k++) rows[k] = src + (size_t)std::min(qy * GLOW_SCALE + k, height - 1) * row_elems;
+
+            for (int qx = 0; qx < qw; qx++)
+            {
+                int o = qx * GLOW_SCALE * 3;
+                float sum[3];
+#ifdef SIMD_SSE2
+                if (o + 16 <= row_elems)
+                {
+                    if constexpr (sizeof(T) == 1)
+                    {
+                        __m128i a = _mm_avg_epu8(_mm_avg_epu8(_mm_loadu_si128((const __m128i*)(rows[0] + o)), _mm_loadu_si128((const __m128i*)(rows[1] + o))),
+                                                 _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(rows[2] + o)), _mm_loadu_si128((const __m128i*)(rows[3] + o))));
+                        for (int c = 0; c < 3; c++)
+                        {
+                            __m128i s = _mm_sad_epu8(_mm_and_si128(a, channel[c]), zero);
+                            sum[c] = (float)(_mm_cvtsi128_si32(s) + _mm_extract_epi16(s, 4)) * (1.f / (4.f * 255.f));
+                        }
+                    }
+                    else
+                    {
+                        __m128i lo = zero, hi = zero;
+                        for (int k = 0; k < GLOW_SCALE; k++)
+                        {
+                            lo = _mm_add_epi16(lo, _mm_loadu_si128((const __m128i*)(rows[k] + o)));
+                            hi = _mm_add_epi16(hi, _mm_loadu_si128((const __m128i*)(rows[k] + o + 8)));
+                        }
+                        for (int c = 0; c < 3; c++)
+                        {
+                            __m128i s = _mm_add_epi32(_mm_madd_epi16(lo, pick[c][0]), _mm_madd_epi16(hi, pick[c][1]));
+                            s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+                            s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+                            sum[c] = (float)_mm_cvtsi128_si32(s) * (1.f / (16.f * LUT12_ONE));
+                        }
+                    }
+                }
+                else
+#endif
+                {
+                    //行尾不足 16 个分量的块逐像素累加
+                    int x0 = qx * GLOW_SCALE, x1 = std::min(x0 + GLOW_SCALE, width), acc[3] = {0, 0, 0};
+                    for (int k = 0; k < GLOW_SCALE; k++)
+                        for (int x = x0; x < x1; x++)
+                            for (int c = 0; c < 3; c++) acc[c] += rows[k][x * 3 + c];
+                    for (int c = 0; c < 3; c++) sum[c] = (float)acc[c] / (unit * GLOW_SCALE * (x1 - x0));
+                }
+                for (int c = 0; c < 3; c++) glow[c * plane + qy * qw + qx] = std::max(sum[c] - threshold, 0.f);
+            }
+        }
+    });
+}
+
+//1/4 分辨率上的可分离高斯模糊：横向 glow -> blur，纵向与横向上采样融合，直接写出画布宽度的交错辉光 wide。
+//两遍卷积都在 x 方向一次算 4 个像素
+void PostProcessor::blurGlow(float sigma, float strength)
+{
+    float s = std::max(sigma / GLOW_SCALE, .5f);
+    int R = std::min((int)std::ceil(3.f * s), 32);
+    std::vector<float> w(2 * R + 1);
+    float total = 0.f;
+    for (int k = -R; k <= R; k++) total += w[k + R] = std::exp(-.5f * k * k / (s * s));
+    for (float &v : w) v /= total;
+
+    const size_t plane = (size_t)qw * qh;
+    const int span = (qw + 3) & ~3;
+    //核是对称的，第 k 与第 2R - k 个抽头先相加再乘权重；一次算 16 个像素，四条累加链互不依赖，不会卡在加法延迟上
+    auto convolve = [&w, R, span](const float* const* taps, float* out)
+    {
+        int x = 0;
+#ifdef SIMD_SSE2
+        for (; x + 16 <= span; x += 16)
+        {
+            __m128 acc[4], center = _mm_set1_ps(w[R]);
+            for (int j = 0; j < 4; j++) acc[j] = _mm_mul_ps(center, _mm_loadu_ps(taps[R] + x + 4 * j));
+            for (int k = 0; k < R; k++)
+            {
+                __m128 wk = _mm_set1_ps(w[k]);
+                for (int j = 0; j < 4; j++)
+                    acc[j] = _mm_add_ps(acc[j], _mm_mul_ps(wk, _mm_add_ps(_mm_loadu_ps(taps[k] + x + 4 * j), _mm_loadu_ps(taps[2 * R - k] + x + 4 * j))));
+            }
+            for (int j = 0; j < 4; j++) _mm_storeu_ps(out + x + 4 * j, acc[j]);
+        }
+        for (; x < span; x += 4)
+        {
+            __m128 acc = _mm_mul_ps(_mm_set1_ps(w[R]), _mm_loadu_ps(taps[R] + x));
+            for (int k = 0; k < R; k++) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_add_ps(_mm_loadu_ps(taps[k] + x), _mm_loadu_ps(taps[2 * R - k] + x))));
+            _mm_storeu_ps(out + x, acc);
+        }
+#else
+        for (; x < span; x++)
+        {
+            float acc = w[R] * taps[R][x];
+            for (int k = 0; k < R; k++) acc += w[k] * (taps[k][x] + taps[2 * R - k][x]);
+            out[x] = acc;
+        }
+#endif
+    };
+
+    //横向：每行先复制到两端按边缘值延拓的行缓冲，第 k 个抽头就是行缓冲偏移 k 的一段
+    parallel_for(0, 3 * qh, ROWS, [&](int r0, int r1)
+    {
+        std::vector<float> pad(span + 2 * R + 4), out(span);
+        std::vector<const float*> taps(2 * R + 1);
+        for (int k = 0; k <= 2 * R; k++) taps[k] = pad.data() + k;
+        for (int r = r0; r < r1; r++)
+        {
+            const float* in = glow.data() + r * (size_t)qw;
+            for (int i = 0; i < (int)pad.size(); i++) pad[i] = in[std::min(std::max(i - R, 0), qw - 1)];
+            convolve(taps.data(), out.data());
+            std::copy(out.begin(), out.begin() + qw, blur.begin() + r * (size_t)qw);
+        }
+    });
+
+    //纵向：第 k 个抽头是上下钳制后的第 y + k - R 行。一行的三个通道算完后立即横向上采样，
+    //乘上辉光强度换算成查表单位，按 BGR 交错写入 wide，合成时只剩纵向插值
+    const float gain = strength * LUT12_ONE;
+    const int row_bytes = width * 3;
+    parallel_for(0, qh, ROWS, [&](int y0, int y1)
+    {
+        std::vector<float> out(3 * span);
+        std::vector<const float*> taps(2 * R + 1);
+        std::vector<float> edge(span);
+        for (int y = y0; y < y1; y++)
+        {
+            for (int p = 0; p < 3; p++)
+            {
+                const float* base = blur.data() + p * plane;
+                for (int k = 0; k <= 2 * R; k++) taps[k] = base + std::min(std::max(y + k - R, 0), qh - 1) * (size_t)qw;
+                //最后一行读到 span 时会越过平面末尾，复制到补齐的缓冲中再算
+                for (int k = 0; k <= 2 * R; k++)
+                    if (taps[k] + span > blur.data() + blur.size())
+                    {
+                        std::copy(taps[k], taps[k] + qw, edge.begin());
+                        taps[k] = edge.data();
+                    }
+                convolve(taps.data(), out.data() + p * span);
+            }
+
+            const float *g0 = out.data(), *g1 = g0 + span, *g2 = g1 + span;
+            const int *ca = col_a.data(), *cb = col_b.data();
+            const float* ct = col_t.data();
+            int16_t* o = wide.data() + (size_t)y * row_bytes;
+            //远离亮部的行（大片星空）辉光全为 0
+            if (*std::max_element(out.begin(), out.end()) * gain < 1.f)
+            {
+                std::fill(o, o + row_bytes, (int16_t)0);
+                continue;
+            }
+            for (int x = 0; x < width; x++)
+            {
+                int a = ca[x], b = cb[x];
+                float t = ct[x];
+                o[3 * x]     = (int16_t)std::min((g0[a] + (g0[b] - g0[a]) * t) * gain, LUT12_SIZE - 1.f);
+                o[3 * x + 1] = (int16_t)std::min((g1[a] + (g1[b] - g1[a]) * t) * gain, LUT12_SIZE - 1.f);
+                o[3 * x + 2] = (int16_t)std::min((g2[a] + (g2[b] - g2[a]) * t) * gain, LUT12_SIZE - 1.f);
+            }
+        }
+    });
+}
+
+//叠加辉光、曝光、色调映射、sRGB 编码与亮度平面融合为一遍。先用 SSE2 一次 16 个分量地把颜色扩展到 12 位
+//（12 位输入已经是查表单位）、加上纵向插值后的辉光，得到一行查表下标；查表没有 SSE2 的 gather，逐像素进行并顺便算出亮度
+template <class T>
+void PostProcessor::composite(const T* src, unsigned char* dst, const PostOptions &options)
+{
+    const int row_bytes = width * 3;
+    const bool bloom = options.bloom;
+    constexpr int scale = sizeof(T) == 1 ? LUT12_ONE / 255 : 1;
+    const unsigned char* lut = bloom || sizeof(T) != 1 ? lut12.data() : lut8;
+    unsigned char* lplane = options.fxaa ? luma.data() : nullptr;
+    parallel_for(0, height, ROWS, [&](int y0, int y1)
+    {
+        std::vector<uint16_t> index(row_bytes);
+        uint16_t* k = index.data();
+        for (int y = y0; y < y1; y++)
+        {
+            const T* s = src + (size_t)y * row_bytes;
+            unsigned char* d = dst + (size_t)y * row_bytes;
+            unsigned char* l = lplane ? lplane + (size_t)y * width : nullptr;
+
+            if (bloom)
+            {
+                //第 y 行像素中心在辉光缓冲中的纵坐标，两行之间按 1/8 定点权重插值
+                float fy = std::min(std::max((y + .5f) / GLOW_SCALE - .5f, 0.f), qh - 1.f);
+                int qa = (int)fy, qb = std::min(qa + 1, qh - 1), t = (int)((fy - qa) * (1 << LERP_BITS) + .5f);
+                const int16_t* a = wide.data() + (size_t)qa * row_bytes;
+                const int16_t* b = wide.data() + (size_t)qb * row_bytes;
+                int i = 0;
+#ifdef SIMD_SSE2
+                const __m128i zero = _mm_setzero_si128(), tt = _mm_set1_epi16((short)t), top = _mm_set1_epi16(LUT12_SIZE - 1);
+                auto glow = [&](int j)
+                {
+                    __m128i va = _mm_loadu_si128((const __m128i*)(a + j));
+                    return _mm_add_epi16(va, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_loadu_si128((const __m128i*)(b + j)), va), tt), LERP_BITS));
+                };
+                for (; i + 16 <= row_bytes; i += 16)
+                {
+                    __m128i lo, hi;
+                    if constexpr (sizeof(T) == 1)
+                    {
+                        __m128i px = _mm_loadu_si128((const __m128i*)(s + i));
+                        lo = _mm_slli_epi16(_mm_unpacklo_epi8(px, zero), 2);
+                        hi = _mm_slli_epi16(_mm_unpackhi_epi8(px, zero), 2);
+                    }
+                    else
+                    {
+                        lo = _mm_loadu_si128((const __m128i*)(s + i));
+                        hi = _mm_loadu_si128((const __m128i*)(s + i + 8));
+                    }
+                    _mm_storeu_si128((__m128i*)(k + i), _mm_min_epi16(_mm_add_epi16(lo, glow(i)), top));
+                    _mm_storeu_si128((__m128i*)(k + i + 8), _mm_min_epi16(_mm_add_epi16(hi, glow(i + 8)), top));
+                }
+#endif
+                for (; i < row_bytes; i++) k[i] = (uint16_t)std::min(s[i] * scale + a[i] + (((b[i] - a[i]) * t) >> LERP_BITS), LUT12_SIZE - 1);
+            }
+            else
+                for (int i = 0; i < row_bytes; i++) k[i] = s[i];
+
+            //逐像素查表，B、G、R 的感知亮度写入亮度平面，FXAA 在 gamma 编码后的颜色上判断边缘
+            auto lookup = [&](int x0, int x1)
+            {
+                if (l)
+                    for (int x = x0; x < x1; x++)
+                    {
+                        unsigned char c0 = lut[k[3 * x]], c1 = lut[k[3 * x + 1]], c2 = lut[k[3 * x + 2]];
+                        d[3 * x] = c0;
+                        d[3 * x + 1] = c1;
+                        d[3 * x + 2] = c2;
+                        l[x] = (unsigned char)((c0 * 29 + c1 * 150 + c2 * 77) >> 8);
+                    }
+                else
+                    for (int i = 3 * x0; i < 3 * x1; i++) d[i] = lut[k[i]];
+            };
+            int x = 0;
+#ifdef SIMD_SSE2
+            //画面大部分是黑色背景：下标全为 0 的 16 个像素直接填充，亮度权重之和为 256，灰色的亮度就是它自己
+            const unsigned char black = lut[0];
+            for (; x + 16 <= width; x += 16)
+            {
+                const __m128i* v = (const __m128i*)(k + 3 * x);
+                __m128i any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(v), _mm_loadu_si128(v + 1)), _mm_or_si128(_mm_loadu_si128(v + 2), _mm_loadu_si128(v + 3)));
+                any = _mm_or_si128(any, _mm_or_si128(_mm_loadu_si128(v + 4), _mm_loadu_si128(v + 5)));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) == 0xffff)
+                {
+                    memset(d + 3 * x, black, 48);
+                    if (l) memset(l + x, black, 16);
+                }
+                else
+                    lookup(x, x + 16);
+            }
+#endif
+            lookup(x, width);
+        }
+    });
+}
+
+//FXAA：在亮度平面上用 SSE2 一次检查 16 个像素的十字邻域对比度，只有超过阈值的边缘像素才沿边缘方向混合。
+//读 ldr 写 dst，首末行与首末列不处理
+void PostProcessor::fxaa(unsigned char* dst)
+{
+    const int row_bytes = width * 3;
+    const unsigned char* L = luma.data();
+    const unsigned char* C = ldr.data();
+
+    //像素坐标 (x, y) 处的双线性取样，像素中心在整数坐标上
+    auto fetch = [&](float x, float y, float* rgb)
+    {
+        x = std::min(std::max(x, 0.f), width - 1.f);
+        y = std::min(std::max(y, 0.f), height - 1.f);
+        int x0 = (int)x, y0 = (int)y, x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+        float u = x - x0, v = y - y0;
+        const unsigned char *p00 = C + (y0 * width + x0) * 3, *p10 = C + (y0 * width + x1) * 3;
+        const unsigned char *p01 = C + (y1 * width + x0) * 3, *p11 = C + (y1 * width + x1) * 3;
+        for (int c = 0; c < 3; c++)
+        {
+            float top = p00[c] + (p10[c] - p00[c]) * u, bottom = p01[c] + (p11[c] - p01[c]) * u;
+            rgb[c] = top + (bottom - top) * v;
+        }
+    };
+
+    auto edge = [&](int x, int y)
+    {
+        const unsigned char* l = L + y * width + x;
+        float nw = l[-width - 1], ne = l[-width + 1], sw = l[width - 1], se = l[width + 1], m = l[0];
+        float lo = std::min(m, std::min(std::min(nw, ne), std::min(sw, se)));
+        float hi = std::max(m, std::max(std::max(nw, ne), std::max(sw, se)));
+
+        float dx = -((nw + ne) - (sw + se)), dy = (nw + sw) - (ne + se);
+        float reduce = std::max((nw + ne + sw + se) * (.25f * FXAA_REDUCE_MUL), FXAA_REDUCE_MIN * 255.f);
+        float rcp = 1.f / (std::min(std::fabs(dx), std::fabs(dy)) + reduce);
+        dx = std::min(std::max(dx * rcp, -FXAA_SPAN_MAX), FXAA_SPAN_MAX);
+        dy = std::min(std::max(dy * rcp, -FXAA_SPAN_MAX), FXAA_SPAN_MAX);
+
+        float a0[3], a1[3], b0[3], b1[3], A[3], B[3];
+        fetch(x + dx * (1.f / 3.f - .5f), y + dy * (1.f / 3.f - .5f), a0);
+        fetch(x + dx * (2.f / 3.f - .5f), y + dy * (2.f / 3.f - .5f), a1);
+        fetch(x - dx * .5f, y - dy * .5f, b0);
+        fetch(x + dx * .5f, y + dy * .5f, b1);
+        for (int c = 0; c < 3; c++)
+        {
+            A[c] = .5f * (a0[c] + a1[c]);
+            B[c] = .5f * A[c] + .25f * (b0[c] + b1[c]);
+        }
+        float lb = (B[0] * 29.f + B[1] * 150.f + B[2] * 77.f) * (1.f / 256.f);
+        const float* res = lb < lo || lb > hi ? A : B;
+        unsigned char* d = dst + (y * width + x) * 3;
+        for (int c = 0; c < 3; c++) d[c] = (unsigned char)(res[c] + .5f);
+    };
+
+    auto contrast = [&](int x, int y)
+    {
+        const unsigned char* l = L + y * width + x;
+        int hi = std::max({l[0], l[-1], l[1], l[-width], l[width]});
+        int lo = std::min({l[0], l[-1], l[1], l[-width], l[width]});
+        return hi - lo > std::max(FXAA_EDGE_MIN, hi >> FXAA_EDGE_SHIFT);
+    };
+
+    parallel_for(0, height, ROWS, [&](int y0, int y1)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            memcpy(dst + (size_t)y * row_bytes, C + (size_t)y * row_bytes, row_bytes);
+            if (y == 0 || y == height - 1) continue;
+            int x = 1;
+#ifdef SIMD_SSE2
+            const __m128i edge_min = _mm_set1_epi8((char)FXAA_EDGE_MIN), low5 = _mm_set1_epi8(0x1f), zero = _mm_setzero_si128();
+            for (; x + 16 <= width - 1; x += 16)
+            {
+                const unsigned char* l = L + y * width + x;
+                __m128i m = _mm_loadu_si128((const __m128i*)l);
+                __m128i n = _mm_loadu_si128((const __m128i*)(l - width)), s = _mm_loadu_si128((const __m128i*)(l + width));
+                __m128i w = _mm_loadu_si128((const __m128i*)(l - 1)), e = _mm_loadu_si128((const __m128i*)(l + 1));
+                __m128i hi = _mm_max_epu8(_mm_max_epu8(m, _mm_max_epu8(n, s)), _mm_max_epu8(w, e));
+                __m128i lo = _mm_min_epu8(_mm_min_epu8(m, _mm_min_epu8(n, s)), _mm_min_epu8(w, e));
+                //阈值 max(EDGE_MIN, hi / 8)，逐字节右移用 16 位移位再屏蔽掉相邻字节移进来的位
+                __m128i threshold = _mm_max_epu8(edge_min, _mm_and_si128(_mm_srli_epi16(hi, FXAA_EDGE_SHIFT), low5));
+                int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(_mm_subs_epu8(hi, lo), threshold), zero)) & 0xffff;
+                while (mask)
+                {
+                    edge(x + std::countr_zero((unsigned)mask), y);
+                    mask &= mask - 1;
+                }
+            }
+#endif
+            for (; x < width - 1; x++)
+                if (contrast(x, y)) edge(x, y);
+        }
+    });
+}
+
+bool PostProcessor::apply(TGAImage &image, const PostOptions &options, const HdrBuffer* hdr)
+{
+    if (image.get_bytespp() != TGAImage::RGB) return false;
+    if (hdr && (hdr->width != image.get_width() || hdr->height != image.get_height())) return false;
+    resize(image.get_width(), image.get_height());
+    buildLut(options);
+
+    unsigned char* pixels = image.buffer();
+    auto run = [&](const auto* src)
+    {
+        if (options.bloom)
+        {
+            brightPass(src, options.bloom_threshold);
+            blurGlow(options.bloom_sigma, options.bloom_strength);
+        }
+        //有 FXAA 时映射结果先写到 ldr，FXAA 读 ldr 写回画布
+        composite(src, options.fxaa ? ldr.data() : pixels, options);
+    };
+    if (hdr)
+    {
+        loadHdr(*hdr);
+        run(hdr12.data());
+    }
+    else
+        run((const unsigned char*)pixels);
+    if (options.fxaa) fxaa(pixels);
+    return true;
+}
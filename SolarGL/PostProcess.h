@@ -0,0 +1,77 @@
+#pragma once
+
+
+#include <cstdint>
+#include <vector>
+
+#include "tgaimage.h"
+
+
+
+//---------------------------------------------------------------------------------------
+//post process
+//渲染完成后对整帧画布执行的后处理链：辉光（亮部提取、1/4 分辨率可分离高斯模糊、上采样叠加）、
+//曝光与色调映射、sRGB 编码（默认关闭，见 PostOptions::srgb）、FXAA。逐像素的几步融合成一遍：叠加辉光后的值直接查一张合成好的表，
+//表里已经包含曝光、色调映射与 gamma。每一遍都按行分块交给线程池，内循环用 SSE2。
+//输入可以直接是 HDR 渲染目标：亮部提取与色调映射看到的是没有截断的高光，量化到 8 位只在最后查表时发生一次
+
+struct HdrBuffer;
+
+//色调映射曲线，输入为线性值，输出限制在 [0,1]
+enum class ToneMap
+{
+    None,           //直接截断
+    Reinhard,       //x / (1 + x)
+    ACES            //ACES filmic 的有理函数拟合，高光过渡更柔和
+};
+
+struct PostOptions
+{
+    float exposure = 1.f;
+    ToneMap tone_map = ToneMap::ACES;
+    //按 sRGB 曲线做 gamma 编码，只适用于线性的输入。纹理是 sRGB 编码的，着色时不转换到线性，
+    //画布与 HDR 渲染目标中的颜色已经是编码后的值，再编码一次整体发灰，所以默认关闭
+    bool srgb = false;
+    bool bloom = true;              //辉光，用于大气层等亮部边缘
+    float bloom_threshold = .6f;    //超过阈值的部分才参与辉光，[0,1]
+    float bloom_strength = .8f;
+    float bloom_sigma = 12.f;       //高斯核的标准差，全分辨率像素
+    bool fxaa = true;
+};
+
+class PostProcessor
+{
+public:
+    PostProcessor() {}
+
+    //就地处理一帧，只支持 RGB 画布，其它格式返回 false。
+    //hdr 非空时从它读取线性颜色（超过约 4 的部分按 4 处理），结果写入画布，画布原有的内容不使用，尺寸须与画布相同
+    bool apply(TGAImage &image, const PostOptions &options = PostOptions(), const HdrBuffer* hdr = nullptr);
+
+private:
+    int width = 0, height = 0;
+    int qw = 0, qh = 0;                 //1/4 分辨率的辉光缓冲尺寸
+    std::vector<float> glow, blur;      //辉光的三个通道依次存放，每个通道 qw * qh
+    std::vector<int16_t> wide;          //横向已上采样到画布宽度的辉光，按 BGR 交错，已乘强度换算成 12 位查表单位，qh 行
+    std::vector<int> col_a, col_b;      //画布第 x 列横向插值用的两个辉光列
+    std::vector<float> col_t;           //及其插值权重
+    std::vector<unsigned char> ldr;     //FXAA 的输入：映射后的颜色
+    std::vector<unsigned char> luma;    //FXAA 使用的亮度平面
+    std::vector<uint16_t> hdr12;        //HDR 输入换算成 12 位查表单位的颜色，按 BGR 交错
+
+    //合成好的查找表：8 位输入（无辉光）与 12 位定点输入（叠加辉光后可能超过 1），以及生成它们的参数
+    unsigned char lut8[256];
+    std::vector<unsigned char> lut12;
+    float lut_exposure = -1.f;
+    ToneMap lut_tone_map = ToneMap::None;
+    bool lut_srgb = false;
+
+    void resize(int w, int h);
+    void buildLut(const PostOptions &options);
+    void loadHdr(const HdrBuffer &hdr);
+    //src 为 8 位画布或 12 位的 hdr12
+    template <class T> void brightPass(const T* src, float threshold);
+    void blurGlow(float sigma, float strength);
+    template <class T> void composite(const T* src, unsigned char* dst, const PostOptions &options);
+    void fxaa(unsigned char* dst);
+};
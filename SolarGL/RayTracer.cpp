@@ -0,0 +1,691 @@
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <limits>
+
+#include "RayTracer.h"
+#include "Shader.h"
+#include "parallel.h"
+#include "simd.h"
+
+
+
+//---------------------------------------------------------------------------------------
+//四路 SIMD
+//四个浮点数一组，SSE2 下是一个 __m128，否则是四个标量；比较的结果是按位全 1 / 全 0 的掩码
+struct float4
+{
+#ifdef SIMD_SSE2
+    __m128 m;
+
+    float4() : m(_mm_setzero_ps()) {}
+    float4(__m128 v) : m(v) {}
+    float4(float f) : m(_mm_set1_ps(f)) {}
+    float4(float a, float b, float c, float d) : m(_mm_setr_ps(a, b, c, d)) {}
+
+    friend float4 operator +(float4 a, float4 b) { return _mm_add_ps(a.m, b.m); }
+    friend float4 operator -(float4 a, float4 b) { return _mm_sub_ps(a.m, b.m); }
+    friend float4 operator *(float4 a, float4 b) { return _mm_mul_ps(a.m, b.m); }
+    friend float4 operator /(float4 a, float4 b) { return _mm_div_ps(a.m, b.m); }
+    friend float4 operator <(float4 a, float4 b) { return _mm_cmplt_ps(a.m, b.m); }
+    friend float4 operator <=(float4 a, float4 b) { return _mm_cmple_ps(a.m, b.m); }
+    friend float4 operator >(float4 a, float4 b) { return _mm_cmpgt_ps(a.m, b.m); }
+    friend float4 operator >=(float4 a, float4 b) { return _mm_cmpge_ps(a.m, b.m); }
+    friend float4 operator &(float4 a, float4 b) { return _mm_and_ps(a.m, b.m); }
+    friend float4 andnot(float4 a, float4 b) { return _mm_andnot_ps(a.m, b.m); }   // ~a & b
+    friend float4 min(float4 a, float4 b) { return _mm_min_ps(a.m, b.m); }
+    friend float4 max(float4 a, float4 b) { return _mm_max_ps(a.m, b.m); }
+    friend float4 blend(float4 mask, float4 a, float4 b) { return _mm_or_ps(_mm_and_ps(mask.m, a.m), _mm_andnot_ps(mask.m, b.m)); }
+    friend int bits(float4 mask) { return _mm_movemask_ps(mask.m); }
+    float operator [](int i) const { float f[4]; _mm_storeu_ps(f, m); return f[i]; }
+#else
+    float v[4];
+
+    float4() : v{0.f, 0.f, 0.f, 0.f} {}
+    float4(float f) : v{f, f, f, f} {}
+    float4(float a, float b, float c, float d) : v{a, b, c, d} {}
+
+    template <class F> static float4 map(F f) { return float4(f(0), f(1), f(2), f(3)); }
+    static float mask(bool b) { return std::bit_cast<float>(b ? 0xffffffffu : 0u); }
+    static uint32_t u(float f) { return std::bit_cast<uint32_t>(f); }
+
+    friend float4 operator +(float4 a, float4 b) { return map([&](int i) { return a.v[i] + b.v[i]; }); }
+    friend float4 operator -(float4 a, float4 b) { return map([&](int i) { return a.v[i] - b.v[i]; }); }
+    friend float4 operator *(float4 a, float4 b) { return map([&](int i) { return a.v[i] * b.v[i]; }); }
+    friend float4 operator /(float4 a, float4 b) { return map([&](int i) { return a.v[i] / b.v[i]; }); }
+    friend float4 operator <(float4 a, float4 b) { return map([&](int i) { return mask(a.v[i] < b.v[i]); }); }
+    friend float4 operator <=(float4 a, float4 b) { return map([&](int i) { return mask(a.v[i] <= b.v[i]); }); }
+    friend float4 operator >(float4 a, float4 b) { return map([&](int i) { return mask(a.v[i] > b.v[i]); }); }
+    friend float4 operator >=(float4 a, float4 b) { return map([&](int i) { return mask(a.v[i] >= b.v[i]); }); }
+    friend float4 operator &(float4 a, float4 b) { return map([&](int i) { return std::bit_cast<float>(u(a.v[i]) & u(b.v[i])); }); }
+    friend float4 andnot(float4 a, float4 b) { return map([&](int i) { return std::bit_cast<float>(~u(a.v[i]) & u(b.v[i])); }); }
+    friend float4 min(float4 a, float4 b) { return map([&](int i) { return a.v[i] < b.v[i] ? a.v[i] : b.v[i]; }); }
+    friend float4 max(float4 a, float4 b) { return map([&](int i) { return a.v[i] > b.v[i] ? a.v[i] : b.v[i]; }); }
+    friend float4 blend(float4 mask, float4 a, float4 b) { return map([&](int i) { return u(mask.v[i]) ? a.v[i] : b.v[i]; }); }
+    friend int bits(float4 mask) { return (int)((u(mask.v[0]) >> 31) | (u(mask.v[1]) >> 31 << 1) | (u(mask.v[2]) >> 31 << 2) | (u(mask.v[3]) >> 31 << 3)); }
+    float operator [](int i) const { return v[i]; }
+#endif
+};
+
+//四个三维向量，按分量 SoA 排列
+struct Vec3x4
+{
+    float4 x, y, z;
+
+    Vec3x4() {}
+    Vec3x4(const Vec3f &v) : x(v.x), y(v.y), z(v.z) {}
+    Vec3x4(float4 x_, float4 y_, float4 z_) : x(x_), y(y_), z(z_) {}
+
+    Vec3x4 operator -(const Vec3x4 &o) const { return Vec3x4(x - o.x, y - o.y, z - o.z); }
+};
+
+static inline float4 dot(const Vec3x4 &a, const Vec3x4 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+static inline Vec3x4 cross(const Vec3x4 &a, const Vec3x4 &b)
+{
+    return Vec3x4(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+
+//四条光线一组：有效区间 (tmin, t)，命中后 t 缩短为最近交点，tri 记录命中的三角形，-1 表示未命中
+struct RayPacket
+{
+    Vec3x4 o, d, inv;
+    float4 tmin, t;
+    float4 u, v;            //命中点的重心坐标
+    float4 active;          //参与求交的光线
+    int tri[4];
+
+    //lanes 的第 k 位为 1 的光线参与求交
+    void init(int lanes, float t_max)
+    {
+        const float tiny = 1e-20f;
+        auto safe = [tiny](float4 f) { return blend(max(f, 0.f - f) < tiny, float4(tiny), f); };
+        inv = Vec3x4(float4(1.f) / safe(d.x), float4(1.f) / safe(d.y), float4(1.f) / safe(d.z));
+        tmin = 0.f;
+        t = t_max;
+        active = float4(lanes & 1 ? 1.f : 0.f, lanes & 2 ? 1.f : 0.f, lanes & 4 ? 1.f : 0.f, lanes & 8 ? 1.f : 0.f) > 0.f;
+        for (int k = 0; k < 4; k++) tri[k] = -1;
+    }
+};
+
+
+//---------------------------------------------------------------------------------------
+//BVH 建立
+//三角形的包围盒与中心
+struct Prim
+{
+    Vec3f lo, hi, c;
+};
+
+static inline float component(const Vec3f &v, int k) { return k == 0 ? v.x : (k == 1 ? v.y : v.z); }
+
+struct Bounds
+{
+    Vec3f lo = Vec3f(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+    Vec3f hi = Vec3f(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+
+    void grow(const Vec3f &p)
+    {
+        lo = Vec3f(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+        hi = Vec3f(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+    }
+    void grow(const Bounds &b)
+    {
+        if (b.lo.x > b.hi.x) return;   //空桶
+        grow(b.lo);
+        grow(b.hi);
+    }
+    float area() const
+    {
+        Vec3f e = hi - lo;
+        return e.x < 0.f ? 0.f : e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+};
+
+//等分为 BINS 个桶的 SAH：遍历代价记为 1，每个三角形的求交代价记为 1
+static constexpr int BINS = 16;
+static constexpr int LEAF_SIZE = 4;         //不超过这个数量的三角形直接成为叶子
+static constexpr int MAX_DEPTH = 48;        //超过后只在叶子计数（uint16_t）存不下时继续按序号对半分
+//三角形数在 int 范围内，超过 MAX_DEPTH 后最多再对半分 16 次；遍历栈的深度不超过树深加一
+static constexpr int STACK_SIZE = MAX_DEPTH + 16 + 1;
+
+//延后到并行阶段建立的子树，depth 为其根节点在整棵树中的深度
+struct Subtree
+{
+    int node, begin, end, depth;
+};
+
+static void buildNode(std::vector<RayTracer::Node> &nodes, int ni,
+                      const std::vector<Prim> &prims, std::vector<int> &order,
+                      int begin, int end, int depth,
+                      int defer, std::vector<Subtree>* deferred)
+{
+    Bounds box, cbox;
+    for (int i = begin; i < end; i++)
+    {
+        const Prim &p = prims[order[i]];
+        box.grow(p.lo);
+        box.grow(p.hi);
+        cbox.grow(p.c);
+    }
+    RayTracer::Node &node = nodes[ni];
+    for (int k = 0; k < 3; k++)
+    {
+        node.lo[k] = box.lo[k];
+        node.hi[k] = box.hi[k];
+    }
+    node.first = begin;
+    node.count = (uint16_t)std::min(end - begin, 65535);
+    node.axis = 0;
+
+    int count = end - begin;
+    if (deferred && count <= defer)
+    {
+        deferred->push_back({ni, begin, end, depth});
+        return;
+    }
+    if (count <= LEAF_SIZE) return;
+    bool too_deep = depth >= MAX_DEPTH;
+    if (too_deep && count <= 65535) return;
+
+    //在中心跨度最大的轴上分桶
+    Vec3f extent = cbox.hi - cbox.lo;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    float lo = cbox.lo[axis], span = extent[axis];
+
+    int mid = begin + count / 2;
+    if (span > 0.f && !too_deep)
+    {
+        int bin_count[BINS] = {};
+        Bounds bin_box[BINS];
+        float scale = BINS / span;
+        auto binOf = [&](const Prim &p) { return std::min(BINS - 1, (int)((component(p.c, axis) - lo) * scale)); };
+        for (int i = begin; i < end; i++)
+        {
+            const Prim &p = prims[order[i]];
+            int b = binOf(p);
+            bin_count[b]++;
+            bin_box[b].grow(p.lo);
+            bin_box[b].grow(p.hi);
+        }
+
+        //从右向左累积右侧的面积与数量，再从左向右求每个划分的代价
+        float right_area[BINS];
+        int right_count[BINS];
+        Bounds acc;
+        int n = 0;
+        for (int b = BINS - 1; b > 0; b--)
+        {
+            acc.grow(bin_box[b]);
+            n += bin_count[b];
+            right_area[b] = acc.area();
+            right_count[b] = n;
+        }
+        float best = std::numeric_limits<float>::max();
+        int split = -1;
+        acc = Bounds();
+        n = 0;
+        for (int b = 0; b < BINS - 1; b++)
+        {
+            acc.grow(bin_box[b]);
+            n += bin_count[b];
+            if (n == 0 || right_count[b + 1] == 0) continue;
+            float cost = n * acc.area() + right_count[b + 1] * right_area[b + 1];
+            if (cost < best)
+            {
+                best = cost;
+                split = b;
+            }
+        }
+
+        float leaf_cost = (float)count;
+        if (split >= 0 && 1.f + best / box.area() < leaf_cost)
+        {
+            mid = (int)(std::partition(order.begin() + begin, order.begin() + end,
+                                       [&](int i) { return binOf(prims[i]) <= split; }) - order.begin());
+        }
+        else if (count <= 65535)
+        {
+            return;  //划分不划算，整体成为叶子
+        }
+    }
+    else
+    {
+        //中心重合时无法按位置划分，超过最大深度时不再划分；叶子计数存不下时都按序号对半分
+        if (count <= 65535) return;
+    }
+
+    int left = (int)nodes.size();
+    nodes.emplace_back();
+    nodes.emplace_back();
+    nodes[ni].first = left;
+    nodes[ni].count = 0;
+    nodes[ni].axis = (uint16_t)axis;
+    buildNode(nodes, left, prims, order, begin, mid, depth + 1, defer, deferred);
+    buildNode(nodes, left + 1, prims, order, mid, end, depth + 1, defer, deferred);
+}
+
+
+RayTracer::RayTracer(Model* m) : model(m)
+{
+    //收集三角形（面已拆分为三角形）
+    std::vector<Vec3i> corners;
+    for (int i = 0; i < model->nfaces(); i++)
+        for (auto &triangle : model->triangulate_face(i))
+            for (int j = 0; j < 3; j++) corners.push_back(triangle[j]);
+    int n = (int)corners.size() / 3;
+    if (n == 0) return;
+
+    std::vector<Prim> prims(n);
+    parallel_for(0, n, 1024, [&](int lo, int hi)
+    {
+        for (int i = lo; i < hi; i++)
+        {
+            Bounds b;
+            for (int j = 0; j < 3; j++) b.grow(model->getVert(corners[i * 3 + j][0]));
+            prims[i] = {b.lo, b.hi, (b.lo + b.hi) * .5f};
+        }
+    });
+
+    std::vector<int> order(n);
+    for (int i = 0; i < n; i++) order[i] = i;
+
+    //上层串行划分，规模足够小的子树记下来交给线程池并行建立，最后拼接回节点数组
+    int threads = parallel_threads();
+    int defer = threads > 1 ? std::max(n / (threads * 4), 256) : n + 1;
+    std::vector<Subtree> deferred;
+    nodes.reserve(2 * n);
+    nodes.emplace_back();
+    buildNode(nodes, 0, prims, order, 0, n, 0, defer, threads > 1 ? &deferred : nullptr);
+
+    std::vector<std::vector<Node>> subtrees(deferred.size());
+    parallel_run((int)deferred.size(), [&](int j)
+    {
+        const Subtree &s = deferred[j];
+        std::vector<Node> &sub = subtrees[j];
+        sub.reserve(2 * (s.end - s.begin));
+        sub.emplace_back();
+        buildNode(sub, 0, prims, order, s.begin, s.end, s.depth, 0, nullptr);
+    });
+    for (int j = 0; j < (int)deferred.size(); j++)
+    {
+        //子树的第 k 个节点（k >= 1）放到 base + k - 1
+        std::vector<Node> &sub = subtrees[j];
+        int base = (int)nodes.size();
+        for (Node &node : sub)
+            if (node.count == 0) node.first += base - 1;
+        nodes[deferred[j].node] = sub[0];
+        nodes.insert(nodes.end(), sub.begin() + 1, sub.end());
+    }
+
+    //三角形按叶子顺序重排，叶子内的三角形连续存放
+    geom.resize(n);
+    shade.resize(n);
+    parallel_for(0, n, 1024, [&](int lo, int hi)
+    {
+        for (int i = lo; i < hi; i++)
+        {
+            Vec3i* c = &corners[order[i] * 3];
+            Vec3f v0 = model->getVert(c[0][0]);
+            geom[i] = {v0, model->getVert(c[1][0]) - v0, model->getVert(c[2][0]) - v0};
+            for (int j = 0; j < 3; j++)
+            {
+                shade[i].n[j] = model->getNorm(c[j][2]);
+                shade[i].uv[j] = model->getUv(c[j][1]);
+            }
+        }
+    });
+}
+
+
+//---------------------------------------------------------------------------------------
+//遍历
+//光线包与节点包围盒的 slab 测试，返回在 (tmin, t) 内穿过包围盒的活动光线
+static inline float4 hitBox(const RayTracer::Node &n, const RayPacket &r)
+{
+    float4 tx0 = (float4(n.lo[0]) - r.o.x) * r.inv.x, tx1 = (float4(n.hi[0]) - r.o.x) * r.inv.x;
+    float4 ty0 = (float4(n.lo[1]) - r.o.y) * r.inv.y, ty1 = (float4(n.hi[1]) - r.o.y) * r.inv.y;
+    float4 tz0 = (float4(n.lo[2]) - r.o.z) * r.inv.z, tz1 = (float4(n.hi[2]) - r.o.z) * r.inv.z;
+    float4 tn = max(max(min(tx0, tx1), min(ty0, ty1)), max(min(tz0, tz1), r.tmin));
+    float4 tf = min(min(max(tx0, tx1), max(ty0, ty1)), min(max(tz0, tz1), r.t));
+    return (tn <= tf) & r.active;
+}
+
+//Möller–Trumbore，四条光线对一个三角形，双面
+static inline float4 hitTriangle(const RayTracer::TriangleGeom &g, RayPacket &r, int index)
+{
+    Vec3x4 e1(g.e1), e2(g.e2);
+    Vec3x4 p = cross(r.d, e2);
+    float4 inv = float4(1.f) / dot(e1, p);
+    Vec3x4 s = r.o - Vec3x4(g.v0);
+    float4 u = dot(s, p) * inv;
+    Vec3x4 q = cross(s, e1);
+    float4 v = dot(r.d, q) * inv;
+    float4 t = dot(e2, q) * inv;
+    //退化三角形 inv 为无穷，u、v 为无穷或 NaN，下面的比较都不成立
+    float4 hit = r.active & (u >= 0.f) & (v >= 0.f) & (u + v <= 1.f) & (t > r.tmin) & (t < r.t);
+    int m = bits(hit);
+    if (m)
+    {
+        r.t = blend(hit, t, r.t);
+        r.u = blend(hit, u, r.u);
+        r.v = blend(hit, v, r.v);
+        for (int k = 0; k < 4; k++)
+            if (m >> k & 1) r.tri[k] = index;
+    }
+    return hit;
+}
+
+//any 为 true 时只关心是否被遮挡：命中的光线立即退出，全部命中后结束遍历
+static void traverse(const std::vector<RayTracer::Node> &nodes, const std::vector<RayTracer::TriangleGeom> &geom,
+                     RayPacket &r, bool any)
+{
+    if (nodes.empty()) return;
+    int stack[STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp)
+    {
+        const RayTracer::Node &n = nodes[stack[--sp]];
+        int live = bits(hitBox(n, r));
+        if (!live) continue;
+        if (n.count)
+        {
+            for (int i = n.first; i < n.first + n.count; i++)
+            {
+                float4 hit = hitTriangle(geom[i], r, i);
+                if (any)
+                {
+                    r.active = andnot(hit, r.active);
+                    if (!bits(r.active)) return;
+                }
+            }
+        }
+        else
+        {
+            //以第一条穿过包围盒的光线的方向决定先访问哪个子节点
+            int lane = std::countr_zero((unsigned)live);
+            const float4 &d = n.axis == 0 ? r.d.x : (n.axis == 1 ? r.d.y : r.d.z);
+            int near = d[lane] < 0.f ? 1 : 0;
+            stack[sp++] = n.first + 1 - near;
+            stack[sp++] = n.first + near;
+        }
+    }
+}
+
+
+//---------------------------------------------------------------------------------------
+//着色
+//每像素分层采样的边长与每个采样的遮蔽光线数
+static void presetSamples(TracePreset preset, int &grid, int &ao)
+{
+    switch (preset)
+    {
+        case TracePreset::Fast:     grid = 1; ao = 0; break;
+        case TracePreset::Quality:  grid = 3; ao = 4; break;
+        default:                    grid = 2; ao = 2; break;
+    }
+}
+
+//整数哈希，给每个像素一个不同的遮蔽采样旋转，避免条纹
+static inline uint32_t hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+//以 n 为轴的余弦加权半球方向，(r1, r2) ∈ [0,1)²
+static inline Vec3f cosineDirection(const Vec3f &n, float r1, float r2)
+{
+    //n 的正交基（Duff 等人的无分支构造）
+    float sign = n.z >= 0.f ? 1.f : -1.f;
+    float a = -1.f / (sign + n.z), b = n.x * n.y * a;
+    Vec3f t(1.f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    Vec3f s(b, sign + n.y * n.y * a, -n.y);
+    float phi = 6.28318531f * r1, r = std::sqrt(r2);
+    return t * (r * std::cos(phi)) + s * (r * std::sin(phi)) + n * std::sqrt(1.f - r2);
+}
+
+RenderStats RayTracer::render(Matrix &ViewPort, Matrix &Projection, Matrix &Rotation,
+                              Vec3f &light_dir,
+                              float ambient_light,
+                              int width,
+                              int height,
+                              Zbuffer &zbuffer,
+                              TGAImage* image,
+                              const RenderOptions &options,
+                              const TraceOptions &trace)
+{
+    RenderStats stats;
+    if (geom.empty() || Projection[3][2] >= 0.f) return stats;
+
+    CameraRays camera(ViewPort, Projection, Rotation);
+    auto toObject = [&Rotation](const Vec3f &v)
+    {
+        return Vec3f(Rotation[0][0] * v.x + Rotation[1][0] * v.y + Rotation[2][0] * v.z,
+                     Rotation[0][1] * v.x + Rotation[1][1] * v.y + Rotation[2][1] * v.z,
+                     Rotation[0][2] * v.x + Rotation[1][2] * v.y + Rotation[2][2] * v.z);
+    };
+    const Vec3f light = toObject(light_dir), half = toObject(options.half);
+    const bool specular = options.shading == Shading::BlinnPhong;
+    //有 HDR 渲染目标时累加不截断的线性颜色写入它，否则写 8 位画布
+    HdrBuffer* hdr = options.hdr;
+    const PowTable spec_pow(options.shininess);
+
+    int grid, ao_rays;
+    presetSamples(trace.preset, grid, ao_rays);
+    const int samples = grid * grid;
+    //自相交偏移，按模型尺度取
+    const float eps = 1e-4f * std::max({nodes[0].hi[0] - nodes[0].lo[0], nodes[0].hi[1] - nodes[0].lo[1], nodes[0].hi[2] - nodes[0].lo[2]});
+    const float inf = std::numeric_limits<float>::max();
+
+    constexpr int TILE = 16;
+    static_assert(TILE % Zbuffer::TILE == 0, "a Hi-Z tile must belong to a single trace tile");
+    const int tiles_x = (width + TILE - 1) / TILE, tiles_y = (height + TILE - 1) / TILE;
+    std::atomic<unsigned long long> shaded(0), covered(0), tested(0), passed(0);
+    //每个 Hi-Z tile 写入的最近深度，只由所在的追踪 tile 写，结束后再串行地交给 markTile
+    std::vector<uint32_t> tile_near(zbuffer.tiles_x * zbuffer.tiles_y, 0u);
+
+    parallel_steal(tiles_x * tiles_y, [&](int tile)
+    {
+        unsigned long long count = 0, filled = 0, tests = 0, passes = 0;
+        int tx0 = (tile % tiles_x) * TILE, ty0 = (tile / tiles_x) * TILE;
+        int tx1 = std::min(tx0 + TILE, width), ty1 = std::min(ty0 + TILE, height);
+
+        //每次处理 2x2 个像素，同一采样位置的四条主光线组成一个包
+        for (int y = ty0; y < ty1; y += 2)
+            for (int x = tx0; x < tx1; x += 2)
+            {
+                int lanes = 0;
+                for (int k = 0; k < 4; k++)
+                    if (x + (k & 1) < tx1 && y + (k >> 1) < ty1) lanes |= 1 << k;
+
+                //每个采样分别与进入时的深度比较，被已有内容遮挡的采样与未命中的一样取画布原有的颜色
+                uint32_t old[4] = {}, nearest[4] = {};
+                for (int k = 0; k < 4; k++)
+                    if (lanes >> k & 1) old[k] = zbuffer.buffer[x + (k & 1) + (y + (k >> 1)) * width];
+                float color[4][3] = {};
+                int hits[4] = {};
+                for (int s = 0; s < samples; s++)
+                {
+                    float jx = ((s % grid) + .5f) / grid, jy = ((s / grid) + .5f) / grid;
+                    float a[4], b[4];
+                    RayPacket primary;
+                    Vec3f dir[4];
+                    for (int k = 0; k < 4; k++)
+                    {
+                        a[k] = camera.ndcX(x + (k & 1) + jx);
+                        b[k] = camera.ndcY(y + (k >> 1) + jy);
+                        dir[k] = camera.direction(a[k], b[k]);
+                    }
+                    primary.o = Vec3x4(camera.origin);
+                    primary.d = Vec3x4(float4(dir[0].x, dir[1].x, dir[2].x, dir[3].x),
+                                       float4(dir[0].y, dir[1].y, dir[2].y, dir[3].y),
+                                       float4(dir[0].z, dir[1].z, dir[2].z, dir[3].z));
+                    primary.init(lanes, inf);
+                    traverse(nodes, geom, primary, false);
+
+                    //交点的法线、纹理与光照；阴影与遮蔽光线同样四条一组
+                    Vec3f pos[4], ng[4], ns[4];
+                    float ndotl[4] = {}, lit[4] = {1.f, 1.f, 1.f, 1.f}, ao[4] = {1.f, 1.f, 1.f, 1.f};
+                    int shadow_lanes = 0, ao_lanes = 0;
+                    for (int k = 0; k < 4; k++)
+                    {
+                        int i = primary.tri[k];
+                        if (i < 0) continue;
+                        float t = primary.t[k], u = primary.u[k], v = primary.v[k];
+                        uint32_t d = zbuffer.encode(camera.depth(a[k], b[k], t));
+                        tests++;
+                        if (d <= old[k])
+                        {
+                            primary.tri[k] = -1;
+                            continue;
+                        }
+                        passes++;
+                        nearest[k] = std::max(nearest[k], d);
+                        pos[k] = camera.origin + dir[k] * t;
+                        Vec3f g = geom[i].e1 ^ geom[i].e2;
+                        g.normalize();
+                        const TriangleShade &sh = shade[i];
+                        Vec3f n = options.shading == Shading::Flat ? g : sh.n[0] * (1.f - u - v) + sh.n[1] * u + sh.n[2] * v;
+                        n.normalize();
+                        //双面：几何法线朝向视点，着色法线随之翻转
+                        if (g * dir[k] > 0.f) { g = g * -1.f; n = n * -1.f; }
+                        ng[k] = g;
+                        ns[k] = n;
+                        ndotl[k] = std::max(n * light, 0.f);
+                        //几何法线背光而插值法线仍朝光的交点位于明暗交界线上，不发阴影光线以免自遮挡出棱角
+                        if (trace.shadows && ndotl[k] > 0.f && g * light > 0.f) shadow_lanes |= 1 << k;
+                        ao_lanes |= 1 << k;
+                    }
+                    if (!ao_lanes) continue;
+
+                    auto offsetOrigin = [&](RayPacket &r)
+                    {
+                        Vec3f o[4];
+                        for (int k = 0; k < 4; k++) o[k] = pos[k] + ng[k] * eps;
+                        r.o = Vec3x4(float4(o[0].x, o[1].x, o[2].x, o[3].x),
+                                     float4(o[0].y, o[1].y, o[2].y, o[3].y),
+                                     float4(o[0].z, o[1].z, o[2].z, o[3].z));
+                    };
+
+                    if (shadow_lanes)
+                    {
+                        RayPacket shadow;
+                        offsetOrigin(shadow);
+                        shadow.d = Vec3x4(light);
+                        shadow.init(shadow_lanes, inf);
+                        traverse(nodes, geom, shadow, true);
+                        for (int k = 0; k < 4; k++)
+                            if (shadow.tri[k] >= 0) lit[k] = 0.f;
+                    }
+
+                    if (ao_rays && ambient_light > 0.f)
+                    {
+                        int open[4] = {};
+                        for (int j = 0; j < ao_rays; j++)
+                        {
+                            Vec3f d[4];
+                            for (int k = 0; k < 4; k++)
+                            {
+                                if (!(ao_lanes >> k & 1)) { d[k] = Vec3f(0.f, 0.f, 1.f); continue; }
+                                //分层的 (r1, r2) 加上每个像素的随机旋转
+                                uint32_t h = hash((uint32_t)(x + (k & 1)) * 73856093u ^ (uint32_t)(y + (k >> 1)) * 19349663u ^ (uint32_t)s * 83492791u);
+                                float r1 = ((j + .5f) / ao_rays + (h & 0xffff) / 65536.f);
+                                float r2 = (h >> 16) / 65536.f;
+                                d[k] = cosineDirection(ns[k] * ng[k] > 0.f ? ns[k] : ng[k], r1 - (int)r1, r2);
+                                //绕插值法线采样的方向可能低于三角形平面，镜像回上方，避免打到相邻面片
+                                float below = d[k] * ng[k];
+                                if (below < 0.f) d[k] = d[k] - ng[k] * (2.f * below);
+                            }
+                            RayPacket occl;
+                            offsetOrigin(occl);
+                            occl.d = Vec3x4(float4(d[0].x, d[1].x, d[2].x, d[3].x),
+                                            float4(d[0].y, d[1].y, d[2].y, d[3].y),
+                                            float4(d[0].z, d[1].z, d[2].z, d[3].z));
+                            occl.init(ao_lanes, trace.ao_distance);
+                            traverse(nodes, geom, occl, true);
+                            for (int k = 0; k < 4; k++) open[k] += occl.tri[k] < 0;
+                        }
+                        for (int k = 0; k < 4; k++) ao[k] = (float)open[k] / ao_rays;
+                    }
+
+                    for (int k = 0; k < 4; k++)
+                    {
+                        int i = primary.tri[k];
+                        if (i < 0) continue;
+                        float u = primary.u[k], v = primary.v[k];
+                        const TriangleShade &sh = shade[i];
+                        Vec2f uv = sh.uv[0] * (1.f - u - v) + sh.uv[1] * u + sh.uv[2] * v;
+                        TGAColor tex = sampleDiffuse(model, uv.x, uv.y);
+                        float diffuse = 1.f, spec = 0.f;
+                        if (options.shading != Shading::Unlit)
+                        {
+                            diffuse = ndotl[k] * lit[k] + ambient_light * ao[k];
+                            if (specular && lit[k] > 0.f)
+                                spec = options.specular * spec_pow(std::min(std::max(ns[k] * half, 0.f), 1.f));
+                        }
+                        if (hdr)
+                        {
+                            Vec4f r = radianceOf(tex, diffuse) + Vec4f(spec, spec, spec, 0.f);
+                            color[k][0] += r.x;
+                            color[k][1] += r.y;
+                            color[k][2] += r.z;
+                        }
+                        else
+                        {
+                            TGAColor c = options.shading != Shading::Unlit ? litColor(tex, std::min(diffuse, 1.f), spec) : tex;
+                            for (int ch = 0; ch < 3; ch++) color[k][ch] += c.bgra[ch];
+                        }
+                        hits[k]++;
+                        count++;
+                    }
+                }
+
+                //有采样通过的像素写入最近的采样深度；没有通过的采样按画布原有的背景计入平均，边缘因此抗锯齿
+                for (int k = 0; k < 4; k++)
+                {
+                    if (!hits[k]) continue;
+                    int px = x + (k & 1), py = y + (k >> 1);
+                    zbuffer.buffer[px + py * width] = nearest[k];
+                    filled += old[k] == 0u;
+                    uint32_t &znear = tile_near[px / Zbuffer::TILE + py / Zbuffer::TILE * zbuffer.tiles_x];
+                    znear = std::max(znear, nearest[k]);
+
+                    float bg = (float)(samples - hits[k]);
+                    if (hdr)
+                    {
+                        int idx = px + py * width;
+                        Vec4f c = hits[k] < samples ? hdr->load(idx) : Vec4f();
+                        hdr->store(idx, Vec4f((color[k][0] + c.x * bg) / samples, (color[k][1] + c.y * bg) / samples, (color[k][2] + c.z * bg) / samples, 1.f));
+                        continue;
+                    }
+                    TGAColor c = hits[k] < samples ? image->get(px, py) : TGAColor(0, 0, 0);
+                    for (int ch = 0; ch < 3; ch++) c.bgra[ch] = (unsigned char)((color[k][ch] + c.bgra[ch] * bg) / samples + .5f);
+                    image->set(px, py, c);
+                }
+            }
+        shaded += count;
+        covered += filled;
+        tested += tests;
+        passed += passes;
+    });
+
+    //直接写了深度缓冲，把写过的 tile 按实际的最近深度标记为脏，Hi-Z 的整块接受仍然可用
+    for (int ty = 0; ty < zbuffer.tiles_y; ty++)
+        for (int tx = 0; tx < zbuffer.tiles_x; tx++)
+            if (uint32_t znear = tile_near[tx + ty * zbuffer.tiles_x]) zbuffer.markTile(tx, ty, znear);
+
+    stats.shaded = shaded;
+    stats.covered = covered;
+    zbuffer.stats.tested += tested;
+    zbuffer.stats.passed += passed;
+    zbuffer.stats.filled += stats.covered;
+    return stats;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+
+#include <cstdint>
+#include <vector>
+
+#include "SolarGL.h"
+
+
+
+//---------------------------------------------------------------------------------------
+//ray tracer
+//与 render() 并列的第二个渲染引擎：在模型三角形上并行地建立 SAH 包围体层次（BVH），
+//以四条光线一组的包（packet）追踪主光线、朝 light_dir 的阴影光线与环境光遮蔽光线。
+//图像按 tile 分给线程池，线程做完自己的 tile 后从其它线程的末尾窃取。
+//输出同样写入 TGAImage（有 RenderOptions::hdr 时写入 HDR 渲染目标）与 Zbuffer，纹理通过 Model 采样。每个采样都与 Zbuffer 中已有的深度比较，
+//被遮挡与未命中的采样取画布原有的颜色，因此可以和光栅化的绘制在同一帧内混合
+
+//质量与速度的预设，决定每像素的采样数与每个采样的环境光遮蔽光线数
+enum class TracePreset
+{
+    Fast,           //每像素 1 个采样，只有阴影
+    Balanced,       //2x2 分层采样，每个采样 2 条遮蔽光线
+    Quality         //3x3 分层采样，每个采样 4 条遮蔽光线
+};
+
+struct TraceOptions
+{
+    TracePreset preset = TracePreset::Balanced;
+    bool shadows = true;
+    float ao_distance = .5f;    //遮蔽光线的最大长度，模型空间单位
+};
+
+class RayTracer
+{
+public:
+    //BVH 节点，两个子节点相邻存放在 first、first + 1；count > 0 时为叶子，覆盖三角形 [first, first + count)
+    struct Node
+    {
+        float lo[3], hi[3];
+        int first;
+        uint16_t count;
+        uint16_t axis;      //内部节点的划分轴，遍历时按光线方向先访问近的子节点
+    };
+
+    //求交用的数据：一个顶点与两条边，按 BVH 叶子顺序存放
+    struct TriangleGeom
+    {
+        Vec3f v0, e1, e2;
+    };
+
+    //着色用的数据：顶点法线与纹素坐标，与 TriangleGeom 同序
+    struct TriangleShade
+    {
+        Vec3f n[3];
+        Vec2f uv[3];
+    };
+
+    //在模型空间建立 BVH，模型在各帧之间只有旋转，BVH 只建一次
+    explicit RayTracer(Model* model);
+
+    RenderStats render(Matrix &ViewPort, Matrix &Projection, Matrix &Rotation,
+                       Vec3f &light_dir,
+                       float ambient_light,
+                       int width,
+                       int height,
+                       Zbuffer &zbuffer,
+                       TGAImage* image,
+                       const RenderOptions &options,
+                       const TraceOptions &trace = TraceOptions());
+
+    int nodeCount() const { return (int)nodes.size(); }
+    int triangleCount() const { return (int)geom.size(); }
+
+private:
+    Model* model;
+    std::vector<Node> nodes;
+    std::vector<TriangleGeom> geom;
+    std::vector<TriangleShade> shade;
+};
@@ -0,0 +1,282 @@
+#pragma once
+
+
+#include <cmath>
+#include <utility>
+
+#include "SolarGL.h"
+#include "simd.h"
+
+
+
+//---------------------------------------------------------------------------------------
+//shader
+//着色器是策略类型，渲染管线按着色器模板实例化，每种光照模型都编译成各自的内循环，
+//新增光照模型不会给其它模型的热路径带来任何分支。一个着色器需要提供：
+//  Varying                                  插值属性类型，Varyings<N>
+//  void vertex(const VertexIn&, Varying &out) 顶点阶段：由顶点输入写出插值属性
+//  void setup(Varying v[3])                 三角形建立阶段：可以改写三个顶点的插值属性
+//  TGAColor fragment(const Varying &in)     片元阶段：由插值后的属性计算颜色
+//受光照的着色器另外提供 shade(in, visibility)，visibility 为阴影查询得到的直接光照比例，
+//fragment(in) 即 shade(in, 1)；Shadowed<Shader> 用它接入阴影贴图。
+//HDR 渲染目标调用 Vec4f radiance(in, visibility)：与 shade 相同的光照，但输出不截断的线性浮点颜色
+
+//N 个浮点插值属性，支持裁剪与重心插值需要的线性运算
+//运算通过整数序列展开成 N 条独立语句，不依赖编译器展开循环，逐像素步进时属性可以留在寄存器里
+template <int N> struct Varyings
+{
+    static constexpr int size = N;
+    float v[N];
+
+    template <class F, int... I>
+    static Varyings<N> map(F f, std::integer_sequence<int, I...>) { return Varyings<N>{{f(I)...}}; }
+
+    Varyings<N> operator +(const Varyings<N>& o) const { return map([&](int i) { return v[i] + o.v[i]; }, std::make_integer_sequence<int, N>()); }
+    Varyings<N> operator -(const Varyings<N>& o) const { return map([&](int i) { return v[i] - o.v[i]; }, std::make_integer_sequence<int, N>()); }
+    Varyings<N> operator *(float f)              const { return map([&](int i) { return v[i] * f; }, std::make_integer_sequence<int, N>()); }
+    float& operator[](const int i) { return v[i]; }
+    const float& operator[](const int i) const { return v[i]; }
+};
+
+//顶点阶段的输入，漫反射强度由每帧的光照阶段批量算好
+struct VertexIn
+{
+    Vec3f norm;     //单位法线，模型空间
+    Vec2f uv;       //纹素坐标
+    float intensity;    //max(norm·light_dir, 0)
+    Vec3f pos;          //模型空间位置
+};
+
+//所有着色器共用的统一参数
+struct ShaderUniforms
+{
+    Model* model;
+    Vec3f light_dir;        //指向光源的单位向量，已变换到模型空间
+    Vec3f half;             //Blinn-Phong 半程向量，模型空间
+    float ambient_light;
+    float specular;         //高光强度
+    float shininess;        //高光指数
+    const ShadowMap* shadow = nullptr;  //Shadowed 着色器使用的阴影贴图
+};
+
+//纹理颜色乘以漫反射系数后加上白色高光，逐通道截断
+inline TGAColor litColor(const TGAColor &c, float diffuse, float specular)
+{
+    TGAColor res = c;
+    float s = specular * 255.f;
+    for (int i = 0; i < 3; i++)
+    {
+        float v = c.bgra[i] * diffuse + s;
+        res.bgra[i] = (unsigned char)(v < 255.f ? v : 255.f);
+    }
+    return res;
+}
+
+//近似 1/sqrt(x)：SSE 的 rsqrtss 约 12 位精度，再做一次牛顿迭代到约 22 位
+inline float fastRsqrt(float x)
+{
+#ifdef SIMD_SSE2
+    float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return y * (1.5f - .5f * x * y * y);
+#else
+    return 1.f / std::sqrt(x);
+#endif
+}
+
+//[0,1] 上 x^e 的查找表，片元中用线性插值代替 pow
+struct PowTable
+{
+    static constexpr int SIZE = 1024;
+    float t[SIZE + 2];
+
+    explicit PowTable(float e)
+    {
+        for (int i = 0; i <= SIZE; i++)
+        {
+            t[i] = std::pow((float)i / SIZE, e);
+            if (t[i] < 1e-20f) t[i] = 0.f;  //避免高指数下出现非规格化数，运算极慢
+        }
+        t[SIZE + 1] = t[SIZE];
+    }
+
+    float operator()(float x) const
+    {
+        float f = x * SIZE;
+        int i = (int)f;
+        return t[i] + (t[i + 1] - t[i]) * (f - i);
+    }
+};
+
+inline TGAColor sampleDiffuse(Model* model, float u, float v)
+{
+    return model->diffuse(Vec2i((int)u, (int)v));
+}
+
+//纹理颜色乘以系数得到线性浮点颜色，通道顺序同 TGAColor，1 对应 8 位的 255，不截断；alpha 为 1 表示已覆盖
+inline Vec4f radianceOf(const TGAColor &c, float k)
+{
+    k *= 1.f / 255.f;
+    return Vec4f(c.bgra[0] * k, c.bgra[1] * k, c.bgra[2] * k, 1.f);
+}
+
+
+//只有纹理颜色，不受光照影响
+struct UnlitShader
+{
+    typedef Varyings<2> Varying;   // u, v
+    const ShaderUniforms &u;
+
+    explicit UnlitShader(const ShaderUniforms &uniforms) : u(uniforms) {}
+
+    void vertex(const VertexIn &in, Varying &out) const { out[0] = in.uv.x; out[1] = in.uv.y; }
+    void setup(Varying *) const {}
+    TGAColor fragment(const Varying &in) const { return sampleDiffuse(u.model, in[0], in[1]); }
+    Vec4f radiance(const Varying &in, float = 1.f) const { return radianceOf(sampleDiffuse(u.model, in[0], in[1]), 1.f); }
+};
+
+//顶点计算光照并插值（原有的着色方式）
+struct GouraudShader
+{
+    typedef Varyings<3> Varying;   // u, v, intensity
+    const ShaderUniforms &u;
+
+    explicit GouraudShader(const ShaderUniforms &uniforms) : u(uniforms) {}
+
+    void vertex(const VertexIn &in, Varying &out) const
+    {
+        out[0] = in.uv.x;
+        out[1] = in.uv.y;
+        out[2] = in.intensity;
+    }
+    void setup(Varying *) const {}
+    TGAColor shade(const Varying &in, float visibility) const
+    {
+        float ity = in[2] * visibility;
+        return sampleDiffuse(u.model, in[0], in[1]) * (ity > 0 ? (ity + u.ambient_light) : u.ambient_light);
+    }
+    TGAColor fragment(const Varying &in) const { return shade(in, 1.f); }
+    Vec4f radiance(const Varying &in, float visibility = 1.f) const
+    {
+        float ity = in[2] * visibility;
+        return radianceOf(sampleDiffuse(u.model, in[0], in[1]), (ity > 0 ? ity : 0.f) + u.ambient_light);
+    }
+};
+
+//每个三角形使用三个顶点光照的平均值
+struct FlatShader : GouraudShader
+{
+    using GouraudShader::GouraudShader;
+
+    void setup(Varying *v) const
+    {
+        float ity = (v[0][2] + v[1][2] + v[2][2]) / 3.f;
+        v[0][2] = v[1][2] = v[2][2] = ity;
+    }
+};
+
+//逐像素漫反射：插值法线，片元中用近似 rsqrt 归一化
+struct PhongShader
+{
+    typedef Varyings<5> Varying;   // u, v, nx, ny, nz
+    const ShaderUniforms &u;
+
+    explicit PhongShader(const ShaderUniforms &uniforms) : u(uniforms) {}
+
+    void vertex(const VertexIn &in, Varying &out) const
+    {
+        out[0] = in.uv.x;
+        out[1] = in.uv.y;
+        out[2] = in.norm.x;
+        out[3] = in.norm.y;
+        out[4] = in.norm.z;
+    }
+    void setup(Varying *) const {}
+    TGAColor shade(const Varying &in, float visibility) const
+    {
+        Vec3f n(in[2], in[3], in[4]);
+        float diff = std::max(n * u.light_dir, 0.f) * fastRsqrt(n * n) * visibility;
+        return sampleDiffuse(u.model, in[0], in[1]) * (diff + u.ambient_light);
+    }
+    TGAColor fragment(const Varying &in) const { return shade(in, 1.f); }
+    Vec4f radiance(const Varying &in, float visibility = 1.f) const
+    {
+        Vec3f n(in[2], in[3], in[4]);
+        float diff = std::max(n * u.light_dir, 0.f) * fastRsqrt(n * n) * visibility;
+        return radianceOf(sampleDiffuse(u.model, in[0], in[1]), diff + u.ambient_light);
+    }
+};
+
+//逐像素 Blinn-Phong：漫反射加半程向量高光，高光指数查表
+struct BlinnPhongShader : PhongShader
+{
+    PowTable spec_pow;
+
+    explicit BlinnPhongShader(const ShaderUniforms &uniforms) : PhongShader(uniforms), spec_pow(uniforms.shininess) {}
+
+    TGAColor shade(const Varying &in, float visibility) const
+    {
+        Vec3f n(in[2], in[3], in[4]);
+        //不必归一化整个法线，只把两个点积乘以 1/|n|
+        float rn = fastRsqrt(n * n);
+        float ndotl = n * u.light_dir * rn * visibility;
+        if (ndotl <= 0.f) return sampleDiffuse(u.model, in[0], in[1]) * u.ambient_light;
+        float ndoth = std::min(std::max(n * u.half * rn, 0.f), 1.f);
+        float spec = u.specular * spec_pow(ndoth) * visibility;
+        return litColor(sampleDiffuse(u.model, in[0], in[1]), std::min(ndotl + u.ambient_light, 1.f), spec);
+    }
+    TGAColor fragment(const Varying &in) const { return shade(in, 1.f); }
+    //漫反射不再截断到 1，高光直接叠加
+    Vec4f radiance(const Varying &in, float visibility = 1.f) const
+    {
+        Vec3f n(in[2], in[3], in[4]);
+        float rn = fastRsqrt(n * n);
+        float ndotl = n * u.light_dir * rn * visibility;
+        if (ndotl <= 0.f) return radianceOf(sampleDiffuse(u.model, in[0], in[1]), u.ambient_light);
+        float ndoth = std::min(std::max(n * u.half * rn, 0.f), 1.f);
+        float spec = u.specular * spec_pow(ndoth) * visibility;
+        return radianceOf(sampleDiffuse(u.model, in[0], in[1]), ndotl + u.ambient_light) + Vec4f(spec, spec, spec, 0.f);
+    }
+};
+
+//阴影包装：在基础着色器的插值属性后追加阴影贴图坐标（模型空间中线性，透视校正插值是精确的），
+//片元中做 PCF 查询，只衰减直接光照，环境光不受影响
+template <class Base>
+struct Shadowed : Base
+{
+    static constexpr int N = Base::Varying::size;
+    typedef Varyings<N + 3> Varying;
+
+    using Base::Base;
+
+    void vertex(const VertexIn &in, Varying &out) const
+    {
+        typename Base::Varying b;
+        Base::vertex(in, b);
+        for (int i = 0; i < N; i++) out[i] = b[i];
+        Vec3f s = this->u.shadow->receiver(in.pos, in.norm);
+        out[N] = s.x;
+        out[N + 1] = s.y;
+        out[N + 2] = s.z;
+    }
+    void setup(Varying *v) const
+    {
+        typename Base::Varying b[3];
+        for (int k = 0; k < 3; k++)
+            for (int i = 0; i < N; i++) b[k][i] = v[k][i];
+        Base::setup(b);
+        for (int k = 0; k < 3; k++)
+            for (int i = 0; i < N; i++) v[k][i] = b[k][i];
+    }
+    TGAColor fragment(const Varying &in) const
+    {
+        typename Base::Varying b;
+        for (int i = 0; i < N; i++) b[i] = in[i];
+        return Base::shade(b, this->u.shadow->lit(in[N], in[N + 1], in[N + 2]));
+    }
+    Vec4f radiance(const Varying &in, float = 1.f) const
+    {
+        typename Base::Varying b;
+        for (int i = 0; i < N; i++) b[i] = in[i];
+        return Base::radiance(b, this->u.shadow->lit(in[N], in[N + 1], in[N + 2]));
+    }
+};
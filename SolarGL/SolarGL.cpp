@@ -1,7 +1,14 @@
-﻿#include <cassert>
+﻿#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstring>
 #include <filesystem>
+#include <limits>
 
 #include "SolarGL.h"
+#include "Shader.h"
+#include "parallel.h"
+#include "simd.h"
 
 namespace fs = std::filesystem;
 
@@ -83,7 +90,7 @@ std::ostream& operator<<(std::ostream& s, Matrix& m)
 
 //-----------------------------------------------------------------------------
 //model
-Model::Model(const char* filename) : verts_(), faces_(), norms_(), uv_(), diffusemap_()
+Model::Model(const char* filename, const char* texture_suffix) : verts_(), faces_(), norms_(), uv_(), diffusemap_()
 {
     std::ifstream in;
     in.open(filename, std::ifstream::in);
@@ -137,7 +144,43 @@ Model::Model(const char* filename) : verts_(), faces_(), norms_(), uv_(), diffus
         }
     }
 
-    load_texture(filename, ".tga", diffusemap_);
+    //法线只在载入时归一化一次，同时建立 SoA 副本
+    int padded = ((int)norms_.size() + 3) & ~3;
+    nx_.assign(padded, 0.f);
+    ny_.assign(padded, 0.f);
+    nz_.assign(padded, 0.f);
+    for (int i = 0; i < (int)norms_.size(); i++)
+    {
+        norms_[i].normalize();
+        nx_[i] = norms_[i].x;
+        ny_[i] = norms_[i].y;
+        nz_[i] = norms_[i].z;
+    }
+
+    //球体拟合，供解析求交路径使用
+    if (!verts_.empty())
+    {
+        Vec3f lo = verts_[0], hi = verts_[0];
+        for (const Vec3f &v : verts_)
+        {
+            lo = Vec3f(std::min(lo.x, v.x), std::min(lo.y, v.y), std::min(lo.z, v.z));
+            hi = Vec3f(std::max(hi.x, v.x), std::max(hi.y, v.y), std::max(hi.z, v.z));
+        }
+        sphere_center_ = (lo + hi) * .5f;
+        float rmin = std::numeric_limits<float>::max(), rmax = 0.f, rsum = 0.f;
+        for (const Vec3f &v : verts_)
+        {
+            float r = (v - sphere_center_).norm();
+            rmin = std::min(rmin, r);
+            rmax = std::max(rmax, r);
+            rsum += r;
+        }
+        sphere_radius_ = rsum / verts_.size();
+        if (sphere_radius_ > 0.f) sphere_error_ = (rmax - rmin) / sphere_radius_;
+        bound_radius_ = rmax;
+    }
+
+    load_texture(filename, texture_suffix, diffusemap_);
 }
 
 Model::~Model() {}
@@ -145,6 +188,8 @@ Model::~Model() {}
 
 int Model::nfaces() {return (int)faces_.size();}
 
+int Model::nverts() {return (int)verts_.size();}
+
 std::vector<int> Model::face(int idx)
 {
     std::vector<int> face;
@@ -164,16 +209,50 @@ void Model::load_texture(std::string filename, const char *suffix, TGAImage &img
     if (dot!=std::string::npos)
     {
         texfile = texfile.substr(0,dot) + std::string(suffix);
-        std::cerr << "texture file " << texfile << " loading " << std::endl << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
-        img.flip_vertically();
+        //未压缩的纹理直接映射文件只读使用；扫描线保持文件中的顺序，不做翻转，由 diffuse() 按原点换算
+        //QOI 纹理解码后原点在左上角，同样由 diffuse() 换算
+        bool ok = texfile.ends_with(".qoi") ? img.read_qoi_file(texfile.c_str()) : img.map_tga_file(texfile.c_str());
+        std::cerr << "texture file " << texfile << " loading " << std::endl << (ok ? "ok" : "failed") << std::endl;
     }
 }
 
-TGAColor Model::diffuse(Vec2i uv) {return diffusemap_.get(uv.x , uv.y);}
+//纹理坐标 v 自下而上，原点在左上角的纹理需要倒过来取行
+TGAColor Model::diffuse(Vec2i uv)
+{
+    int y = diffusemap_.get_origin() == TGAImage::BOTTOM_LEFT ? uv.y : diffusemap_.get_height() - 1 - uv.y;
+    return diffusemap_.get(uv.x, y);
+}
+
+Vec2f Model::getUv(int idx){return texel(uv_[idx]);}
+
+Vec2f Model::texel(const Vec2f &uv){return Vec2f(uv.x * diffusemap_.get_width(), uv.y * diffusemap_.get_height());}
 
-Vec2i Model::getUv(int idx){return Vec2i(uv_[idx].x * diffusemap_.get_width(), uv_[idx].y * diffusemap_.get_height());}
+//少于 64 个顶点时即使等距也不当作球体，例如立方体、正二十面体
+bool Model::isSphere(float tolerance){return verts_.size() >= 64 && sphere_error_ <= tolerance;}
 
-Vec3f Model::getNorm(int idx){return norms_[idx].normalize();}
+int Model::nnorms() {return (int)norms_.size();}
+
+Vec3f Model::getNorm(int idx){return norms_[idx];}
+
+void Model::lighting(const Vec3f &light, std::vector<float> &intensity)
+{
+    int padded = (int)nx_.size();
+    intensity.resize(padded);
+#ifdef SIMD_SSE2
+    __m128 lx = _mm_set1_ps(light.x), ly = _mm_set1_ps(light.y), lz = _mm_set1_ps(light.z);
+    __m128 zero = _mm_setzero_ps();
+    for (int i = 0; i < padded; i += 4)
+    {
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&nx_[i]), lx),
+                                         _mm_mul_ps(_mm_loadu_ps(&ny_[i]), ly)),
+                              _mm_mul_ps(_mm_loadu_ps(&nz_[i]), lz));
+        _mm_storeu_ps(&intensity[i], _mm_max_ps(d, zero));
+    }
+#else
+    for (int i = 0; i < padded; i++)
+        intensity[i] = std::max(nx_[i] * light.x + ny_[i] * light.y + nz_[i] * light.z, 0.f);
+#endif
+}
 
 std::vector<std::vector<Vec3i>> Model::triangulate_face(int idx)
 {
@@ -193,8 +272,659 @@ std::vector<std::vector<Vec3i>> Model::triangulate_face(int idx)
     return triangles;
 }
 
+//-----------------------------------------------------------------------------
+//zbuffer
+Zbuffer::Zbuffer(const int w, const int h, DepthFormat fmt) : width(w), height(h), format(fmt), buffer(w * h, 0u)
+{
+    tiles_x  = (width  + TILE - 1) / TILE;
+    tiles_y  = (height + TILE - 1) / TILE;
+    blocks_x = (tiles_x + BLOCK - 1) / BLOCK;
+    blocks_y = (tiles_y + BLOCK - 1) / BLOCK;
+    tile_far.assign(tiles_x * tiles_y, 0u);
+    tile_near.assign(tiles_x * tiles_y, 0u);
+    tile_dirty.assign(tiles_x * tiles_y, 0);
+    block_far.assign(blocks_x * blocks_y, 0u);
+    block_dirty.assign(blocks_x * blocks_y, 0);
+}
+
+void Zbuffer::fresh()
+{
+    //reverse-Z 清空为 0（无穷远）
+    std::fill(buffer.begin(), buffer.end(), 0u);
+    std::fill(tile_far.begin(), tile_far.end(), 0u);
+    std::fill(tile_near.begin(), tile_near.end(), 0u);
+    std::fill(tile_dirty.begin(), tile_dirty.end(), 0);
+    std::fill(block_far.begin(), block_far.end(), 0u);
+    std::fill(block_dirty.begin(), block_dirty.end(), 0);
+}
+
+uint32_t Zbuffer::tileFar(int tx, int ty)
+{
+    int t = tx + ty * tiles_x;
+    if (tile_dirty[t])
+    {
+        int x0 = tx * TILE, x1 = std::min(x0 + TILE, width);
+        int y0 = ty * TILE, y1 = std::min(y0 + TILE, height);
+        uint32_t m = std::numeric_limits<uint32_t>::max();
+        for (int y = y0; y < y1; y++)
+        {
+            const uint32_t *row = buffer.data() + y * width;
+            for (int x = x0; x < x1; x++) m = std::min(m, row[x]);
+        }
+        tile_far[t] = m;
+        tile_dirty[t] = 0;
+    }
+    return tile_far[t];
+}
+
+uint32_t Zbuffer::blockFar(int bx, int by)
+{
+    int b = bx + by * blocks_x;
+    if (block_dirty[b])
+    {
+        int tx1 = std::min((bx + 1) * BLOCK, tiles_x);
+        int ty1 = std::min((by + 1) * BLOCK, tiles_y);
+        uint32_t m = std::numeric_limits<uint32_t>::max();
+        for (int ty = by * BLOCK; ty < ty1; ty++)
+            for (int tx = bx * BLOCK; tx < tx1; tx++)
+                m = std::min(m, tileFar(tx, ty));
+        block_far[b] = m;
+        block_dirty[b] = 0;
+    }
+    return block_far[b];
+}
+
+void Zbuffer::markTile(int tx, int ty, uint32_t znear)
+{
+    int t = tx + ty * tiles_x;
+    tile_near[t] = std::max(tile_near[t], znear);
+    tile_dirty[t] = 1;
+    block_dirty[tx / BLOCK + (ty / BLOCK) * blocks_x] = 1;
+}
+
+bool Zbuffer::occluded(int x0, int y0, int x1, int y1, uint32_t znear)
+{
+    int bx0 = x0 / (TILE * BLOCK), bx1 = x1 / (TILE * BLOCK);
+    int by0 = y0 / (TILE * BLOCK), by1 = y1 / (TILE * BLOCK);
+    for (int by = by0; by <= by1; by++)
+        for (int bx = bx0; bx <= bx1; bx++)
+            if (znear > blockFar(bx, by)) return false;
+    return true;
+}
+
+
+ShadowMap::ShadowMap(int s) : size(s), depth(s, s, DepthFormat::Float32) {}
+
+void ShadowMap::begin(const Vec3f &c, float r, const Vec3f &light)
+{
+    center = c;
+    radius = r > 0.f ? r : 1.f;
+    axis_l = light;
+    axis_l.normalize();
+    Vec3f helper = std::fabs(axis_l.x) < .9f ? Vec3f(1.f, 0.f, 0.f) : Vec3f(0.f, 1.f, 0.f);
+    axis_u = helper ^ axis_l;
+    axis_u.normalize();
+    axis_v = axis_l ^ axis_u;
+    //留出两个纹素的边，包围球内的点做 PCF 不会采到贴图之外；接收点外推后可能超出，由 lit 限制
+    scale = (size * .5f - 2.f) / radius;
+    //一个纹素在 45° 斜面上对应的深度约为 1/size，PCF 跨一个纹素，取两倍
+    bias = 2.f / size;
+    depth.fresh();
+}
+
+SampleBuffer::SampleBuffer(int w, int h, int n)
+    : width(w), height(h), samples(n == 8 ? 8 : 4),
+      depth((size_t)w * h * samples), color((size_t)w * h * samples), coverage((size_t)w * h, 0) {}
+
+void SampleBuffer::fresh()
+{
+    std::fill(coverage.begin(), coverage.end(), 0);
+}
+
+//IEEE 半精度与单精度互转，没有 F16C 时使用：按位重新偏置指数，向最近偶数舍入，溢出为无穷，NaN 保持
+static inline uint16_t toHalf(float f)
+{
+    uint32_t x = std::bit_cast<uint32_t>(f);
+    uint16_t sign = (uint16_t)((x >> 16) & 0x8000u);
+    x &= 0x7fffffffu;
+    if (x >= 0x47800000u) return sign | (x > 0x7f800000u ? 0x7e00 : 0x7c00);
+    //非规格化结果：加 0.5 让硬件按浮点加法舍入，尾数的低位就是半精度的尾数
+    if (x < 0x38800000u) return sign | (uint16_t)(std::bit_cast<uint32_t>(std::bit_cast<float>(x) + .5f) - 0x3f000000u);
+    x += 0xc8000fffu + ((x >> 13) & 1u);   //指数减去 127 - 15，并加上舍入量
+    return sign | (uint16_t)(x >> 13);
+}
+
+static inline float fromHalf(uint16_t h)
+{
+    uint32_t em = (uint32_t)(h & 0x7fff) << 13;
+    //指数按单精度解释再乘 2^112 即完成重新偏置，非规格化数也同样成立；无穷与 NaN 单独处理
+    float f = (h & 0x7c00) == 0x7c00 ? std::bit_cast<float>(em | 0x7f800000u) : std::bit_cast<float>(em) * 0x1p112f;
+    return std::bit_cast<float>(std::bit_cast<uint32_t>(f) | (uint32_t)(h & 0x8000) << 16);
+}
+
+HdrBuffer::HdrBuffer(int w, int h, HdrFormat fmt) : width(w), height(h), format(fmt)
+{
+    if (format == HdrFormat::Float32) f32.assign((size_t)w * h * 4, 0.f);
+    else f16.assign((size_t)w * h * 4, 0);
+}
+
+void HdrBuffer::fresh()
+{
+    std::fill(f32.begin(), f32.end(), 0.f);
+    std::fill(f16.begin(), f16.end(), (uint16_t)0);
+}
+
+void HdrBuffer::store(int idx, const Vec4f &c)
+{
+    if (format == HdrFormat::Float32)
+    {
+        float* p = f32.data() + (size_t)idx * 4;
+        p[0] = c.x;
+        p[1] = c.y;
+        p[2] = c.z;
+        p[3] = c.w;
+        return;
+    }
+    uint16_t* p = f16.data() + (size_t)idx * 4;
+#ifdef SIMD_F16C
+    _mm_storel_epi64((__m128i*)p, _mm_cvtps_ph(_mm_setr_ps(c.x, c.y, c.z, c.w), _MM_FROUND_TO_NEAREST_INT));
+#else
+    p[0] = toHalf(c.x);
+    p[1] = toHalf(c.y);
+    p[2] = toHalf(c.z);
+    p[3] = toHalf(c.w);
+#endif
+}
+
+Vec4f HdrBuffer::load(int idx) const
+{
+    if (format == HdrFormat::Float32)
+    {
+        const float* p = f32.data() + (size_t)idx * 4;
+        return Vec4f(p[0], p[1], p[2], p[3]);
+    }
+    const uint16_t* p = f16.data() + (size_t)idx * 4;
+#ifdef SIMD_F16C
+    alignas(16) float c[4];
+    _mm_store_ps(c, _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)p)));
+    return Vec4f(c[0], c[1], c[2], c[3]);
+#else
+    return Vec4f(fromHalf(p[0]), fromHalf(p[1]), fromHalf(p[2]), fromHalf(p[3]));
+#endif
+}
+
+const float* HdrBuffer::row(int y, float* scratch) const
+{
+    const size_t i = (size_t)y * width * 4, n = (size_t)width * 4;
+    if (format == HdrFormat::Float32) return f32.data() + i;
+    size_t k = 0;
+#ifdef SIMD_F16C
+    for (; k + 8 <= n; k += 8)
+    {
+        __m128i h = _mm_loadu_si128((const __m128i*)(f16.data() + i + k));
+        _mm_storeu_ps(scratch + k, _mm_cvtph_ps(h));
+        _mm_storeu_ps(scratch + k + 4, _mm_cvtph_ps(_mm_unpackhi_epi64(h, h)));
+    }
+#endif
+    for (; k < n; k++) scratch[k] = fromHalf(f16[i + k]);
+    return scratch;
+}
+
+void HdrBuffer::resolve(const ImageView &image) const
+{
+    const int bytespp = image.bytespp;
+    const int w = std::min(width, image.width), h = std::min(height, image.height);
+
+    //与 SIMD 部分相同：钳制到 [0,1]、乘 255、加 0.5 后截断，NaN 按 0 处理
+    auto quantize = [](float v) { return (unsigned char)((v > 0.f ? (v < 1.f ? v : 1.f) : 0.f) * 255.f + .5f); };
+
+    parallel_for(0, h, 16, [&](int y0, int y1)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            unsigned char* dst = image.row(y);
+            size_t i = (size_t)y * width;
+            int x = 0;
+#ifdef SIMD_SSE2
+            //4 个像素共 16 个通道：钳制、乘 255 加 0.5 后截断转整数（与逐像素的尾部舍入一致），两次饱和打包成 16 字节 BGRA
+            const __m128 scale = _mm_set1_ps(255.f), zero = _mm_setzero_ps(), half = _mm_set1_ps(.5f);
+            for (; x + 4 <= w; x += 4, i += 4)
+            {
+                __m128 c[4];
+                if (format == HdrFormat::Float32)
+                    for (int k = 0; k < 4; k++) c[k] = _mm_loadu_ps(f32.data() + (i + k) * 4);
+                else
+                {
+#ifdef SIMD_F16C
+                    __m128i lo = _mm_loadu_si128((const __m128i*)(f16.data() + i * 4)), hi = _mm_loadu_si128((const __m128i*)(f16.data() + i * 4 + 8));
+                    c[0] = _mm_cvtph_ps(lo);
+                    c[1] = _mm_cvtph_ps(_mm_unpackhi_epi64(lo, lo));
+                    c[2] = _mm_cvtph_ps(hi);
+                    c[3] = _mm_cvtph_ps(_mm_unpackhi_epi64(hi, hi));
+#else
+                    for (int k = 0; k < 4; k++)
+                    {
+                        Vec4f v = load((int)(i + k));
+                        c[k] = _mm_setr_ps(v.x, v.y, v.z, v.w);
+                    }
+#endif
+                }
+                __m128i q[4];
+                for (int k = 0; k < 4; k++) q[k] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(c[k], zero), _mm_set1_ps(1.f)), scale), half));
+                __m128i bgra = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+                unsigned char* d = dst + x * bytespp;
+                if (bytespp == 4) _mm_storeu_si128((__m128i*)d, bgra);
+#ifdef SIMD_SSSE3
+                else if (bytespp == 3)
+                {
+                    //去掉 alpha 压成 12 字节，分 8 + 4 字节写，不越过行尾
+                    __m128i bgr = _mm_shuffle_epi8(bgra, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+                    _mm_storel_epi64((__m128i*)d, bgr);
+                    int tail = _mm_cvtsi128_si32(_mm_srli_si128(bgr, 8));
+                    memcpy(d + 8, &tail, 4);
+                }
+#endif
+                else
+                {
+                    alignas(16) unsigned char t[16];
+                    _mm_store_si128((__m128i*)t, bgra);
+                    for (int k = 0; k < 4; k++) memcpy(d + k * bytespp, t + 4 * k, bytespp);
+                }
+            }
+#endif
+            for (; x < w; x++, i++)
+            {
+                Vec4f v = load((int)i);
+                const float c[4] = {v.x, v.y, v.z, v.w};
+                for (int k = 0; k < bytespp; k++) dst[x * bytespp + k] = quantize(c[k]);
+            }
+        }
+    });
+}
+
 //---------------------------------------------------------------------------------------
-void triangleDraw(Vec3i &t0, Vec3i &t1, Vec3i &t2,
+//屏幕空间中线性变化的量（深度、属性/w、1/w）的平面方程：f(x,y) = f0 + dfdx*(x - x0) + dfdy*(y - y0)
+//三角形建立时求一次梯度，光栅化内循环只做加法
+template <class T>
+struct Plane
+{
+    T f0, dfdx, dfdy;
+
+    Plane() {}
+    Plane(const Vec3f *v, const T &f0_, const T &f1, const T &f2)
+    {
+        float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[2].x - v[0].x) * (v[1].y - v[0].y);
+        float inv_area = area != 0.f ? 1.f / area : 0.f;
+        T d1 = f1 - f0_, d2 = f2 - f0_;
+        f0   = f0_;
+        dfdx = (d1 * (v[2].y - v[0].y) - d2 * (v[1].y - v[0].y)) * inv_area;
+        dfdy = (d2 * (v[1].x - v[0].x) - d1 * (v[2].x - v[0].x)) * inv_area;
+    }
+
+    T at(const Vec3f &origin, float px, float py) const { return f0 + dfdx * (px - origin.x) + dfdy * (py - origin.y); }
+};
+
+//不需要插值属性时（只写深度）的空步进器
+struct NoStepper
+{
+    void start(float, float) {}
+    void next() {}
+};
+
+//t0,t1,t2 的 x,y 为屏幕坐标，z 为 reverse-Z 深度（z/w 在屏幕空间中线性，可直接插值）
+//按 8x8 tile 遍历包围盒，用边函数判断覆盖，每个 tile 先做 Hi-Z 测试再进入逐像素循环
+//边函数、深度与 stepper 都在行首求值一次，之后逐像素增量前进
+//通过深度测试并写入深度后调用 fragment(x, y, idx)，此时 stepper 停在该像素上
+template <class Stepper, class Fragment>
+static void rasterize(const Vec3f &t0, const Vec3f &t1, const Vec3f &t2,
+                      int width,
+                      Zbuffer &zbuffer,
+                      Stepper &stepper,
+                      Fragment &&fragment)
+{
+    float area = (t1.x - t0.x) * (t2.y - t0.y) - (t2.x - t0.x) * (t1.y - t0.y);
+    if (area == 0.f) return;  // 退化三角形忽略
+
+    // 两种绕序都绘制：把边函数统一到三角形内部非负
+    float sign = area > 0.f ? 1.f : -1.f;
+
+    // 包围盒，限制在缓冲区内
+    int xmin = std::max(0, (int)std::floor(std::min({t0.x, t1.x, t2.x})));
+    int ymin = std::max(0, (int)std::floor(std::min({t0.y, t1.y, t2.y})));
+    int xmax = std::min(std::min(width, zbuffer.width) - 1, (int)std::ceil(std::max({t0.x, t1.x, t2.x})));
+    int ymax = std::min(zbuffer.height - 1, (int)std::ceil(std::max({t0.y, t1.y, t2.y})));
+    if (xmin > xmax || ymin > ymax) return;
+
+    // 三角形最近与最远深度，用于和 Hi-Z 比较
+    uint32_t znear = zbuffer.encode(std::max({t0.z, t1.z, t2.z}));
+    uint32_t zfar  = zbuffer.encode(std::min({t0.z, t1.z, t2.z}));
+    if (zbuffer.occluded(xmin, ymin, xmax, ymax, znear))
+    {
+        zbuffer.stats.tris_rejected++;
+        return;
+    }
+
+    // 边函数 w0 对应 t1->t2，w1 对应 t2->t0，w2 对应 t0->t1，沿 x 每步的增量
+    float dw0dx = -(t2.y - t1.y) * sign, dw1dx = -(t0.y - t2.y) * sign, dw2dx = -(t1.y - t0.y) * sign;
+    auto edge = [sign](const Vec3f &a, const Vec3f &b, float px, float py)
+    {
+        return ((b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x)) * sign;
+    };
+    const Vec3f v[3] = {t0, t1, t2};
+    Plane<float> depth(v, t0.z, t1.z, t2.z);
+
+    const int T = Zbuffer::TILE;
+    unsigned long long tested = 0, passed = 0, filled = 0, tiles_rejected = 0;
+
+    for (int ty = ymin / T; ty <= ymax / T; ty++)
+    {
+        for (int tx = xmin / T; tx <= xmax / T; tx++)
+        {
+            // tile 中最远的已存深度都比三角形最近点更近，整块跳过
+            if (znear <= zbuffer.tileFar(tx, ty)) { tiles_rejected++; continue; }
+            // 三角形最远点都比 tile 中最近的已存深度更近，tile 内深度测试必然通过
+            bool accept = zfar > zbuffer.tileNear(tx, ty);
+
+            int x0 = std::max(xmin, tx * T), x1 = std::min(xmax, tx * T + T - 1);
+            int y0 = std::max(ymin, ty * T), y1 = std::min(ymax, ty * T + T - 1);
+            bool written = false;
+
+            for (int y = y0; y <= y1; y++)
+            {
+                float px = x0 + .5f, py = y + .5f;
+                float w0 = edge(t1, t2, px, py);
+                float w1 = edge(t2, t0, px, py);
+                float w2 = edge(t0, t1, px, py);
+                float zP = depth.at(t0, px, py);
+                stepper.start(px, py);
+                for (int x = x0; x <= x1; x++, w0 += dw0dx, w1 += dw1dx, w2 += dw2dx, zP += depth.dfdx, stepper.next())
+                {
+                    if (w0 < 0.f || w1 < 0.f || w2 < 0.f) continue;
+
+                    int Z_idx = x + y * width;
+                    tested++;
+                    uint32_t d = zbuffer.encode(zP), old = zbuffer.buffer[Z_idx];
+                    if (!accept && old >= d) continue;
+                    zbuffer.buffer[Z_idx] = d;
+                    passed++;
+                    filled += old == 0u;
+                    written = true;
+
+                    fragment(x, y, Z_idx);
+                }
+            }
+            if (written) zbuffer.markTile(tx, ty, znear);
+        }
+    }
+
+    zbuffer.stats.tested += tested;
+    zbuffer.stats.passed += passed;
+    zbuffer.stats.filled += filled;
+    zbuffer.stats.tiles_rejected += tiles_rejected;
+}
+
+//多重采样的采样点位置，相对像素中心，单位为像素（D3D 标准的 4x、8x 模式）
+static const float MSAA4[4][2] = {{-2 / 16.f, -6 / 16.f}, {6 / 16.f, -2 / 16.f}, {-6 / 16.f, 2 / 16.f}, {2 / 16.f, 6 / 16.f}};
+static const float MSAA8[8][2] = {{1 / 16.f, -3 / 16.f}, {-1 / 16.f, 3 / 16.f}, {5 / 16.f, 1 / 16.f}, {-3 / 16.f, -5 / 16.f},
+                                  {-5 / 16.f, 5 / 16.f}, {-7 / 16.f, -1 / 16.f}, {3 / 16.f, 7 / 16.f}, {7 / 16.f, -7 / 16.f}};
+
+//多重采样光栅化：覆盖与深度测试按 S 个采样点分别做，fragment 每像素只调用一次，返回的颜色写入通过测试的采样点。
+//边函数与深度在像素中心步进，采样点只加一个三角形建立时算好的固定偏移；
+//离三条边都足够远的像素直接视为全覆盖，完全在某条边外侧的像素直接跳过，只有边缘像素逐采样点判断覆盖。
+//Zbuffer 中存放像素内最远的采样深度（未全覆盖时为 0），Hi-Z 仍然保守
+template <int S, class Stepper, class Fragment>
+static void rasterizeMsaa(const Vec3f &t0, const Vec3f &t1, const Vec3f &t2,
+                          int width,
+                          Zbuffer &zbuffer,
+                          SampleBuffer &samples,
+                          Stepper &stepper,
+                          Fragment &&fragment)
+{
+    const float (*pattern)[2] = S == 8 ? MSAA8 : MSAA4;
+    const unsigned full = (1u << S) - 1;
+
+    float area = (t1.x - t0.x) * (t2.y - t0.y) - (t2.x - t0.x) * (t1.y - t0.y);
+    if (area == 0.f) return;
+    float sign = area > 0.f ? 1.f : -1.f;
+
+    //采样点离像素中心不到半个像素，原来的包围盒已经覆盖所有可能命中的采样点
+    int xmin = std::max(0, (int)std::floor(std::min({t0.x, t1.x, t2.x})));
+    int ymin = std::max(0, (int)std::floor(std::min({t0.y, t1.y, t2.y})));
+    int xmax = std::min(std::min(width, zbuffer.width) - 1, (int)std::ceil(std::max({t0.x, t1.x, t2.x})));
+    int ymax = std::min(zbuffer.height - 1, (int)std::ceil(std::max({t0.y, t1.y, t2.y})));
+    if (xmin > xmax || ymin > ymax) return;
+
+    uint32_t znear = zbuffer.encode(std::max({t0.z, t1.z, t2.z}));
+    uint32_t zfar  = zbuffer.encode(std::min({t0.z, t1.z, t2.z}));
+    if (zbuffer.occluded(xmin, ymin, xmax, ymax, znear))
+    {
+        zbuffer.stats.tris_rejected++;
+        return;
+    }
+
+    float dw0dx = -(t2.y - t1.y) * sign, dw1dx = -(t0.y - t2.y) * sign, dw2dx = -(t1.y - t0.y) * sign;
+    float dw0dy =  (t2.x - t1.x) * sign, dw1dy =  (t0.x - t2.x) * sign, dw2dy =  (t1.x - t0.x) * sign;
+    auto edge = [sign](const Vec3f &a, const Vec3f &b, float px, float py)
+    {
+        return ((b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x)) * sign;
+    };
+    const Vec3f v[3] = {t0, t1, t2};
+    Plane<float> depth(v, t0.z, t1.z, t2.z);
+
+    //各采样点相对像素中心的边函数与深度偏移；中心的边函数不小于 in 时该边对所有采样点成立，小于 out 时对所有采样点都不成立
+    float o0[S], o1[S], o2[S], oz[S];
+    float in0 = -1e30f, in1 = -1e30f, in2 = -1e30f, out0 = 1e30f, out1 = 1e30f, out2 = 1e30f;
+    for (int k = 0; k < S; k++)
+    {
+        float ox = pattern[k][0], oy = pattern[k][1];
+        o0[k] = dw0dx * ox + dw0dy * oy;
+        o1[k] = dw1dx * ox + dw1dy * oy;
+        o2[k] = dw2dx * ox + dw2dy * oy;
+        oz[k] = depth.dfdx * ox + depth.dfdy * oy;
+        in0 = std::max(in0, -o0[k]); out0 = std::min(out0, -o0[k]);
+        in1 = std::max(in1, -o1[k]); out1 = std::min(out1, -o1[k]);
+        in2 = std::max(in2, -o2[k]); out2 = std::min(out2, -o2[k]);
+    }
+#ifdef SIMD_SSE2
+    //深度测试与颜色写入每次处理 4 个采样点，bits 把掩码的低 4 位展开成 4 个通道
+    const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+    const bool fixed24 = zbuffer.format == DepthFormat::Fixed24;
+    __m128 ozv[S / 4];
+    for (int k = 0; k < S; k += 4) ozv[k / 4] = _mm_loadu_ps(oz + k);
+    auto lanes = [&bits](unsigned m) { return _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32((int)m), bits), bits); };
+#endif
+
+    const int T = Zbuffer::TILE;
+    unsigned long long tested = 0, passed = 0, filled = 0, tiles_rejected = 0;
+
+    for (int ty = ymin / T; ty <= ymax / T; ty++)
+    {
+        for (int tx = xmin / T; tx <= xmax / T; tx++)
+        {
+            if (znear <= zbuffer.tileFar(tx, ty)) { tiles_rejected++; continue; }
+            bool accept = zfar > zbuffer.tileNear(tx, ty);
+
+            int x0 = std::max(xmin, tx * T), x1 = std::min(xmax, tx * T + T - 1);
+            int y0 = std::max(ymin, ty * T), y1 = std::min(ymax, ty * T + T - 1);
+            bool written = false;
+
+            for (int y = y0; y <= y1; y++)
+            {
+                float px = x0 + .5f, py = y + .5f;
+                float w0 = edge(t1, t2, px, py);
+                float w1 = edge(t2, t0, px, py);
+                float w2 = edge(t0, t1, px, py);
+                float zP = depth.at(t0, px, py);
+                stepper.start(px, py);
+                for (int x = x0; x <= x1; x++, w0 += dw0dx, w1 += dw1dx, w2 += dw2dx, zP += depth.dfdx, stepper.next())
+                {
+                    bool inside = w0 >= in0 && w1 >= in1 && w2 >= in2;
+                    if (!inside && (w0 < out0 || w1 < out1 || w2 < out2)) continue;
+                    unsigned mask = full;
+                    if (!inside)
+                    {
+                        mask = 0;
+                        for (int k = 0; k < S; k++)
+                            mask |= (unsigned)(w0 + o0[k] >= 0.f && w1 + o1[k] >= 0.f && w2 + o2[k] >= 0.f) << k;
+                        if (!mask) continue;
+                    }
+
+                    int Z_idx = x + y * width;
+                    tested += std::popcount(mask);
+                    uint32_t* sd = samples.depth.data() + (size_t)Z_idx * S;
+                    unsigned cov = samples.coverage[Z_idx], pass = 0;
+#ifdef SIMD_SSE2
+                    for (int k = 0; k < S; k += 4)
+                    {
+                        __m128 z = _mm_max_ps(_mm_add_ps(_mm_set1_ps(zP), ozv[k / 4]), _mm_setzero_ps());
+                        __m128i d = fixed24 ? _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(z, _mm_set1_ps(1.f)), _mm_set1_ps(16777215.f)), _mm_set1_ps(.5f)))
+                                            : _mm_castps_si128(z);
+                        __m128i old = _mm_loadu_si128((const __m128i*)(sd + k));
+                        //覆盖到的采样点中，本帧未写过的直接通过，写过的比较深度
+                        __m128i ok = lanes(mask >> k);
+                        if (!accept) ok = _mm_and_si128(ok, _mm_or_si128(_mm_cmpeq_epi32(lanes(cov >> k), _mm_setzero_si128()), _mm_cmpgt_epi32(d, old)));
+                        _mm_storeu_si128((__m128i*)(sd + k), _mm_or_si128(_mm_and_si128(ok, d), _mm_andnot_si128(ok, old)));
+                        pass |= (unsigned)_mm_movemask_ps(_mm_castsi128_ps(ok)) << k;
+                    }
+#else
+                    for (int k = 0; k < S; k++)
+                    {
+                        if (!(mask >> k & 1)) continue;
+                        uint32_t d = zbuffer.encode(zP + oz[k]);
+                        if (!accept && (cov >> k & 1) && sd[k] >= d) continue;
+                        sd[k] = d;
+                        pass |= 1u << k;
+                    }
+#endif
+                    if (!pass) continue;
+                    passed += std::popcount(pass);
+                    filled += cov == 0u;
+                    written = true;
+
+                    cov |= pass;
+                    samples.coverage[Z_idx] = (unsigned char)cov;
+                    uint32_t far = 0u;
+                    if (cov == full)
+                    {
+                        far = sd[0];
+                        for (int k = 1; k < S; k++) far = std::min(far, sd[k]);
+                    }
+                    zbuffer.buffer[Z_idx] = far;
+
+                    TGAColor c = fragment(x, y, Z_idx);
+                    uint32_t packed;
+                    memcpy(&packed, c.bgra, 4);
+                    uint32_t* sc = samples.color.data() + (size_t)Z_idx * S;
+#ifdef SIMD_SSE2
+                    for (int k = 0; k < S; k += 4)
+                    {
+                        __m128i ok = lanes(pass >> k), old = _mm_loadu_si128((const __m128i*)(sc + k));
+                        _mm_storeu_si128((__m128i*)(sc + k), _mm_or_si128(_mm_and_si128(ok, _mm_set1_epi32((int)packed)), _mm_andnot_si128(ok, old)));
+                    }
+#else
+                    for (int k = 0; k < S; k++)
+                        if (pass >> k & 1) sc[k] = packed;
+#endif
+                }
+            }
+            if (written) zbuffer.markTile(tx, ty, znear);
+        }
+    }
+
+    zbuffer.stats.tested += tested;
+    zbuffer.stats.passed += passed;
+    zbuffer.stats.filled += filled;
+    zbuffer.stats.tiles_rejected += tiles_rejected;
+}
+
+//几何阶段已经裁剪，光栅化又把包围盒限制在缓冲区内，像素坐标必然合法，直接写画布内存
+static inline void putPixel(unsigned char* pixels, int bytespp, int idx, const TGAColor &c)
+{
+    memcpy(pixels + idx * bytespp, c.bgra, bytespp);
+}
+
+//片元输出目标，管线按目标分别实例化：画布写入 fragment 的 8 位颜色，HDR 渲染目标写入 radiance 的线性浮点颜色
+struct CanvasTarget
+{
+    unsigned char* pixels;
+    int bytespp;
+
+    template <class Shader>
+    void put(const Shader &shader, int idx, const typename Shader::Varying &in) const { putPixel(pixels, bytespp, idx, shader.fragment(in)); }
+};
+
+struct HdrTarget
+{
+    HdrBuffer* hdr;
+
+    template <class Shader>
+    void put(const Shader &shader, int idx, const typename Shader::Varying &in) const { hdr->store(idx, shader.radiance(in)); }
+};
+
+//几何阶段输出的屏幕空间三角形，V 为着色器的插值属性类型
+template <class V>
+struct ScreenTriangle
+{
+    Vec3f v[3];     //屏幕坐标，z 为 reverse-Z 深度
+    float rw[3];    //1/w，用于透视校正
+    V var[3];
+};
+
+//透视校正插值：属性/w 与 1/w 在屏幕空间线性，按平面方程增量步进，取值时再除以 1/w
+template <class V>
+struct PerspectiveStepper
+{
+    Vec3f origin;
+    Plane<V> a;         //属性/w
+    Plane<float> q;     //1/w
+    V cur_a;
+    float cur_q;
+
+    explicit PerspectiveStepper(const ScreenTriangle<V> &t)
+        : origin(t.v[0]),
+          a(t.v, t.var[0] * t.rw[0], t.var[1] * t.rw[1], t.var[2] * t.rw[2]),
+          q(t.v, t.rw[0], t.rw[1], t.rw[2]) {}
+
+    void start(float px, float py) { cur_a = a.at(origin, px, py); cur_q = q.at(origin, px, py); }
+    void next() { cur_a = cur_a + a.dfdx; cur_q += q.dfdx; }
+    V value() const { return cur_a * (1.f / cur_q); }
+};
+
+//前向着色：通过深度测试的片元取出透视校正后的属性并执行片元着色器
+template <class Shader, class Target>
+static void drawTriangle(const ScreenTriangle<typename Shader::Varying> &t,
+                         const Shader &shader,
+                         int width,
+                         Zbuffer &zbuffer,
+                         const Target &target)
+{
+    PerspectiveStepper<typename Shader::Varying> stepper(t);
+    rasterize(t.v[0], t.v[1], t.v[2], width, zbuffer, stepper, [&](int, int, int idx)
+    {
+        target.put(shader, idx, stepper.value());
+    });
+}
+
+//多重采样的前向着色，返回片元着色器的调用次数
+template <int S, class Shader>
+static unsigned long long drawTriangleMsaa(const ScreenTriangle<typename Shader::Varying> &t,
+                                           const Shader &shader,
+                                           int width,
+                                           Zbuffer &zbuffer,
+                                           SampleBuffer &samples)
+{
+    PerspectiveStepper<typename Shader::Varying> stepper(t);
+    unsigned long long count = 0;
+    rasterizeMsaa<S>(t.v[0], t.v[1], t.v[2], width, zbuffer, samples, stepper, [&](int, int, int)
+    {
+        count++;
+        return shader.fragment(stepper.value());
+    });
+    return count;
+}
+
+//外部接口按屏幕空间线性插值（顶点没有 w 信息）
+void triangleDraw(Vec3f &t0, Vec3f &t1, Vec3f &t2,
                   float &ity0, float &ity1, float &ity2,
                   Vec2i &uv0, Vec2i &uv1, Vec2i &uv2,
                   float ambient_light,
@@ -203,91 +933,796 @@ void triangleDraw(Vec3i &t0, Vec3i &t1, Vec3i &t2,
                   Model* model,
                   TGAImage* image)
 {
-    if (t0.y == t1.y && t0.y == t2.y) return;  // 退化三角形忽略
+    ShaderUniforms uniforms = {model, Vec3f(), Vec3f(), ambient_light, 0.f, 1.f};
+    GouraudShader shader(uniforms);
+    ScreenTriangle<GouraudShader::Varying> t = {{t0, t1, t2}, {1.f, 1.f, 1.f},
+                                                {{(float)uv0.x, (float)uv0.y, ity0},
+                                                 {(float)uv1.x, (float)uv1.y, ity1},
+                                                 {(float)uv2.x, (float)uv2.y, ity2}}};
+    drawTriangle(t, shader, width, zbuffer, CanvasTarget{image->buffer(), image->get_bytespp()});
+}
+
+void triangleDepth(Vec3f &t0, Vec3f &t1, Vec3f &t2,
+                   uint32_t id,
+                   int width,
+                   Zbuffer &zbuffer)
+{
+    uint32_t* ids = zbuffer.ids.empty() ? nullptr : zbuffer.ids.data();
+    NoStepper stepper;
+    rasterize(t0, t1, t2, width, zbuffer, stepper, [ids, id](int, int, int idx)
+    {
+        if (ids) ids[idx] = id;
+    });
+}
 
-    // 排序顶点，确保从低到高的顺序是 t0, t1, t2
-    if (t0.y > t1.y) { std::swap(t0, t1); std::swap(ity0, ity1); std::swap(uv0, uv1); }
-    if (t0.y > t2.y) { std::swap(t0, t2); std::swap(ity0, ity2); std::swap(uv0, uv2); }
-    if (t1.y > t2.y) { std::swap(t1, t2); std::swap(ity1, ity2); std::swap(uv1, uv2); }
+//只写深度的光栅化的 SIMD 版本，用于阴影贴图：与 rasterize 相同的 8x8 tile 遍历，tile 内每行一次处理 4 个像素。
+//阴影贴图只画朝向光源的三角形，深度复杂度接近 1，Hi-Z 几乎剔除不掉什么，维护它的开销反而更大，所以这里不做 Hi-Z。
+//要求 Float32 格式且不写三角形编号，非负浮点数的位模式可以直接按整数比较
+static void rasterizeDepth(const Vec3f &t0, const Vec3f &t1, const Vec3f &t2, Zbuffer &zbuffer)
+{
+#ifdef SIMD_SSE2
+    float area = (t1.x - t0.x) * (t2.y - t0.y) - (t2.x - t0.x) * (t1.y - t0.y);
+    if (area == 0.f) return;
+    float sign = area > 0.f ? 1.f : -1.f;
 
-    int total_height = t2.y - t0.y;
+    int width = zbuffer.width;
+    int xmin = std::max(0, (int)std::floor(std::min({t0.x, t1.x, t2.x})));
+    int ymin = std::max(0, (int)std::floor(std::min({t0.y, t1.y, t2.y})));
+    int xmax = std::min(width - 1, (int)std::ceil(std::max({t0.x, t1.x, t2.x})));
+    int ymax = std::min(zbuffer.height - 1, (int)std::ceil(std::max({t0.y, t1.y, t2.y})));
+    if (xmin > xmax || ymin > ymax) return;
 
-    for (int i = 0; i < total_height; i++)
+    float dw0dx = -(t2.y - t1.y) * sign, dw1dx = -(t0.y - t2.y) * sign, dw2dx = -(t1.y - t0.y) * sign;
+    auto edge = [sign](const Vec3f &a, const Vec3f &b, float px, float py)
     {
-        bool second_half = i > t1.y - t0.y || t1.y == t0.y; // 判断是否在下半部分
-        int segment_height = second_half ? t2.y - t1.y : t1.y - t0.y; // 片段高度
-        float alpha = (float)i / total_height;
-        float beta  = (float)(i - (second_half ? t1.y - t0.y : 0)) / segment_height;
+        return ((b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x)) * sign;
+    };
+    const Vec3f v[3] = {t0, t1, t2};
+    Plane<float> depth(v, t0.z, t1.z, t2.z);
 
-        Vec3i A = t0 + Vec3f(t2 - t0) * alpha;
-        Vec3i B = second_half ? t1 + Vec3f(t2 - t1) * beta : t0 + Vec3f(t1 - t0) * beta;
+    //4 个相邻像素的边函数与深度：行首值加上 0..3 倍的 x 方向增量
+    const __m128 lane = _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+    const __m128 dw0 = _mm_mul_ps(lane, _mm_set1_ps(dw0dx)), dw1 = _mm_mul_ps(lane, _mm_set1_ps(dw1dx));
+    const __m128 dw2 = _mm_mul_ps(lane, _mm_set1_ps(dw2dx)), dz = _mm_mul_ps(lane, _mm_set1_ps(depth.dfdx));
+    const __m128 zero = _mm_setzero_ps();
 
-        float ityA = ity0 + (ity2 - ity0) * alpha;
-        float ityB = second_half ? ity1 + (ity2 - ity1) * beta : ity0 + (ity1 - ity0) * beta;
+    const int T = Zbuffer::TILE;
+    unsigned long long tested = 0, passed = 0;
+    for (int ty = ymin / T; ty <= ymax / T; ty++)
+    {
+        for (int tx = xmin / T; tx <= xmax / T; tx++)
+        {
+            int x0 = std::max(xmin, tx * T), x1 = std::min(xmax, tx * T + T - 1);
+            int y0 = std::max(ymin, ty * T), y1 = std::min(ymax, ty * T + T - 1);
 
-    	Vec2i uvA = uv0 + (uv2 - uv0) * alpha;
-    	Vec2i uvB = second_half ? uv1 + (uv2 - uv1) * beta : uv0 + (uv1 - uv0) * beta;
+            for (int y = y0; y <= y1; y++)
+            {
+                float px = x0 + .5f, py = y + .5f;
+                float w0 = edge(t1, t2, px, py), w1 = edge(t2, t0, px, py), w2 = edge(t0, t1, px, py);
+                float zP = depth.at(t0, px, py);
+                uint32_t* row = zbuffer.buffer.data() + y * width;
+                for (int x = x0; x <= x1; x += 4, w0 += 4 * dw0dx, w1 += 4 * dw1dx, w2 += 4 * dw2dx, zP += 4 * depth.dfdx)
+                {
+                    __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(_mm_add_ps(_mm_set1_ps(w0), dw0), zero),
+                                                          _mm_cmpge_ps(_mm_add_ps(_mm_set1_ps(w1), dw1), zero)),
+                                               _mm_cmpge_ps(_mm_add_ps(_mm_set1_ps(w2), dw2), zero));
+                    int live = _mm_movemask_ps(inside) & (0xf >> std::max(0, x + 3 - x1));
+                    if (!live) continue;
+                    __m128i d = _mm_castps_si128(_mm_max_ps(_mm_add_ps(_mm_set1_ps(zP), dz), zero));
+                    tested += std::popcount((unsigned)live);
+                    if (x + 3 <= x1)
+                    {
+                        __m128i old = _mm_loadu_si128((const __m128i*)(row + x));
+                        __m128i pass = _mm_and_si128(_mm_castps_si128(inside), _mm_cmpgt_epi32(d, old));
+                        int m = _mm_movemask_ps(_mm_castsi128_ps(pass));
+                        if (!m) continue;
+                        _mm_storeu_si128((__m128i*)(row + x), _mm_or_si128(_mm_and_si128(pass, d), _mm_andnot_si128(pass, old)));
+                        passed += std::popcount((unsigned)m);
+                    }
+                    else
+                    {
+                        //tile 的最后几个像素，逐个写以免越过行尾
+                        uint32_t dd[4];
+                        _mm_storeu_si128((__m128i*)dd, d);
+                        for (int k = 0; k < 4; k++)
+                        {
+                            if (!(live >> k & 1) || row[x + k] >= dd[k]) continue;
+                            row[x + k] = dd[k];
+                            passed++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    zbuffer.stats.tested += tested;
+    zbuffer.stats.passed += passed;
+#else
+    NoStepper stepper;
+    rasterize(t0, t1, t2, zbuffer.width, zbuffer, stepper, [](int, int, int) {});
+#endif
+}
+
+//可见性缓冲的着色阶段：按行并行，每个可见像素根据三角形编号取出该三角形的平面方程，
+//在像素中心求值得到透视校正后的属性，着色一次。编号为 NO_ID 的像素不是本次绘制覆盖的（可能来自之前的绘制），跳过
+template <class Shader, class Target>
+static unsigned long long shadeVisibility(const std::vector<ScreenTriangle<typename Shader::Varying>> &tris,
+                                          const Shader &shader,
+                                          int width,
+                                          int height,
+                                          Zbuffer &zbuffer,
+                                          const Target &target)
+{
+    typedef typename Shader::Varying Varying;
 
-        if (A.x > B.x) { std::swap(A, B); std::swap(ityA, ityB); std::swap(uvA, uvB); }
+    //每个三角形的平面方程只求一次
+    std::vector<PerspectiveStepper<Varying>> planes;
+    planes.reserve(tris.size());
+    for (const ScreenTriangle<Varying> &t : tris) planes.emplace_back(t);
 
-        for (int j = A.x; j <= B.x; j++)
+    std::atomic<unsigned long long> shaded(0);
+    parallel_for(0, height, 16, [&](int y0, int y1)
+    {
+        unsigned long long count = 0;
+        for (int y = y0; y < y1; y++)
         {
-            float phi = (B.x == A.x) ? 1.f : (float)(j - A.x) / (float)(B.x - A.x); // 插值参数
-            Vec3i P = Vec3f(A) + Vec3f(B - A) * phi;  // 当前点
-        	Vec2i uvP =  uvA + (uvB - uvA) * phi;
+            for (int x = 0; x < width; x++)
+            {
+                int idx = x + y * width;
+                uint32_t id = zbuffer.ids[idx];
+                if (id >= planes.size()) continue;
+
+                PerspectiveStepper<Varying> s = planes[id];
+                s.start(x + .5f, y + .5f);
+                target.put(shader, idx, s.value());
+                count++;
+            }
+        }
+        shaded += count;
+    });
+    return shaded;
+}
+
+
+//裁剪空间顶点
+template <class V>
+struct ClipVertex
+{
+    Vec4f p;
+    V var;
+};
+
+//保护带（NDC 单位）：只有超出视口数倍的三角形才真正被 x/y 平面裁剪，其余交给包围盒限制
+static const float GUARD_BAND = 4.f;
+static const int CLIP_PLANES = 5;
+
+static Vec4f transform(Matrix &m, const Vec3f &v)
+{
+    return Vec4f(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z + m[0][3],
+                 m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z + m[1][3],
+                 m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z + m[2][3],
+                 m[3][0] * v.x + m[3][1] * v.y + m[3][2] * v.z + m[3][3]);
+}
+
+//到裁剪平面的有向距离，非负为内侧
+//reverse-Z 下近平面为 z <= w，远平面在无穷远（z >= 0 恒成立），无需裁剪
+static float clipDistance(const Vec4f &p, int plane)
+{
+    switch (plane)
+    {
+        case 0:  return p.w - p.z;
+        case 1:  return GUARD_BAND * p.w - p.x;
+        case 2:  return GUARD_BAND * p.w + p.x;
+        case 3:  return GUARD_BAND * p.w - p.y;
+        default: return GUARD_BAND * p.w + p.y;
+    }
+}
+
+static int outcode(const Vec4f &p)
+{
+    int code = 0;
+    for (int k = 0; k < CLIP_PLANES; k++) if (clipDistance(p, k) < 0.f) code |= 1 << k;
+    return code;
+}
+
+//透视除法 + 视口变换
+static Vec3f toScreen(Matrix &ViewPort, const Vec4f &p)
+{
+    float iw = 1.f / p.w;
+    Vec4f s = transform(ViewPort, Vec3f(p.x * iw, p.y * iw, p.z * iw));
+    return Vec3f(s.x, s.y, s.z);
+}
+
+//Sutherland–Hodgman 依次裁剪近平面和保护带平面，结果按扇形拆成三角形追加到 out
+template <class Shader>
+static void clipTriangle(const ClipVertex<typename Shader::Varying> *tri,
+                         const Shader &shader,
+                         Matrix &ViewPort,
+                         std::vector<ScreenTriangle<typename Shader::Varying>> &out)
+{
+    typedef ClipVertex<typename Shader::Varying> Vertex;
+    int c0 = outcode(tri[0].p), c1 = outcode(tri[1].p), c2 = outcode(tri[2].p);
+    if (c0 & c1 & c2) return;  // 三个顶点都在同一平面外侧
 
-        	float ityP = ityA + (ityB - ityA) * phi; // 当前点的光照强度
+    Vertex buf[2][3 + CLIP_PLANES];
+    int n = 3;
+    for (int j = 0; j < 3; j++) buf[0][j] = tri[j];
 
-            int Z_idx = P.x + P.y * width;
-            if (zbuffer.buffer[Z_idx] < P.z)
+    //全部在内侧时跳过裁剪
+    int cur = 0;
+    if (c0 | c1 | c2)
+    {
+        for (int k = 0; k < CLIP_PLANES && n > 0; k++)
+        {
+            if (!((c0 | c1 | c2) & (1 << k))) continue;
+            const Vertex *in = buf[cur];
+            Vertex *res = buf[cur ^ 1];
+            int m = 0;
+            for (int j = 0; j < n; j++)
             {
-                zbuffer.buffer[Z_idx] = P.z;
-                TGAColor color = model->diffuse(uvP);  // 获取纹理颜色
-                image->set(P.x, P.y, color * (ityP > 0 ? (ityP + ambient_light) : ambient_light));
+                const Vertex &a = in[j], &b = in[(j + 1) % n];
+                float da = clipDistance(a.p, k), db = clipDistance(b.p, k);
+                if (da >= 0.f) res[m++] = a;
+                if ((da >= 0.f) != (db >= 0.f))
+                {
+                    float s = da / (da - db);
+                    res[m].p = a.p + (b.p - a.p) * s;
+                    res[m].var = a.var + (b.var - a.var) * s;
+                    m++;
+                }
             }
+            n = m;
+            cur ^= 1;
         }
+    }
 
+    for (int j = 1; j + 1 < n; j++)
+    {
+        const Vertex *v[3] = {&buf[cur][0], &buf[cur][j], &buf[cur][j + 1]};
+        ScreenTriangle<typename Shader::Varying> t;
+        for (int k = 0; k < 3; k++)
+        {
+            t.v[k] = toScreen(ViewPort, v[k]->p);
+            t.rw[k] = 1.f / v[k]->p.w;
+            t.var[k] = v[k]->var;
+        }
+        shader.setup(t.var);
+        out.push_back(t);
+    }
+}
+
+
+//按三角形最近深度从前到后排序：深度量化为 16 位，两趟 8 位基数排序
+template <class Triangle>
+static void sortFrontToBack(std::vector<Triangle> &tris)
+{
+    int n = (int)tris.size();
+    if (n < 2) return;
+
+    std::vector<float> nearest(n);
+    float lo = std::numeric_limits<float>::max(), hi = -std::numeric_limits<float>::max();
+    for (int i = 0; i < n; i++)
+    {
+        const Triangle &t = tris[i];
+        nearest[i] = std::max({t.v[0].z, t.v[1].z, t.v[2].z});
+        lo = std::min(lo, nearest[i]);
+        hi = std::max(hi, nearest[i]);
+    }
+
+    //reverse-Z 越大越近，取反后升序即为从前到后
+    float scale = hi > lo ? 65535.f / (hi - lo) : 0.f;
+    std::vector<uint16_t> keys(n);
+    for (int i = 0; i < n; i++) keys[i] = (uint16_t)(65535 - (int)((nearest[i] - lo) * scale));
+
+    std::vector<int> order(n), tmp(n);
+    for (int i = 0; i < n; i++) order[i] = i;
+    for (int shift = 0; shift < 16; shift += 8)
+    {
+        int count[257] = {};
+        for (int i = 0; i < n; i++) count[((keys[order[i]] >> shift) & 0xff) + 1]++;
+        for (int b = 0; b < 256; b++) count[b + 1] += count[b];
+        for (int i = 0; i < n; i++) tmp[count[(keys[order[i]] >> shift) & 0xff]++] = order[i];
+        order.swap(tmp);
     }
+
+    std::vector<Triangle> sorted(n);
+    for (int i = 0; i < n; i++) sorted[i] = tris[order[i]];
+    tris.swap(sorted);
+}
+
+//一个像素的采样点颜色取平均，未覆盖的采样点取背景色 bg。SSE2 下一次处理 4 个采样点：按覆盖掩码与背景混合，展开到 16 位相加
+template <int S>
+static inline uint32_t resolvePixel(const uint32_t* sc, unsigned cov, uint32_t bg)
+{
+#ifdef SIMD_SSE2
+    const __m128i bits = _mm_setr_epi32(1, 2, 4, 8), zero = _mm_setzero_si128();
+    __m128i sum = zero, back = _mm_set1_epi32((int)bg);
+    for (int k = 0; k < S; k += 4)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i*)(sc + k));
+        __m128i m = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32((int)(cov >> k)), bits), bits);
+        c = _mm_or_si128(_mm_and_si128(m, c), _mm_andnot_si128(m, back));
+        sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_unpacklo_epi8(c, zero), _mm_unpackhi_epi8(c, zero)));
+    }
+    sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+    sum = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(S / 2)), S == 8 ? 3 : 2);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+#else
+    unsigned acc[4] = {S / 2, S / 2, S / 2, S / 2};
+    for (int k = 0; k < S; k++)
+    {
+        uint32_t c = cov >> k & 1 ? sc[k] : bg;
+        for (int i = 0; i < 4; i++) acc[i] += c >> (8 * i) & 255u;
+    }
+    uint32_t res = 0u;
+    for (int i = 0; i < 4; i++) res |= (acc[i] / S) << (8 * i);
+    return res;
+#endif
+}
+
+//全覆盖的内部像素各采样点颜色相同，不必求平均
+template <int S>
+static inline bool uniformSamples(const uint32_t* sc)
+{
+#ifdef SIMD_SSE2
+    __m128i first = _mm_set1_epi32((int)sc[0]);
+    int eq = 0xffff;
+    for (int k = 0; k < S; k += 4) eq &= _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(sc + k)), first));
+    return eq == 0xffff;
+#else
+    for (int k = 1; k < S; k++)
+        if (sc[k] != sc[0]) return false;
+    return true;
+#endif
+}
+
+//多重采样的 resolve：每个像素的采样点取平均写入画布，部分覆盖的像素混入画布原有的背景，完全未覆盖的像素不动，
+//连续 16 个像素都未覆盖时一次跳过。按行并行
+template <int S>
+static void resolveSamples(const SampleBuffer &samples, const ImageView &image)
+{
+    const unsigned full = (1u << S) - 1;
+    const int bytespp = image.bytespp;
+    const int width = samples.width, w = std::min(width, image.width), h = std::min(samples.height, image.height);
+    parallel_for(0, h, 16, [&](int y0, int y1)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            const unsigned char* crow = samples.coverage.data() + y * width;
+            unsigned char* dst = image.row(y);
+            for (int x = 0; x < w; x++)
+            {
+#ifdef SIMD_SSE2
+                if ((x & 15) == 0 && x + 16 <= w &&
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(crow + x)), _mm_setzero_si128())) == 0xffff)
+                {
+                    x += 15;
+                    continue;
+                }
+#endif
+                unsigned cov = crow[x];
+                if (!cov) continue;
+
+                int idx = x + y * width;
+                unsigned char* p = dst + x * bytespp;
+                const uint32_t* sc = samples.color.data() + (size_t)idx * S;
+                uint32_t res;
+                if (cov == full && uniformSamples<S>(sc)) res = sc[0];
+                else
+                {
+                    uint32_t bg = 0u;
+                    if (cov != full) memcpy(&bg, p, bytespp);
+                    res = resolvePixel<S>(sc, cov, bg);
+                }
+                memcpy(p, &res, bytespp);
+            }
+        }
+    });
 }
 
+void SampleBuffer::resolve(const ImageView &image) const
+{
+    if (samples == 8) resolveSamples<8>(*this, image);
+    else resolveSamples<4>(*this, image);
+}
 
 
-void render(Matrix &ViewPort, Matrix &Projection, Matrix &Rotation,
-            Vec3f &light_dir,
-            float ambient_light,
-            int width,
-            int height,
-            Zbuffer &zbuffer,
-            Model* model,
-            TGAImage* image)
+//按着色器实例化的整条管线：几何、裁剪、排序、光栅化与着色
+template <class Shader, class Target>
+static RenderStats renderWith(const Shader &shader,
+                              Matrix &ViewPort, Matrix &MVP,
+                              int width,
+                              int height,
+                              Zbuffer &zbuffer,
+                              Model* model,
+                              const std::vector<float> &intensity,
+                              const Target &target,
+                              const RenderOptions &options)
 {
+    typedef typename Shader::Varying Varying;
+
+    //几何阶段：变换到裁剪空间并执行顶点着色器，裁剪后再做透视除法和视口变换
+    std::vector<ScreenTriangle<Varying>> tris;
+    tris.reserve(model->nfaces() * 2);
     for (int i = 0; i < model->nfaces(); i++)
     {
         auto triangles = model->triangulate_face(i); // 将面拆分为多个三角形
 
         for (auto &triangle : triangles)
         {
-            Vec3i screen_coords[3];
-            Vec2i uv[3];
-            float intensity[3];
-
+            ClipVertex<Varying> poly[3];
             for (int j = 0; j < 3; j++)
             {
                 Vec3i idx = triangle[j];
-                screen_coords[j] = Vec3f(ViewPort * Projection * Rotation * Matrix(model->getVert(idx[0])));
-                uv[j] = model->getUv(idx[1]);
-                intensity[j] = std::max(model->getNorm(idx[2]) * light_dir, 0.f);
+                poly[j].p = transform(MVP, model->getVert(idx[0]));
+                VertexIn in = {model->getNorm(idx[2]), model->getUv(idx[1]), intensity[idx[2]], model->getVert(idx[0])};
+                shader.vertex(in, poly[j].var);
+            }
+            clipTriangle(poly, shader, ViewPort, tris);
+        }
+    }
+
+    if (options.sort_front_to_back) sortFrontToBack(tris);
+
+    RenderStats stats;
+    unsigned long long filled = zbuffer.stats.filled;
+    if (options.msaa)
+    {
+        //多重采样：逐采样点深度测试，每像素每三角形着色一次，帧内所有绘制完成后由调用者 resolve 到画布
+        SampleBuffer &samples = *options.msaa;
+        for (const ScreenTriangle<Varying> &t : tris)
+            stats.shaded += samples.samples == 8 ? drawTriangleMsaa<8>(t, shader, width, zbuffer, samples)
+                                                 : drawTriangleMsaa<4>(t, shader, width, zbuffer, samples);
+        stats.covered = zbuffer.stats.filled - filled;
+        return stats;
+    }
+
+    if (options.mode == RenderMode::Visibility)
+    {
+        //第一遍只写深度与三角形编号；编号先全部重置，之前的绘制留下的编号指向的是别的三角形列表
+        zbuffer.ids.assign(zbuffer.buffer.size(), Zbuffer::NO_ID);
+        for (int i = 0; i < (int)tris.size(); i++)
+        {
+            ScreenTriangle<Varying> &t = tris[i];
+            triangleDepth(t.v[0], t.v[1], t.v[2], (uint32_t)i, width, zbuffer);
+        }
+        //第二遍对可见像素着色
+        stats.shaded = shadeVisibility(tris, shader, width, height, zbuffer, target);
+    }
+    else
+    {
+        unsigned long long passed = zbuffer.stats.passed;
+        for (const ScreenTriangle<Varying> &t : tris) drawTriangle(t, shader, width, zbuffer, target);
+        stats.shaded = zbuffer.stats.passed - passed;
+    }
+
+    stats.covered = zbuffer.stats.filled - filled;
+    return stats;
+}
+
+
+CameraRays::CameraRays(Matrix &ViewPort, Matrix &Projection, Matrix &Rotation)
+{
+    //视空间到模型空间：p_o = R^T (p_v - t)
+    auto toObject = [&Rotation](const Vec3f &v)
+    {
+        return Vec3f(Rotation[0][0] * v.x + Rotation[1][0] * v.y + Rotation[2][0] * v.z,
+                     Rotation[0][1] * v.x + Rotation[1][1] * v.y + Rotation[2][1] * v.z,
+                     Rotation[0][2] * v.x + Rotation[1][2] * v.y + Rotation[2][2] * v.z);
+    };
+    c = -1.f / Projection[3][2];
+    origin = toObject(Vec3f(-Rotation[0][3], -Rotation[1][3], c - Rotation[2][3]));
+    ex = toObject(Vec3f(1.f, 0.f, 0.f));
+    ey = toObject(Vec3f(0.f, 1.f, 0.f));
+    ez = toObject(Vec3f(0.f, 0.f, -c));
+    vx = ViewPort[0][3];
+    vy = ViewPort[1][3];
+    vsx = 1.f / ViewPort[0][0];
+    vsy = 1.f / ViewPort[1][1];
+    for (int k = 0; k < 4; k++)
+    {
+        p2[k] = Projection[2][k];
+        p3[k] = Projection[3][k];
+    }
+}
+
+
+//atan2 的多项式近似，最大误差约 1e-5 弧度，在 1024 宽的等距柱状纹理上不到 0.01 个纹素
+static inline float fastAtan2(float y, float x)
+{
+    float ax = std::fabs(x), ay = std::fabs(y);
+    float lo = std::min(ax, ay), hi = std::max(ax, ay);
+    if (hi == 0.f) return 0.f;
+    float q = lo / hi, q2 = q * q;
+    float r = q * (0.99997726f + q2 * (-0.33262347f + q2 * (0.19354346f + q2 * (-0.11643287f + q2 * (0.05265332f + q2 * -0.01172120f)))));
+    if (ay > ax) r = 1.57079633f - r;
+    if (x < 0.f) r = 3.14159265f - r;
+    return y < 0.f ? -r : r;
+}
+
+#ifdef SIMD_SSE2
+static inline __m128 blend(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+//四路 fastAtan2
+static inline __m128 fastAtan2(__m128 y, __m128 x)
+{
+    const __m128 sign = _mm_set1_ps(-0.f);
+    __m128 ax = _mm_andnot_ps(sign, x), ay = _mm_andnot_ps(sign, y);
+    __m128 hi = _mm_max_ps(ax, ay);
+    __m128 q = _mm_div_ps(_mm_min_ps(ax, ay), _mm_max_ps(hi, _mm_set1_ps(1e-30f)));
+    __m128 q2 = _mm_mul_ps(q, q);
+    __m128 r = _mm_set1_ps(-0.01172120f);
+    r = _mm_add_ps(_mm_mul_ps(r, q2), _mm_set1_ps(0.05265332f));
+    r = _mm_add_ps(_mm_mul_ps(r, q2), _mm_set1_ps(-0.11643287f));
+    r = _mm_add_ps(_mm_mul_ps(r, q2), _mm_set1_ps(0.19354346f));
+    r = _mm_add_ps(_mm_mul_ps(r, q2), _mm_set1_ps(-0.33262347f));
+    r = _mm_add_ps(_mm_mul_ps(r, q2), _mm_set1_ps(0.99997726f));
+    r = _mm_mul_ps(r, q);
+    r = blend(_mm_cmpgt_ps(ay, ax), _mm_sub_ps(_mm_set1_ps(1.57079633f), r), r);
+    r = blend(_mm_cmplt_ps(x, _mm_setzero_ps()), _mm_sub_ps(_mm_set1_ps(3.14159265f), r), r);
+    return _mm_or_ps(r, _mm_and_ps(y, sign));
+}
+#endif
+
+//模型空间中与解析球求交的一帧常量，光线参见 CameraRays
+struct SphereCaster
+{
+    Vec3f oc;               //视点减球心
+    Vec3f ex, ey, ez;
+    float cq;               //|oc|² - r²
+    float inv_r;
+    float c;
+    float p2[4], p3[4];
+
+    //一行 n 个像素（n 为 4 的倍数）的求交，NDC 横坐标为 a0 + i·da，结果按 SoA 写入，未命中处 t 为 0
+    void row(float a0, float da, float b, int n, float* t, float* depth, float* u, float* v, Vec3f* normal) const
+    {
+        const float inv_2pi = .5f / 3.14159265f, inv_pi = 1.f / 3.14159265f;
+        Vec3f rowd = ey * b + ez;
+#ifdef SIMD_SSE2
+        const __m128 zero = _mm_setzero_ps();
+        __m128 a = _mm_add_ps(_mm_set1_ps(a0), _mm_mul_ps(_mm_set_ps(3.f, 2.f, 1.f, 0.f), _mm_set1_ps(da)));
+        __m128 a_step = _mm_set1_ps(4.f * da);
+        for (int i = 0; i < n; i += 4, a = _mm_add_ps(a, a_step))
+        {
+            __m128 dx = _mm_add_ps(_mm_mul_ps(a, _mm_set1_ps(ex.x)), _mm_set1_ps(rowd.x));
+            __m128 dy = _mm_add_ps(_mm_mul_ps(a, _mm_set1_ps(ex.y)), _mm_set1_ps(rowd.y));
+            __m128 dz = _mm_add_ps(_mm_mul_ps(a, _mm_set1_ps(ex.z)), _mm_set1_ps(rowd.z));
+            __m128 qa = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+            __m128 qb = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_set1_ps(oc.x)), _mm_mul_ps(dy, _mm_set1_ps(oc.y))),
+                                   _mm_mul_ps(dz, _mm_set1_ps(oc.z)));
+            __m128 disc = _mm_sub_ps(_mm_mul_ps(qb, qb), _mm_mul_ps(qa, _mm_set1_ps(cq)));
+            __m128 tt = _mm_div_ps(_mm_sub_ps(zero, _mm_add_ps(qb, _mm_sqrt_ps(_mm_max_ps(disc, zero)))), qa);
+            tt = _mm_and_ps(_mm_cmpge_ps(disc, zero), _mm_max_ps(tt, zero));
+            _mm_storeu_ps(t + i, tt);
+
+            __m128 at = _mm_mul_ps(a, tt), bt = _mm_mul_ps(_mm_set1_ps(b), tt);
+            __m128 zv = _mm_sub_ps(_mm_set1_ps(c), _mm_mul_ps(_mm_set1_ps(c), tt));
+            __m128 zc = _mm_add_ps(_mm_add_ps(_mm_mul_ps(at, _mm_set1_ps(p2[0])), _mm_mul_ps(bt, _mm_set1_ps(p2[1]))),
+                                   _mm_add_ps(_mm_mul_ps(zv, _mm_set1_ps(p2[2])), _mm_set1_ps(p2[3])));
+            __m128 w  = _mm_add_ps(_mm_add_ps(_mm_mul_ps(at, _mm_set1_ps(p3[0])), _mm_mul_ps(bt, _mm_set1_ps(p3[1]))),
+                                   _mm_add_ps(_mm_mul_ps(zv, _mm_set1_ps(p3[2])), _mm_set1_ps(p3[3])));
+            _mm_storeu_ps(depth + i, _mm_div_ps(zc, w));
+
+            __m128 r = _mm_set1_ps(inv_r);
+            __m128 nx = _mm_mul_ps(_mm_add_ps(_mm_set1_ps(oc.x), _mm_mul_ps(dx, tt)), r);
+            __m128 ny = _mm_mul_ps(_mm_add_ps(_mm_set1_ps(oc.y), _mm_mul_ps(dy, tt)), r);
+            __m128 nz = _mm_mul_ps(_mm_add_ps(_mm_set1_ps(oc.z), _mm_mul_ps(dz, tt)), r);
+            //经度 atan2(z,x)，纬度 asin(y) = atan2(y, sqrt(x²+z²))
+            __m128 lon = fastAtan2(nz, nx);
+            __m128 lat = fastAtan2(ny, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(nz, nz))));
+            _mm_storeu_ps(u + i, _mm_sub_ps(_mm_set1_ps(.5f), _mm_mul_ps(lon, _mm_set1_ps(inv_2pi))));
+            _mm_storeu_ps(v + i, _mm_add_ps(_mm_set1_ps(.5f), _mm_mul_ps(lat, _mm_set1_ps(inv_pi))));
+
+            float fx[4], fy[4], fz[4];
+            _mm_storeu_ps(fx, nx);
+            _mm_storeu_ps(fy, ny);
+            _mm_storeu_ps(fz, nz);
+            for (int k = 0; k < 4; k++) normal[i + k] = Vec3f(fx[k], fy[k], fz[k]);
+        }
+#else
+        for (int i = 0; i < n; i++)
+        {
+            float a = a0 + i * da;
+            Vec3f d = ex * a + rowd;
+            float qa = d * d, qb = oc * d;
+            float disc = qb * qb - qa * cq;
+            float tt = disc >= 0.f ? std::max((-qb - std::sqrt(disc)) / qa, 0.f) : 0.f;
+            t[i] = tt;
+
+            float zv = c - c * tt;
+            depth[i] = (p2[0] * a * tt + p2[1] * b * tt + p2[2] * zv + p2[3]) /
+                       (p3[0] * a * tt + p3[1] * b * tt + p3[2] * zv + p3[3]);
+
+            Vec3f nn = (oc + d * tt) * inv_r;
+            u[i] = .5f - fastAtan2(nn.z, nn.x) * inv_2pi;
+            v[i] = .5f + fastAtan2(nn.y, std::sqrt(nn.x * nn.x + nn.z * nn.z)) * inv_pi;
+            normal[i] = nn;
+        }
+#endif
+    }
+};
+
+//解析球体路径：每个像素一条光线与模型拟合出的球求交，交点的法线即球面法线，
+//经纬度直接给出等距柱状纹理坐标，没有多边形化的棱角，且各行互不相关可以并行。
+//每行先批量求交写入行缓冲，再逐像素做深度测试与着色
+//要求投影矩阵为 main 中的透视形式：x、y 不变，w = 1 + Projection[3][2]·z，视点在 (0,0,-1/Projection[3][2])
+template <class Shader, class Target>
+static RenderStats raycastSphere(const Shader &shader,
+                                 Matrix &ViewPort, Matrix &Projection, Matrix &Rotation, Matrix &MVP,
+                                 int width,
+                                 int height,
+                                 Zbuffer &zbuffer,
+                                 Model* model,
+                                 const Target &target)
+{
+    typedef typename Shader::Varying Varying;
+
+    Vec3f center = model->sphereCenter();
+    float radius = model->sphereRadius();
+
+    CameraRays camera(ViewPort, Projection, Rotation);
+    SphereCaster caster;
+    caster.oc = camera.origin - center;
+    caster.ex = camera.ex;
+    caster.ey = camera.ey;
+    caster.ez = camera.ez;
+    caster.cq = caster.oc * caster.oc - radius * radius;
+    caster.inv_r = 1.f / radius;
+    caster.c = camera.c;
+    std::copy(camera.p2, camera.p2 + 4, caster.p2);
+    std::copy(camera.p3, camera.p3 + 4, caster.p3);
+
+    //屏幕包围矩形：投影球的包围立方体的 8 个角点，有角点在视点之后时退化为整屏
+    int x0 = 0, y0 = 0, x1 = width - 1, y1 = height - 1;
+    {
+        Matrix M = ViewPort * MVP;
+        float lo_x = std::numeric_limits<float>::max(), lo_y = lo_x, hi_x = -lo_x, hi_y = -lo_x;
+        bool behind = false;
+        for (int k = 0; k < 8; k++)
+        {
+            Vec3f p(center.x + (k & 1 ? radius : -radius),
+                    center.y + (k & 2 ? radius : -radius),
+                    center.z + (k & 4 ? radius : -radius));
+            Vec4f q = transform(M, p);
+            if (q.w <= 0.f) { behind = true; break; }
+            lo_x = std::min(lo_x, q.x / q.w); hi_x = std::max(hi_x, q.x / q.w);
+            lo_y = std::min(lo_y, q.y / q.w); hi_y = std::max(hi_y, q.y / q.w);
+        }
+        if (!behind)
+        {
+            x0 = std::max(x0, (int)std::floor(lo_x)); x1 = std::min(x1, (int)std::ceil(hi_x));
+            y0 = std::max(y0, (int)std::floor(lo_y)); y1 = std::min(y1, (int)std::ceil(hi_y));
+        }
+    }
+    RenderStats stats;
+    if (x0 > x1 || y0 > y1) return stats;
+
+    const float a0 = camera.ndcX(x0 + .5f);
+    const int span = (x1 - x0 + 4) & ~3;
+    const Vec3f light = shader.u.light_dir;
+
+    std::atomic<unsigned long long> hit(0), covered(0);
+    std::atomic<uint32_t> nearest(0u);
+    parallel_for(y0, y1 + 1, 16, [&](int ya, int yb)
+    {
+        std::vector<float> t(span), depth(span), u(span), v(span);
+        std::vector<Vec3f> normal(span);
+        unsigned long long count = 0, filled = 0;
+        uint32_t znear = 0u;
+        for (int y = ya; y < yb; y++)
+        {
+            caster.row(a0, camera.vsx, camera.ndcY(y + .5f), span, t.data(), depth.data(), u.data(), v.data(), normal.data());
+            for (int i = 0; i <= x1 - x0; i++)
+            {
+                if (t[i] <= 0.f) continue;
+                int idx = x0 + i + y * width;
+                bool fresh = zbuffer.buffer[idx] == 0u;
+                if (!zbuffer.test(idx, depth[i])) continue;
+                znear = std::max(znear, zbuffer.buffer[idx]);
+                filled += fresh;
+
+                const Vec3f &n = normal[i];
+                VertexIn in = {n, model->texel(Vec2f(std::min(u[i], .99999f), std::min(v[i], .99999f))), std::max(n * light, 0.f), center + n * radius};
+                Varying var;
+                shader.vertex(in, var);
+                target.put(shader, idx, var);
+                count++;
             }
+        }
+        hit += count;
+        covered += filled;
+        uint32_t cur = nearest.load();
+        while (cur < znear && !nearest.compare_exchange_weak(cur, znear)) {}
+    });
+
+    //直接写了深度缓冲，把覆盖到的 tile 标记为脏，使后续的 Hi-Z 测试保持保守
+    for (int ty = y0 / Zbuffer::TILE; ty <= y1 / Zbuffer::TILE; ty++)
+        for (int tx = x0 / Zbuffer::TILE; tx <= x1 / Zbuffer::TILE; tx++)
+            zbuffer.markTile(tx, ty, nearest);
+
+    zbuffer.stats.tested += hit;
+    zbuffer.stats.passed += hit;
+    zbuffer.stats.filled += covered;
+    stats.shaded = hit;
+    stats.covered = covered;
+    return stats;
+}
 
-            triangleDraw(screen_coords[0], screen_coords[1], screen_coords[2],
-                     intensity[0], intensity[1], intensity[2],
-                     uv[0], uv[1], uv[2],
-                     ambient_light,
-                     width,
-                     zbuffer,
-                     model,
-                     image);
+
+//阴影贴图：顶点只变换一次到光源空间，再用 SIMD 的只写深度光栅化画入贴图，不做纹理与着色
+//三个顶点法线都背向光源的三角形不可能离光源最近，直接跳过
+static void shadowPass(Model* model, ShadowMap &shadow, const Vec3f &light)
+{
+    shadow.begin(model->sphereCenter(), model->boundRadius(), light);
+    std::vector<Vec3f> verts(model->nverts());
+    for (int i = 0; i < (int)verts.size(); i++) verts[i] = shadow.project(model->getVert(i));
+    for (int i = 0; i < model->nfaces(); i++)
+        for (auto &triangle : model->triangulate_face(i))
+        {
+            if (model->getNorm(triangle[0][2]) * shadow.axis_l < 0.f &&
+                model->getNorm(triangle[1][2]) * shadow.axis_l < 0.f &&
+                model->getNorm(triangle[2][2]) * shadow.axis_l < 0.f) continue;
+            rasterizeDepth(verts[triangle[0][0]], verts[triangle[1][0]], verts[triangle[2][0]], shadow.depth);
         }
+}
+
+
+RenderStats render(Matrix &ViewPort, Matrix &Projection, Matrix &Rotation,
+                   Vec3f &light_dir,
+                   float ambient_light,
+                   int width,
+                   int height,
+                   Zbuffer &zbuffer,
+                   Model* model,
+                   TGAImage* image,
+                   const RenderOptions &options)
+{
+    Matrix MVP = Projection * Rotation;
+
+    //旋转是正交矩阵，把光照方向与半程向量用转置变换到模型空间一次，法线保持不动
+    auto toObject = [&Rotation](const Vec3f &v)
+    {
+        return Vec3f(Rotation[0][0] * v.x + Rotation[1][0] * v.y + Rotation[2][0] * v.z,
+                     Rotation[0][1] * v.x + Rotation[1][1] * v.y + Rotation[2][1] * v.z,
+                     Rotation[0][2] * v.x + Rotation[1][2] * v.y + Rotation[2][2] * v.z);
+    };
+    ShaderUniforms uniforms = {model, toObject(light_dir), toObject(options.half), ambient_light, options.specular, options.shininess, options.shadow_map};
+    if (options.shadow_map && options.shading != Shading::Unlit) shadowPass(model, *options.shadow_map, uniforms.light_dir);
+
+    //球体模型走解析求交路径，需要透视投影；多重采样只在光栅化路径上实现
+    bool sphere = !options.msaa && Projection[3][2] < 0.f &&
+                  (options.sphere == SpherePath::Force || (options.sphere == SpherePath::Auto && model->isSphere()));
+
+    //光照阶段：整个网格的顶点漫反射强度一次批量算完，三角形建立时按法线编号取用
+    std::vector<float> intensity;
+    if (!sphere) model->lighting(uniforms.light_dir, intensity);
+    auto drawTo = [&](const auto &shader, const auto &target)
+    {
+        if (sphere) return raycastSphere(shader, ViewPort, Projection, Rotation, MVP, width, height, zbuffer, model, target);
+        return renderWith(shader, ViewPort, MVP, width, height, zbuffer, model, intensity, target, options);
+    };
+    //有 HDR 渲染目标时着色结果写入它，多重采样仍然 resolve 到画布
+    auto draw = [&](const auto &shader)
+    {
+        if (options.hdr && !options.msaa) return drawTo(shader, HdrTarget{options.hdr});
+        return drawTo(shader, CanvasTarget{image->buffer(), image->get_bytespp()});
+    };
+
+    //每种着色方式对应一份独立实例化的管线
+    //有阴影贴图时受光照的着色器换成 Shadowed 版本
+    ShadowMap* shadow = options.shadow_map;
+    switch (options.shading)
+    {
+        case Shading::Unlit:      return draw(UnlitShader(uniforms));
+        case Shading::Flat:       return shadow ? draw(Shadowed<FlatShader>(uniforms)) : draw(FlatShader(uniforms));
+        case Shading::Phong:      return shadow ? draw(Shadowed<PhongShader>(uniforms)) : draw(PhongShader(uniforms));
+        case Shading::BlinnPhong: return shadow ? draw(Shadowed<BlinnPhongShader>(uniforms)) : draw(BlinnPhongShader(uniforms));
+        default:                  return shadow ? draw(Shadowed<GouraudShader>(uniforms)) : draw(GouraudShader(uniforms));
     }
 }
 
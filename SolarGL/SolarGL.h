@@ -4,6 +4,9 @@
 #include <vector>
 #include <sstream>
 #include <iostream>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
 
 #include "tgaimage.h"
 
@@ -43,10 +46,22 @@ template <class t> struct Vec3
     template <class > friend std::ostream& operator<<(std::ostream& s, Vec3<t>& v);
 };
 
+template <class t> struct Vec4
+{
+    t x, y, z, w;
+    Vec4<t>() : x(t()), y(t()), z(t()), w(t()) {}
+    Vec4<t>(t _x, t _y, t _z, t _w) : x(_x), y(_y), z(_z), w(_w) {}
+    Vec4<t> operator +(const Vec4<t>& v) const { return Vec4<t>(x + v.x, y + v.y, z + v.z, w + v.w); }
+    Vec4<t> operator -(const Vec4<t>& v) const { return Vec4<t>(x - v.x, y - v.y, z - v.z, w - v.w); }
+    Vec4<t> operator *(float f)          const { return Vec4<t>(x * f, y * f, z * f, w * f); }
+    t& operator[](const int i) { return i <= 0 ? x : (1 == i ? y : (2 == i ? z : w)); }
+};
+
 typedef Vec2<float> Vec2f;
 typedef Vec2<int>   Vec2i;
 typedef Vec3<float> Vec3f;
 typedef Vec3<int>   Vec3i;
+typedef Vec4<float> Vec4f;
 
 template <> template <> Vec3<int>::Vec3(const Vec3<float>& v);
 template <> template <> Vec3<float>::Vec3(const Vec3<int>& v);
@@ -87,55 +102,299 @@ class Model
 {
     std::vector<Vec3f> verts_;
     std::vector<std::vector<Vec3i>> faces_; // attention, this Vec3i means vertex/uv/normal
-    std::vector<Vec3f> norms_;
+    std::vector<Vec3f> norms_;              //载入时已归一化
+    std::vector<float> nx_, ny_, nz_;       //法线的 SoA 副本，长度补齐到 4 的倍数，供光照阶段批量计算
     std::vector<Vec2f> uv_;
     TGAImage diffusemap_;
+    //顶点的外接球拟合：包围盒中心，平均半径，以及顶点到中心距离的最大相对偏差
+    Vec3f sphere_center_;
+    float sphere_radius_ = 0.f;
+    float sphere_error_ = 1.f;
+    float bound_radius_ = 0.f;  //包围球半径（以 sphere_center_ 为中心的最大顶点距离）
     void load_texture(std::string filename, const char *suffix, TGAImage &img);
 public:
-    Model(const char* filename);
+    //texture_suffix 选择纹理缓存：".tga" 映射未压缩文件，".qoi" 解码 QOI 文件
+    Model(const char* filename, const char* texture_suffix = ".tga");
     ~Model();
     int nfaces();
+    int nverts();
+    int nnorms();
     Vec3f getNorm(int idx);
+    void lighting(const Vec3f &light, std::vector<float> &intensity);  //一次算出所有法线的 max(n·light, 0)
     Vec3f getVert(int idx);
-    Vec2i getUv(int idx);
+    Vec2f getUv(int idx);   //纹素坐标，保留小数部分
+    Vec2f texel(const Vec2f &uv);   //[0,1] 纹理坐标转为纹素坐标
+    //模型是否是（细分的）球体：顶点足够多且到中心的距离相对偏差不超过 tolerance
+    bool isSphere(float tolerance = .01f);
+    Vec3f sphereCenter() { return sphere_center_; }
+    float sphereRadius() { return sphere_radius_; }
+    float boundRadius() { return bound_radius_; }
     TGAColor diffuse(Vec2i uv);
     std::vector<int> face(int idx);
     std::vector<std::vector<Vec3i>> triangulate_face(int idx); // 新增方法：将面拆分为三角形
 };
 
 
+//深度格式：两者都按 reverse-Z 存储，值越大越近，0 表示无穷远
+enum class DepthFormat
+{
+    Float32,    //32位浮点，reverse-Z 下精度分布最均匀
+    Fixed24     //24位定点，[0,1] 量化到 0..2^24-1
+};
+
+//深度测试统计，用于观察提前剔除率
+struct DepthStats
+{
+    unsigned long long tested = 0;
+    unsigned long long passed = 0;
+    unsigned long long filled = 0;          //通过测试时原先还是清除值的像素，即新被覆盖的像素；多重采样时为此前没有采样点被覆盖的像素
+    unsigned long long tiles_rejected = 0;  //被分块 Hi-Z 整块跳过的 tile
+    unsigned long long tris_rejected  = 0;  //三角形建立阶段就被整体剔除的三角形
+
+    void reset() { tested = passed = filled = tiles_rejected = tris_rejected = 0; }
+    //未通过深度测试（被提前剔除）的比例
+    float rejectRate() const { return tested ? 1.f - (float)passed / (float)tested : 0.f; }
+};
+
 struct Zbuffer
 {
+    //Hi-Z 金字塔：第一层 8x8 像素一个 tile，第二层 8x8 个 tile 组成一个 block
+    static constexpr int TILE  = 8;
+    static constexpr int BLOCK = 8;
+
     int width;
     int height;
-    //缓存区
-    std::vector<int> buffer;
+    DepthFormat format;
+    //缓存区，两种格式都以 uint32 存储：非负浮点数的位模式与数值同序，可以直接按整数比较
+    std::vector<uint32_t> buffer;
+    //可见性缓冲：每个像素最近三角形的编号，只在 Visibility 模式下分配；每次绘制前重置为 NO_ID
+    std::vector<uint32_t> ids;
+    static constexpr uint32_t NO_ID = UINT32_MAX;
+    DepthStats stats;
 
-    Zbuffer(const int w, const int h) : width(w), height(h), buffer(w * h)
-    {
-        for (int i=0; i<width*height; i++)
-        {
-            buffer[i] = std::numeric_limits<int>::min();
-        }
-    }
+    int tiles_x, tiles_y;
+    int blocks_x, blocks_y;
+    //每个 tile / block 的最远（最小）与最近（最大）深度；最远值在写入后惰性重算
+    std::vector<uint32_t> tile_far, tile_near;
+    std::vector<uint32_t> block_far;
+    std::vector<unsigned char> tile_dirty, block_dirty;
+
+    Zbuffer(const int w, const int h, DepthFormat fmt = DepthFormat::Float32);
 
     ~Zbuffer()
     {
         //缓存缩为0
-        buffer = std::vector<int>();
+        buffer = std::vector<uint32_t>();
+    }
+    void fresh();
+
+    //把 [0,1] 的 reverse-Z 深度编码为可比较的整数
+    uint32_t encode(float z) const
+    {
+        z = z > 0.f ? z : 0.f;
+        if (format == DepthFormat::Fixed24) return (uint32_t)((z < 1.f ? z : 1.f) * 16777215.f + .5f);
+        return std::bit_cast<uint32_t>(z);
     }
-    void fresh()
+
+    float decode(uint32_t d) const
     {
-        for (int i=0; i<width*height; i++)
+        if (format == DepthFormat::Fixed24) return (float)d / 16777215.f;
+        return std::bit_cast<float>(d);
+    }
+
+    //深度测试并写入，更近（值更大）时通过
+    bool test(int idx, float z)
+    {
+        uint32_t d = encode(z);
+        if (buffer[idx] < d)
         {
-            buffer[i] = std::numeric_limits<int>::min();
+            buffer[idx] = d;
+            return true;
         }
+        return false;
     }
 
+    //tile 内已存储的最远深度，脏时从像素重算
+    uint32_t tileFar(int tx, int ty);
+    uint32_t tileNear(int tx, int ty) const { return tile_near[tx + ty * tiles_x]; }
+    //block 内已存储的最远深度，脏时从 tile 重算
+    uint32_t blockFar(int bx, int by);
+    //tile 中有像素写入后调用，znear 为写入深度的上界
+    void markTile(int tx, int ty, uint32_t znear);
+    //像素矩形 [x0,x1]x[y0,y1] 中的已有深度是否全部不远于 znear，即最近深度为 znear 的图元一定被遮挡
+    bool occluded(int x0, int y0, int x1, int y1, uint32_t znear);
 };
 
+//方向光的阴影贴图：模型空间中沿光照方向的正交投影，覆盖模型的包围球。
+//深度与 Zbuffer 一样越大越靠近光源，固定用 Float32 以便深度测试直接比较位模式
+struct ShadowMap
+{
+    int size;
+    Zbuffer depth;
+    Vec3f center;
+    Vec3f axis_u, axis_v, axis_l;   //贴图的 x、y 轴与指向光源的方向
+    float radius = 1.f;
+    float scale = 1.f;              //模型空间单位到贴图像素
+    float bias = 0.f;               //深度偏移，避免表面自遮挡产生条纹
+
+    explicit ShadowMap(int size = 1024);
+
+    //按包围球与模型空间中指向光源的方向建立投影，并清空深度
+    void begin(const Vec3f &c, float r, const Vec3f &light);
+
+    //模型空间点到贴图：x、y 为像素坐标，z 为深度
+    Vec3f project(const Vec3f &p) const
+    {
+        Vec3f d = p - center;
+        return Vec3f((d * axis_u) * scale + size * .5f, (d * axis_v) * scale + size * .5f, (d * axis_l + radius) * (.5f / radius));
+    }
+
+    //接收阴影的点先沿法线外推 1.5 个纹素再投影，掠射角处常数偏移不够，靠它消除条纹
+    Vec3f receiver(const Vec3f &p, const Vec3f &n) const { return project(p + n * (1.5f / scale)); }
+
+    //双线性 PCF：与最近的 2x2 纹素分别比较，再按到纹素中心的距离加权。
+    //外推后的接收点可能落到 begin 留的边之外，坐标先限制在贴图内，超出的部分按边缘纹素处理
+    float lit(float x, float y, float z) const
+    {
+        x = std::clamp(x - .5f, 0.f, size - 1.f);
+        y = std::clamp(y - .5f, 0.f, size - 1.f);
+        int cx = std::min((int)x, size - 2), cy = std::min((int)y, size - 2);
+        float fx = x - cx, fy = y - cy, ref = z + bias;
+        const uint32_t* t = depth.buffer.data() + cx + cy * size;
+        float s00 = std::bit_cast<float>(t[0]) <= ref, s10 = std::bit_cast<float>(t[1]) <= ref;
+        float s01 = std::bit_cast<float>(t[size]) <= ref, s11 = std::bit_cast<float>(t[size + 1]) <= ref;
+        return (s00 + (s10 - s00) * fx) * (1.f - fy) + (s01 + (s11 - s01) * fx) * fy;
+    }
+};
+
+//多重采样缓冲：每个像素 samples 个采样点，各自保存深度与颜色，另有一个每像素的覆盖掩码记录本帧写过哪些采样点。
+//未覆盖的采样点视为无穷远、颜色取画布原有的背景，所以换帧时只需清空掩码，不必清空深度与颜色
+struct SampleBuffer
+{
+    int width;
+    int height;
+    int samples;                            //4 或 8
+    std::vector<uint32_t> depth;            //第 idx 个像素的采样点在 [idx * samples, idx * samples + samples)，格式同 Zbuffer
+    std::vector<uint32_t> color;            //BGRA，与 depth 同序
+    std::vector<unsigned char> coverage;    //每像素一字节，第 s 位表示第 s 个采样点已写入
 
-void triangleDraw(Vec3i &t0, Vec3i &t1, Vec3i &t2,
+    //samples 取 8 以外的值都按 4 处理
+    SampleBuffer(int w, int h, int samples);
+    void fresh();
+    //帧内所有绘制完成后调用一次：每个像素的采样点取平均写入画布的视图，部分覆盖的像素与画布原有的背景按覆盖比例混合，
+    //未覆盖的像素不动。背景只能混入一次，不能在每次绘制后 resolve，否则前一次的部分覆盖会被重复叠加
+    void resolve(const ImageView &image) const;
+    //采样缓冲占用的内存，不含 Zbuffer 与画布
+    size_t bytes() const { return (depth.size() + color.size()) * sizeof(uint32_t) + coverage.size(); }
+};
+
+//HDR 渲染目标的通道格式
+enum class HdrFormat
+{
+    Half16,         //RGBA16F，每像素 8 字节，11 位有效精度，足够累加与色调映射
+    Float32         //RGBA32F，每像素 16 字节
+};
+
+//HDR 渲染目标：每像素 B、G、R、A 四个线性浮点通道，顺序同画布，1 对应 8 位的 255。
+//着色器写入 radiance，光照乘法不再逐步截断到 8 位，多光源或多遍累加可以超过 1；
+//帧末由 resolve 一次性量化到 8 位画布
+struct HdrBuffer
+{
+    int width;
+    int height;
+    HdrFormat format;
+    std::vector<float> f32;         //Float32 时使用，每像素 4 个
+    std::vector<uint16_t> f16;      //Half16 时使用，每像素 4 个，IEEE 半精度位模式
+
+    HdrBuffer(int w, int h, HdrFormat fmt = HdrFormat::Half16);
+    //清为 0：黑色且未覆盖
+    void fresh();
+    void store(int idx, const Vec4f &c);
+    Vec4f load(int idx) const;
+    //第 y 行的单精度颜色，每像素 4 个：Float32 时直接指向缓冲，Half16 时转换到 scratch（至少 width * 4 个）再返回它
+    const float* row(int y, float* scratch) const;
+    //钳制到 [0,1] 后乘 255 四舍五入写入画布的视图，按行并行，一次转换 4 个像素；画布不足 4 通道时丢弃多余的通道
+    void resolve(const ImageView &image) const;
+    size_t bytes() const { return f32.size() * sizeof(float) + f16.size() * sizeof(uint16_t); }
+};
+
+
+enum class RenderMode
+{
+    Forward,        //逐三角形光栅化并立即着色，被覆盖的像素会重复着色
+    Visibility      //先只写深度和三角形编号，再并行地对每个可见像素着色一次
+};
+
+//着色方式，每种对应 Shader.h 中的一个着色器，管线按着色器分别实例化
+enum class Shading
+{
+    Unlit,          //只有纹理
+    Flat,           //每个三角形一个光照值
+    Gouraud,        //顶点光照插值
+    Phong,          //逐像素漫反射
+    BlinnPhong      //逐像素漫反射加高光
+};
+
+//球体模型的解析光线求交路径
+enum class SpherePath
+{
+    Off,            //总是光栅化网格
+    Auto,           //检测到模型是球体时逐像素与解析球求交，按经纬度采样等距柱状纹理
+    Force           //声明模型就是球体，直接使用拟合出的中心与半径
+};
+
+struct RenderOptions
+{
+    RenderMode mode = RenderMode::Forward;
+    Shading shading = Shading::Gouraud;
+    Vec3f half = Vec3f(0.f, 0.f, 1.f);  //Blinn-Phong 半程向量
+    float specular = .5f;               //高光强度
+    float shininess = 32.f;             //高光指数
+    bool sort_front_to_back = false;    //光栅化前按最近深度从前到后排序三角形，提高提前深度剔除率
+    SpherePath sphere = SpherePath::Off;    //球体模型是否走解析求交路径
+    ShadowMap* shadow_map = nullptr;        //非空时先从光源方向渲染阴影贴图，着色时做 PCF 查询
+    SampleBuffer* msaa = nullptr;           //非空时多重采样：逐采样点深度测试，每像素每三角形只着色一次，由调用者在帧末 resolve 到画布；
+                                            //此时总是前向光栅化，不走可见性缓冲与解析球体路径
+    HdrBuffer* hdr = nullptr;               //非空时着色结果不截断地写入 HDR 渲染目标而不是画布，由调用者在帧末 resolve，光线追踪引擎同样写入它；
+                                            //多重采样的采样点颜色是 8 位的，resolve 直接写画布，此时不使用，调用者也不应再 resolve 它
+};
+
+//单帧着色统计
+struct RenderStats
+{
+    unsigned long long shaded  = 0;    //执行了纹理采样和光照的像素次数
+    unsigned long long covered = 0;    //本次绘制新覆盖的像素数，不含之前的绘制已覆盖的，各次绘制相加即整帧的覆盖像素数
+
+    //平均每个可见像素被着色的次数
+    float overdraw() const { return covered ? (float)shaded / (float)covered : 0.f; }
+};
+
+
+//透视相机在模型空间中的光线。视空间里视点在 (0,0,c)，NDC 坐标 (a,b) 的光线方向为 (a, b, -c)，
+//参数 t 处的点为 (a·t, b·t, c - c·t)；方向变换到模型空间后为 a·ex + b·ey + ez。
+//要求投影矩阵为 main 中的透视形式：x、y 不变，w = 1 + Projection[3][2]·z
+struct CameraRays
+{
+    Vec3f origin;           //模型空间中的视点
+    Vec3f ex, ey, ez;
+    float c;
+    float vx, vy, vsx, vsy; //像素到 NDC：a = (x - vx)·vsx
+    float p2[4], p3[4];     //投影矩阵第 2、3 行，用于求 reverse-Z 深度
+
+    CameraRays(Matrix &ViewPort, Matrix &Projection, Matrix &Rotation);
+
+    float ndcX(float x) const { return (x - vx) * vsx; }
+    float ndcY(float y) const { return (y - vy) * vsy; }
+    Vec3f direction(float a, float b) const { return ex * a + ey * b + ez; }
+    //NDC (a,b) 的光线在参数 t 处的 reverse-Z 深度
+    float depth(float a, float b, float t) const
+    {
+        float zv = c - c * t;
+        return (p2[0] * a * t + p2[1] * b * t + p2[2] * zv + p2[3]) / (p3[0] * a * t + p3[1] * b * t + p3[2] * zv + p3[3]);
+    }
+};
+
+void triangleDraw(Vec3f &t0, Vec3f &t1, Vec3f &t2,
                   float &ity0, float &ity1, float &ity2,
                   Vec2i &uv0, Vec2i &uv1, Vec2i &uv2,
                   float ambient_light,
@@ -144,13 +403,20 @@ void triangleDraw(Vec3i &t0, Vec3i &t1, Vec3i &t2,
                   Model* model,
                   TGAImage* image);
 
-void render(Matrix &ViewPort, Matrix &Projection, Matrix &Rotation,
-            Vec3f &light_dir,
-            float ambient_light,
-            int width,
-            int height,
-            Zbuffer &zbuffer,
-            Model* model,
-            TGAImage* image);
+//只写深度的光栅化，zbuffer.ids 非空时同时写入三角形编号 id
+void triangleDepth(Vec3f &t0, Vec3f &t1, Vec3f &t2,
+                   uint32_t id,
+                   int width,
+                   Zbuffer &zbuffer);
+
+RenderStats render(Matrix &ViewPort, Matrix &Projection, Matrix &Rotation,
+                   Vec3f &light_dir,
+                   float ambient_light,
+                   int width,
+                   int height,
+                   Zbuffer &zbuffer,
+                   Model* model,
+                   TGAImage* image,
+                   const RenderOptions &options = RenderOptions());
 
 std::vector<std::string> getImageFiles(const std::string& directory);
\ No newline at end of file
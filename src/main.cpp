@@ -2,8 +2,20 @@
 #include <vector>
 #include <filesystem>
 #include <numbers>
+#include <chrono>
+#include <fstream>
+#include <cstring>
 
 #include "SolarGL.h"
+#include "RayTracer.h"
+#include "PostProcess.h"
+#include "convert.h"
+#include "png.h"
+#include "parallel.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image/stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image/stb_image_write.h"
 
 
 namespace fs = std::filesystem;
@@ -11,7 +23,52 @@ namespace fs = std::filesystem;
 
 constexpr int width = 1000;
 constexpr int height = 1000;
-constexpr int depth = 255;
+//近平面距离，reverse-Z 深度 = z_near / 视距，远平面在无穷远
+constexpr float z_near = 1.f;
+//深度缓冲格式：Float32 或 Fixed24
+constexpr DepthFormat depth_format = DepthFormat::Float32;
+//渲染模式：Forward 逐三角形着色，Visibility 先写可见性缓冲再对每个可见像素着色一次
+constexpr RenderMode render_mode = RenderMode::Forward;
+//每帧按深度从前到后排序三角形，让深度测试尽早剔除被遮挡的片元
+constexpr bool sort_front_to_back = true;
+//着色方式：Unlit / Flat / Gouraud / Phong / BlinnPhong
+constexpr Shading shading = Shading::Gouraud;
+//球体模型（如行星）逐像素与解析球求交：Off / Auto / Force
+constexpr SpherePath sphere_path = SpherePath::Auto;
+//渲染前在几种分辨率下对比光栅化与解析球体路径的耗时
+constexpr bool benchmark_sphere = false;
+//渲染引擎：false 为光栅化 render()，true 为带阴影与环境光遮蔽的 BVH 光线追踪
+constexpr bool ray_trace = false;
+//光线追踪的质量预设：Fast / Balanced / Quality
+constexpr TracePreset trace_preset = TracePreset::Fast;
+//光栅化时先从光源方向渲染一张阴影贴图，受光照的着色器用 PCF 采样得到投射阴影
+constexpr bool shadows = false;
+//多重采样抗锯齿的每像素采样数：1 关闭，4 或 8
+constexpr int msaa_samples = 1;
+//渲染前对比不同采样数下的每帧耗时与额外内存
+constexpr bool benchmark_msaa = false;
+//HDR 渲染目标的通道位数：0 关闭直接写画布，16 为 RGBA16F，32 为 RGBA32F；着色不再逐步截断，帧末一次量化到画布。
+//多重采样的采样点颜色是 8 位的，直接 resolve 到画布，开启多重采样时不分配 HDR 渲染目标
+constexpr int hdr_bits = 0;
+//输出前对整帧做后处理：辉光、色调映射、可选的 sRGB 编码与 FXAA，参数见 PostOptions；有 HDR 渲染目标时直接读取它的浮点颜色
+constexpr bool post_process = false;
+//结束后反复解码第一帧输出与模型纹理，统计 TGA 读取的吞吐量与只读映射的耗时
+constexpr bool benchmark_tga = false;
+//结束后用第一帧输出对比各种重采样滤波器：缩略图（1/4）、预览（放大 2 倍）与 8 级金字塔的耗时
+constexpr bool benchmark_scale = false;
+//每帧另外转换为 YUV420p 追加到 output/output.yuv，可直接交给编码器：ffmpeg -f rawvideo -pix_fmt yuv420p -s 宽x高 -i output.yuv
+constexpr bool yuv_output = false;
+//输出帧序列的格式：false 写 TGA（RLE），true 写 QOI，无损且体积与编码耗时都更小，ffplay 同样可以播放
+constexpr bool qoi_output = false;
+//输出帧序列写 PNG：滤波与 deflate 分块在线程池上并行，png_level 为 PNG_FAST 时最快；qoi_output 打开时以 QOI 为准
+constexpr bool png_output = false;
+constexpr int png_level = PNG_FAST;
+//纹理缓存改用 QOI：模型同名的 TGA 纹理编码一次存为 .qoi，之后载入时整文件解码而不是映射
+constexpr bool qoi_textures = false;
+//结束后用每 10 帧中的一帧比较 TGA RLE、QOI 与 PNG（stb_image_write）的编码耗时、文件大小与解码耗时
+constexpr bool benchmark_qoi = false;
+//结束后把第 0 帧放大到 4K 与 8K，比较多线程 PNG 写入（快速与默认级别）和单线程 stb_image_write 的耗时
+constexpr bool benchmark_png = false;
 
 
 Vec3f light_dir = Vec3f(1,-1,1).normalize();
@@ -19,8 +76,8 @@ Vec3f camera(0,0,5);
 
 //视线方向
 Vec3f view(0, 0, -1);
-//计算半程向量
-Vec3f half = (light_dir + view).normalize();
+//计算半程向量：光源方向与指向观察者的方向（视线反方向）之和
+Vec3f half = (light_dir - view).normalize();
 
 float ambient_light = .0;
 
@@ -31,11 +88,10 @@ Matrix viewPort(int x, int y, int w, int h)
 	Matrix m = Matrix::identity(4);
 	m[0][3] = x+w/2.f;
 	m[1][3] = y+h/2.f;
-	m[2][3] = depth/2.f;
 
 	m[0][0] = w/2.f;
 	m[1][1] = h/2.f;
-	m[2][2] = depth/2.f;
+	//深度直接使用投影得到的 reverse-Z 值，不再压缩到 0..255
 	return m;
 }
 
@@ -50,6 +106,250 @@ Matrix rotationY(float angle)
 }
 
 
+//光栅化与解析球体路径在不同分辨率下的每帧耗时，只统计 render() 本身
+void benchmarkSphere(Matrix &Projection, const RenderOptions &base)
+{
+	const int sizes[] = {256, 512, 1000, 2048};
+	const int frames = 30;
+	std::cout << "resolution, raster ms/frame, sphere ms/frame" << std::endl;
+	for (int size : sizes)
+	{
+		Matrix ViewPort = viewPort(size/8, size/8, size*3/4, size*3/4);
+		Zbuffer zbuffer(size, size, depth_format);
+		TGAImage image(size, size, TGAImage::RGB);
+		double ms[2] = {0., 0.};
+		for (int path = 0; path < 2; path++)
+		{
+			RenderOptions options = base;
+			options.sphere = path ? SpherePath::Force : SpherePath::Off;
+			for (int i = 0; i < frames; i++)
+			{
+				Matrix Rotation = rotationY(i * (std::numbers::pi / frames));
+				auto start = std::chrono::steady_clock::now();
+				render(ViewPort, Projection, Rotation, light_dir, ambient_light, size, size, zbuffer, model, &image, options);
+				ms[path] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+				zbuffer.fresh();
+			}
+		}
+		std::cout << size << "x" << size << ", " << ms[0] / frames << ", " << ms[1] / frames << std::endl;
+	}
+}
+
+//不同采样数下的每帧耗时与采样缓冲占用的内存，只统计 render() 本身
+void benchmarkMsaa(Matrix &ViewPort, Matrix &Projection, const RenderOptions &base)
+{
+	const int counts[] = {1, 4, 8};
+	const int frames = 30;
+	Zbuffer zbuffer(width, height, depth_format);
+	TGAImage image(width, height, TGAImage::RGB);
+	double base_ms = 0.;
+	std::cout << "samples, ms/frame, time overhead, sample buffer MB" << std::endl;
+	for (int n : counts)
+	{
+		SampleBuffer* samples = n > 1 ? new SampleBuffer(width, height, n) : nullptr;
+		RenderOptions options = base;
+		options.msaa = samples;
+		//多重采样只在光栅化路径上实现，1x 也走光栅化才有可比性
+		options.sphere = SpherePath::Off;
+		double ms = 0.;
+		for (int i = 0; i < frames; i++)
+		{
+			Matrix Rotation = rotationY(i * (std::numbers::pi / frames));
+			auto start = std::chrono::steady_clock::now();
+			render(ViewPort, Projection, Rotation, light_dir, ambient_light, width, height, zbuffer, model, &image, options);
+			if (samples) samples->resolve(image.view());
+			ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			zbuffer.fresh();
+			if (samples) samples->fresh();
+		}
+		ms /= frames;
+		if (n == 1) base_ms = ms;
+		std::cout << n << ", " << ms << ", " << ms / base_ms << "x, " << (samples ? samples->bytes() / 1048576.0 : 0.) << std::endl;
+		delete samples;
+	}
+}
+
+//整文件解码的吞吐量，按解码后的像素数据计算 MB/s
+void benchmarkTga(const std::string &file)
+{
+	const int reads = 50;
+	TGAImage image;
+	//read_tga_file 每次都会往 cerr 打印尺寸，计时期间屏蔽
+	std::cerr.setstate(std::ios::failbit);
+	auto start = std::chrono::steady_clock::now();
+	bool ok = true;
+	for (int i = 0; i < reads && ok; i++) ok = image.read_tga_file(file.c_str());
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / reads;
+	std::cerr.clear();
+	if (!ok)
+	{
+		std::cerr << "Failed to read " << file << std::endl;
+		return;
+	}
+	double mb = (double)image.get_width() * image.get_height() * image.get_bytespp() / 1048576.0;
+	std::cout << "tga read " << file << ": " << ms << " ms, " << mb / ms * 1000. << " MB/s" << std::endl;
+
+	//只读映射：未压缩的文件不复制像素，耗时与文件大小基本无关
+	std::cerr.setstate(std::ios::failbit);
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < reads; i++) image.map_tga_file(file.c_str());
+	ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / reads;
+	std::cerr.clear();
+	std::cout << "tga map " << file << ": " << ms << " ms" << std::endl;
+}
+
+//按扩展名读取 TGA、QOI 或 PNG；PNG 经 stb_image 解码，灰度保持 1 字节，其余转为 BGR(A)
+bool readImage(TGAImage &image, const std::string &file)
+{
+	if (file.ends_with(".qoi")) return image.read_qoi_file(file.c_str());
+	if (!file.ends_with(".png")) return image.read_tga_file(file.c_str());
+	int w, h, n;
+	if (!stbi_info(file.c_str(), &w, &h, &n)) return false;
+	const int bpp = n == 1 ? 1 : (n == 3 ? 3 : 4);
+	unsigned char* rgb = stbi_load(file.c_str(), &w, &h, &n, bpp);
+	if (!rgb) return false;
+	image = TGAImage(w, h, bpp);
+	ConstImageView src(rgb, w, h, (long)w * bpp, bpp);
+	if (bpp == 1) memcpy(image.buffer(), rgb, (size_t)w * h);
+	else swap_red_blue(src, image.view());
+	stbi_image_free(rgb);
+	return true;
+}
+
+//stb_image_write 需要 RGB 顺序、自上而下的行，先交换红蓝通道，再按原点决定是否翻转
+bool writePng(TGAImage &image, const char* file)
+{
+	const int w = image.get_width(), h = image.get_height(), bpp = image.get_bytespp();
+	std::vector<unsigned char> rgb((size_t)w * h * bpp);
+	ImageView dst(rgb.data(), w, h, (long)w * bpp, bpp);
+	if (bpp == 1) memcpy(rgb.data(), image.buffer(), rgb.size());
+	else swap_red_blue(image.view(), dst);
+	stbi_flip_vertically_on_write(image.get_origin() == TGAImage::BOTTOM_LEFT);
+	return stbi_write_png(file, w, h, bpp, rgb.data(), w * bpp) != 0;
+}
+
+//同一批帧分别编码为 TGA RLE、QOI 与 PNG（自带写入的快速与默认级别，以及 stb_image_write）再读回，统计平均的编解码耗时与文件大小
+void benchmarkQoi(const std::vector<std::string> &files)
+{
+	const int formats = 5;
+	const char* names[] = {"tga rle", "qoi", "png fast", "png", "png stb"};
+	const char* temp[] = {"output/bench.tga", "output/bench.qoi", "output/bench.png", "output/bench.png", "output/bench.png"};
+	double encode_ms[formats] = {}, decode_ms[formats] = {}, bytes[formats] = {};
+	double raw = 0.;
+	int frames = 0;
+	std::cerr.setstate(std::ios::failbit);
+	for (const std::string &file : files)
+	{
+		TGAImage image;
+		if (!readImage(image, file)) continue;
+		frames++;
+		raw += (double)image.get_width() * image.get_height() * image.get_bytespp();
+		for (int f = 0; f < formats; f++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			if (f == 0) image.write_tga_file(temp[f]);
+			else if (f == 1) image.write_qoi_file(temp[f]);
+			else if (f == 2) image.write_png_file(temp[f], PNG_FAST);
+			else if (f == 3) image.write_png_file(temp[f], PNG_DEFAULT);
+			else writePng(image, temp[f]);
+			auto mid = std::chrono::steady_clock::now();
+			TGAImage decoded;
+			if (f == 0) decoded.read_tga_file(temp[f]);
+			else if (f == 1) decoded.read_qoi_file(temp[f]);
+			else
+			{
+				int w, h, n;
+				stbi_image_free(stbi_load(temp[f], &w, &h, &n, 0));
+			}
+			encode_ms[f] += std::chrono::duration<double, std::milli>(mid - start).count();
+			decode_ms[f] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - mid).count();
+			bytes[f] += (double)fs::file_size(temp[f]);
+		}
+	}
+	std::cerr.clear();
+	if (!frames)
+	{
+		std::cerr << "No frames to benchmark" << std::endl;
+		return;
+	}
+	std::cout << "format, encode ms, encode MB/s, size KB, ratio, decode ms (" << frames << " frames)" << std::endl;
+	for (int f = 0; f < formats; f++)
+	{
+		std::cout << names[f] << ", " << encode_ms[f] / frames << ", " << raw / 1048576.0 / encode_ms[f] * 1000. << ", "
+				  << bytes[f] / frames / 1024. << ", " << bytes[f] / raw << ", " << decode_ms[f] / frames << std::endl;
+	}
+}
+
+//大图的 PNG 写入吞吐量：把一帧放大到 4K 与 8K 后分别用自带的多线程写入（快速、默认级别）与 stb_image_write 编码
+void benchmarkPng(const std::string &file)
+{
+	const int sizes[][2] = {{3840, 2160}, {7680, 4320}};
+	const char* names[] = {"fast", "default", "stb"};
+	TGAImage source;
+	std::cerr.setstate(std::ios::failbit);
+	bool ok = readImage(source, file);
+	std::cerr.clear();
+	if (!ok)
+	{
+		std::cerr << "Failed to read " << file << std::endl;
+		return;
+	}
+	std::cout << "png encode, " << parallel_threads() << " threads: size, writer, ms, MB/s, KB" << std::endl;
+	for (const auto &size : sizes)
+	{
+		TGAImage still(source);
+		still.scale(size[0], size[1], FILTER_BICUBIC);
+		const double mb = (double)size[0] * size[1] * still.get_bytespp() / 1048576.0;
+		for (int f = 0; f < 3; f++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			if (f == 0) still.write_png_file("output/bench.png", PNG_FAST);
+			else if (f == 1) still.write_png_file("output/bench.png", PNG_DEFAULT);
+			else writePng(still, "output/bench.png");
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			std::cout << size[0] << "x" << size[1] << ", " << names[f] << ", " << ms << ", " << mb / ms * 1000. << ", "
+					  << fs::file_size("output/bench.png") / 1024 << std::endl;
+		}
+	}
+}
+
+//各滤波器的缩放耗时，每项取多次的平均
+void benchmarkScale(const std::string &file)
+{
+	const char* names[] = {"box", "bilinear", "bicubic", "lanczos3"};
+	const int runs = 10;
+	TGAImage source;
+	std::cerr.setstate(std::ios::failbit);
+	bool ok = readImage(source, file);
+	std::cerr.clear();
+	if (!ok)
+	{
+		std::cerr << "Failed to read " << file << std::endl;
+		return;
+	}
+	const int w = source.get_width(), h = source.get_height();
+	std::cout << "filter, thumbnail ms, 2x preview ms, pyramid ms" << std::endl;
+	for (int f = FILTER_BOX; f <= FILTER_LANCZOS3; f++)
+	{
+		ResampleFilter filter = (ResampleFilter)f;
+		double ms[3] = {0., 0., 0.};
+		for (int i = 0; i < runs; i++)
+		{
+			TGAImage thumbnail(source), preview(source);
+			auto start = std::chrono::steady_clock::now();
+			thumbnail.scale(w / 4, h / 4, filter);
+			auto mid = std::chrono::steady_clock::now();
+			preview.scale(w * 2, h * 2, filter);
+			auto end = std::chrono::steady_clock::now();
+			source.pyramid(8, filter);
+			ms[0] += std::chrono::duration<double, std::milli>(mid - start).count();
+			ms[1] += std::chrono::duration<double, std::milli>(end - mid).count();
+			ms[2] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - end).count();
+		}
+		std::cout << names[f] << ", " << ms[0] / runs << ", " << ms[1] / runs << ", " << ms[2] / runs << std::endl;
+	}
+}
+
 int main()
 {
 	std::cout << "ambient light:";
@@ -126,49 +426,179 @@ int main()
 		}
 
 
+	//纹理缓存改用 QOI：缺少 .qoi 或 TGA 更新过时重新编码
+	std::string texture_base = obj_file.substr(0, obj_file.find_last_of('.'));
+	if (qoi_textures && fs::exists(texture_base + ".tga")
+		&& (!fs::exists(texture_base + ".qoi") || fs::last_write_time(texture_base + ".qoi") < fs::last_write_time(texture_base + ".tga")))
+	{
+		TGAImage texture;
+		if (texture.read_tga_file((texture_base + ".tga").c_str()) && texture.write_qoi_file((texture_base + ".qoi").c_str()))
+			std::cout << "Cached " << texture_base << ".tga as " << texture_base << ".qoi" << std::endl;
+		else
+			std::cerr << "Failed to cache " << texture_base << ".tga as QOI" << std::endl;
+	}
+
+
 	//--------------------------------------------------------------------------
 	//初始化资源
-	Zbuffer z_buffer(width, height);
-	model = new Model(obj_file.data());
+	Zbuffer z_buffer(width, height, depth_format);
+	ShadowMap* shadow_map = shadows ? new ShadowMap(1024) : nullptr;
+	SampleBuffer* samples = msaa_samples > 1 ? new SampleBuffer(width, height, msaa_samples) : nullptr;
+	HdrBuffer* hdr = hdr_bits && !samples ? new HdrBuffer(width, height, hdr_bits == 32 ? HdrFormat::Float32 : HdrFormat::Half16) : nullptr;
+	model = new Model(obj_file.data(), qoi_textures ? ".qoi" : ".tga");
+	RayTracer* tracer = nullptr;
+	if (ray_trace)
+	{
+		auto start = std::chrono::steady_clock::now();
+		tracer = new RayTracer(model);
+		std::cout << "bvh: " << tracer->triangleCount() << " triangles, " << tracer->nodeCount() << " nodes, "
+				  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+	}
 
 	//--------------------------------------------------------------------------
 	//设定变换矩阵
 	Matrix Projection = Matrix::identity(4);
 	Matrix ViewPort   = viewPort(width/8, height/8, width*3/4, height*3/4);
 	Projection[3][2] = -1.f/camera.z;
-
+	//z_clip 取常数 z_near/camera.z，透视除法后得到 z_near/视距（reverse-Z）
+	Projection[2][2] = 0.f;
+	Projection[2][3] = z_near/camera.z;
+
+
+	RenderOptions options;
+	options.mode = render_mode;
+	options.sort_front_to_back = sort_front_to_back;
+	options.shading = shading;
+	options.half = half;
+	options.sphere = sphere_path;
+	options.shadow_map = shadow_map;
+	if (benchmark_sphere) benchmarkSphere(Projection, options);
+	if (benchmark_msaa) benchmarkMsaa(ViewPort, Projection, options);
+	options.msaa = samples;
+	options.hdr = hdr;
+	TraceOptions trace;
+	trace.preset = trace_preset;
+	unsigned long long shaded = 0, covered = 0;
+	double render_ms = 0., resolve_ms = 0., write_ms = 0.;
+	PostProcessor post;
+	PostOptions post_options;
+	double post_ms = 0.;
+	const std::string frame_ext = qoi_output ? ".qoi" : (png_output ? ".png" : ".tga");
+	std::ofstream yuv_file;
+	std::vector<unsigned char> yuv;
+	double yuv_ms = 0.;
+	if (yuv_output)
+	{
+		yuv_file.open("output/output.yuv", std::ios::binary);
+		yuv.resize(width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2));
+	}
 
 	//执行渲染循环写入
 	for (int i = 0;i < 121;++i)//
 	{
-		//申请画布
-		TGAImage* image = new TGAImage(width, height, TGAImage::RGB);
+		//申请画布，视口的 y 轴向上，画布原点设在左下角，写出时不需要翻转
+		TGAImage* image = new TGAImage(width, height, TGAImage::RGB, TGAImage::BOTTOM_LEFT);
 
 		float angle = i * (std::numbers::pi / 60);
 		Matrix Rotation = rotationY(angle);
 
-		render(ViewPort, Projection, Rotation, light_dir, ambient_light, width, height, z_buffer, model, image);
+		auto start = std::chrono::steady_clock::now();
+		RenderStats stats = tracer ? tracer->render(ViewPort, Projection, Rotation, light_dir, ambient_light, width, height, z_buffer, image, options, trace)
+								   : render(ViewPort, Projection, Rotation, light_dir, ambient_light, width, height, z_buffer, model, image, options);
+		//多重采样在帧内所有绘制完成后 resolve 一次，背景只混入一次
+		if (samples) samples->resolve(image->view());
+		render_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		shaded += stats.shaded;
+		covered += stats.covered;
+
+		//有后处理时由它直接读取 HDR 的浮点颜色，高光不会先被截断到 1
+		if (hdr && !post_process)
+		{
+			start = std::chrono::steady_clock::now();
+			hdr->resolve(image->view());
+			resolve_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		if (post_process)
+		{
+			start = std::chrono::steady_clock::now();
+			post.apply(*image, post_options, hdr);
+			post_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		}
 
-		image->flip_vertically();
 		std::ostringstream stream;
 		stream << std::setw(3) << std::setfill('0') << i;
-		std::string output_file = "output/output" + stream.str() + ".tga";
-		image->write_tga_file(output_file.c_str());
+		std::string output_file = "output/output" + stream.str() + frame_ext;
+		start = std::chrono::steady_clock::now();
+		if (qoi_output) image->write_qoi_file(output_file.c_str());
+		else if (png_output) image->write_png_file(output_file.c_str(), png_level);
+		else image->write_tga_file(output_file.c_str());
+		write_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		if (yuv_output)
+		{
+			//画布原点在左下角，翻转视图得到编码器需要的自上而下的行序
+			int cw = (width + 1) / 2, ch = (height + 1) / 2;
+			ImageView y(yuv.data(), width, height, width, 1);
+			ImageView u(yuv.data() + width * height, cw, ch, cw, 1);
+			ImageView v(u.data + cw * ch, cw, ch, cw, 1);
+			start = std::chrono::steady_clock::now();
+			convert_to_yuv420p(image->view().flipped(), y, u, v);
+			yuv_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			yuv_file.write((const char*)yuv.data(), yuv.size());
+		}
 
 		//删除画布
 		delete image;
 		z_buffer.fresh();
+		if (samples) samples->fresh();
+		if (hdr) hdr->fresh();
 
 		std::cout << ".";
 	}
+	std::cout << std::endl;
+	std::cout << "depth tests: " << z_buffer.stats.tested << ", passed: " << z_buffer.stats.passed
+			  << ", early-out rate: " << z_buffer.stats.rejectRate() * 100.f << "%" << std::endl;
+	std::cout << "render: " << render_ms / 121 << " ms/frame, shaded pixels: " << shaded / 121
+			  << " per frame, overdraw: " << (covered ? (float)shaded / (float)covered : 0.f) << std::endl;
+	std::cout << "hi-z rejected triangles: " << z_buffer.stats.tris_rejected
+			  << ", tiles: " << z_buffer.stats.tiles_rejected << std::endl;
+	std::cout << frame_ext.substr(1) << " write: " << write_ms / 121 << " ms/frame" << std::endl;
+	if (yuv_output) std::cout << "yuv420p: " << yuv_ms / 121 * 1000. << " us/frame" << std::endl;
+	if (post_process) std::cout << "post process: " << post_ms / 121 << " ms/frame, "
+								<< post_ms / 121 / (width * height / 1e6) << " ms/megapixel" << std::endl;
+	if (samples) std::cout << "msaa: " << samples->samples << "x, sample buffer: " << samples->bytes() / 1048576.0 << " MB" << std::endl;
+	if (hdr) std::cout << "hdr: RGBA" << hdr_bits << "F, buffer: " << hdr->bytes() / 1048576.0 << " MB, resolve: " << resolve_ms / 121 << " ms/frame" << std::endl;
+	if (benchmark_scale) benchmarkScale("output/output000" + frame_ext);
+	if (benchmark_tga)
+	{
+		if (frame_ext == ".tga") benchmarkTga("output/output000.tga");
+		benchmarkTga(texture_base + ".tga");
+	}
+	if (benchmark_qoi)
+	{
+		std::vector<std::string> frames;
+		for (int i = 0; i < 121; i += 10)
+		{
+			std::ostringstream stream;
+			stream << "output/output" << std::setw(3) << std::setfill('0') << i << frame_ext;
+			frames.push_back(stream.str());
+		}
+		benchmarkQoi(frames);
+	}
+	if (benchmark_png) benchmarkPng("output/output000" + frame_ext);
 
-	std::string display_command = R"(ffmpeg\ffplay -loop 0 -vf "fps=24" -pattern_type sequence -i output\output%03d.tga)";
+	std::string display_command = R"(ffmpeg\ffplay -loop 0 -vf "fps=24" -pattern_type sequence -i output\output%03d)" + frame_ext;
 	int display_result = system(display_command.c_str());
 	if (display_result == 0) std::cout << "Success to display" << std::endl;
 	else std::cerr << "Failed to display." << std::endl;
 
 
 	// 释放内存
+	delete shadow_map;
+	delete samples;
+	delete hdr;
+	delete tracer;
 	delete model;
 
 	return 0;
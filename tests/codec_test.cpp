@@ -0,0 +1,263 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <string.h>
+#include "tgaimage.h"
+#include "png.h"
+#include "qoi.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image/stb_image.h"
+
+// round trips of the hand-written codecs: every image is encoded, decoded by an independent reader
+// where there is one (stb_image for PNG, including its inflate) and compared byte for byte. the
+// images are random but seeded, so a failure always reproduces
+
+namespace {
+
+int failures = 0;
+int cases = 0;
+
+void fail(const std::string &what) {
+    failures++;
+    std::cerr << "FAIL " << what << std::endl;
+}
+
+// content that reaches the different paths of the coders: noise (literals, stored blocks), smooth
+// gradients (small differences, the PNG filters), flat blocks (long runs) and a repeating tile with
+// sparse noise (long matches far back, lazy matching, QOI's color index)
+enum Kind { NOISE, GRADIENT, BLOCKS, TILE, KINDS };
+
+TGAImage make_image(int w, int h, int bpp, Kind kind, unsigned seed) {
+    TGAImage img(w, h, bpp);
+    std::mt19937 rng(seed);
+    unsigned char *p = img.buffer();
+    int tw = 1 + rng()%23, th = 1 + rng()%7;
+    std::vector<unsigned char> tile((size_t)tw*th*bpp);
+    for (unsigned char &c : tile) c = (unsigned char)rng();
+    for (int y=0; y<h; y++) {
+        for (int x=0; x<w; x++) {
+            for (int c=0; c<bpp; c++, p++) {
+                switch (kind) {
+                    case NOISE:    *p = (unsigned char)rng(); break;
+                    case GRADIENT: *p = (unsigned char)(x*(c+1) + y*(3-c) + (rng()%3)); break;
+                    case BLOCKS:   *p = (unsigned char)(((x/13)*37 + (y/9)*91 + c*50) & 0xc0); break;
+                    default:       *p = rng()%61 ? tile[((y%th)*tw + x%tw)*bpp + c] : (unsigned char)rng(); break;
+                }
+            }
+        }
+    }
+    return img;
+}
+
+std::string name_of(const char *codec, int w, int h, int bpp, int kind, int level=-1) {
+    std::string s = std::string(codec) + " " + std::to_string(w) + "x" + std::to_string(h) + " bpp " + std::to_string(bpp) + " kind " + std::to_string(kind);
+    if (level >= 0) s += " level " + std::to_string(level);
+    return s;
+}
+
+std::vector<unsigned char> read_file(const char *filename) {
+    std::ifstream in(filename, std::ios::binary);
+    return std::vector<unsigned char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+uint32_t be32(const unsigned char *p) {
+    return (uint32_t)p[0]<<24 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<8 | p[3];
+}
+
+// bitwise reference versions, deliberately unlike the table-driven ones in png.cpp
+uint32_t crc32(const unsigned char *p, size_t n, uint32_t crc=0) {
+    crc = ~crc;
+    for (size_t i=0; i<n; i++) {
+        crc ^= p[i];
+        for (int k=0; k<8; k++) crc = crc&1 ? 0xedb88320u^(crc>>1) : crc>>1;
+    }
+    return ~crc;
+}
+
+uint32_t adler32(const unsigned char *p, size_t n) {
+    uint32_t a = 1, b = 0;
+    for (size_t i=0; i<n; i++) {
+        a = (a + p[i])%65521;
+        b = (b + a)%65521;
+    }
+    return b<<16 | a;
+}
+
+// walks the chunks checking every CRC, inflates the IDAT stream and checks its Adler-32 and size,
+// then lets stb_image undo the filters and compares the pixels with the source
+void check_png(TGAImage &img, int level, const std::string &what) {
+    const char *filename = "codec_test.png";
+    int w = img.get_width(), h = img.get_height(), bpp = img.get_bytespp();
+    if (!img.write_png_file(filename, level)) return fail(what + ": write");
+    std::vector<unsigned char> file = read_file(filename);
+    static const unsigned char signature[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+    if (file.size() < 8 || memcmp(file.data(), signature, 8)) return fail(what + ": signature");
+
+    std::vector<unsigned char> idat;
+    bool end = false;
+    int idats = 0;
+    for (size_t pos=8; pos<file.size() && !end; ) {
+        if (pos + 12 > file.size()) return fail(what + ": truncated chunk");
+        uint32_t len = be32(&file[pos]);
+        if (pos + 12 + len > file.size()) return fail(what + ": chunk length");
+        const unsigned char *type = &file[pos+4], *data = type + 4;
+        if (crc32(type, 4 + len) != be32(data + len)) return fail(what + ": chunk crc");
+        if (!memcmp(type, "IHDR", 4)) {
+            static const int color_type[5] = {0, 0, 0, 2, 6};
+            if (len != 13 || (int)be32(data) != w || (int)be32(data+4) != h || data[8] != 8 || data[9] != color_type[bpp]) return fail(what + ": IHDR");
+        } else if (!memcmp(type, "IDAT", 4)) {
+            idat.insert(idat.end(), data, data + len);
+            idats++;
+        } else if (!memcmp(type, "IEND", 4)) {
+            end = true;
+        }
+        pos += 12 + len;
+    }
+    if (!end || idat.size() < 6) return fail(what + ": no IEND or IDAT");
+
+    int raw_len = 0;
+    char *raw = stbi_zlib_decode_malloc((const char*)idat.data(), (int)idat.size(), &raw_len);
+    if (!raw) return fail(what + ": inflate");
+    size_t expected = (size_t)h*(1 + (size_t)w*bpp);
+    bool ok = (size_t)raw_len == expected && adler32((const unsigned char*)raw, raw_len) == be32(&idat[idat.size()-4]);
+    STBI_FREE(raw);
+    if (!ok) return fail(what + ": inflated size or adler32");
+
+    int dw, dh, channels;
+    unsigned char *pixels = stbi_load_from_memory(file.data(), (int)file.size(), &dw, &dh, &channels, 0);
+    if (!pixels) return fail(what + ": decode");
+    bool same = dw == w && dh == h && channels == bpp;
+    const unsigned char *s = img.buffer();
+    for (size_t i=0; same && i<(size_t)w*h; i++) {
+        const unsigned char *a = s + i*bpp, *b = pixels + i*bpp;
+        if (bpp == 1) same = a[0] == b[0];
+        else same = a[0] == b[2] && a[1] == b[1] && a[2] == b[0] && (bpp == 3 || a[3] == b[3]);
+    }
+    stbi_image_free(pixels);
+    if (!same) return fail(what + ": pixels");
+    if (w*h*bpp > (1 << 17) && level > 0 && idats < 2) fail(what + ": expected one IDAT per chunk");
+}
+
+// straight from the specification, so that a mistake shared by qoi.cpp's encoder and decoder (the
+// hash, say) still shows up. returns R,G,B,A per pixel, empty on a malformed stream
+std::vector<unsigned char> qoi_reference_decode(const std::vector<unsigned char> &file, size_t pixels) {
+    std::vector<unsigned char> out;
+    unsigned char index[64][4] = {}, px[4] = {0, 0, 0, 255};
+    size_t pos = 14;
+    while (out.size() < pixels*4) {
+        if (pos >= file.size()) return std::vector<unsigned char>();
+        int op = file[pos++], run = 1;
+        if (op == 0xfe || op == 0xff) {
+            if (pos + (op&1 ? 4 : 3) > file.size()) return std::vector<unsigned char>();
+            for (int c=0; c<(op&1 ? 4 : 3); c++) px[c] = file[pos++];
+        } else if ((op>>6) == 0) {
+            memcpy(px, index[op], 4);
+        } else if ((op>>6) == 1) {
+            px[0] += ((op>>4)&3) - 2;
+            px[1] += ((op>>2)&3) - 2;
+            px[2] += (op&3) - 2;
+        } else if ((op>>6) == 2) {
+            if (pos >= file.size()) return std::vector<unsigned char>();
+            int dg = (op&63) - 32, next = file[pos++];
+            px[0] += dg + (next>>4) - 8;
+            px[1] += dg;
+            px[2] += dg + (next&15) - 8;
+        } else {
+            run = (op&63) + 1;
+        }
+        memcpy(index[(px[0]*3 + px[1]*5 + px[2]*7 + px[3]*11)%64], px, 4);
+        for (int k=0; k<run; k++) out.insert(out.end(), px, px + 4);
+    }
+    static const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    if (out.size() != pixels*4 || pos + 8 != file.size() || memcmp(&file[pos], end, 8)) return std::vector<unsigned char>();
+    return out;
+}
+
+// writes with the streaming encoder in uneven bands and decodes from memory, with qoi.cpp and with
+// the reference decoder; 1-byte images come back as gray RGB
+void check_qoi(TGAImage &img, const std::string &what) {
+    const char *filename = "codec_test.qoi";
+    int w = img.get_width(), h = img.get_height(), bpp = img.get_bytespp();
+    int channels = bpp == 4 ? 4 : 3;
+    QoiEncoder enc;
+    if (!enc.open(filename, w, h, channels)) return fail(what + ": open");
+    ConstImageView view = img.view();
+    for (int y=0, band=1; y<h; y+=band, band=band*2 + 1) {
+        int n = std::min(band, h - y);
+        if (!enc.write_rows(view.sub(0, y, w, n))) return fail(what + ": write_rows");
+    }
+    if (!enc.close()) return fail(what + ": close");
+
+    std::vector<unsigned char> file = read_file(filename);
+    QoiHeader header;
+    if (!qoi_read_header(file.data(), file.size(), header) || header.width != w || header.height != h || header.channels != channels) return fail(what + ": header");
+    std::vector<unsigned char> out((size_t)w*h*channels);
+    if (!qoi_decode(file.data(), file.size(), ImageView(out.data(), w, h, (long)w*channels, channels))) return fail(what + ": decode");
+    const unsigned char *s = img.buffer();
+    for (size_t i=0; i<(size_t)w*h; i++) {
+        for (int c=0; c<channels; c++) {
+            if (out[i*channels + c] != s[i*bpp + (bpp == 1 ? 0 : c)]) return fail(what + ": pixels");
+        }
+    }
+    std::vector<unsigned char> ref = qoi_reference_decode(file, (size_t)w*h);
+    if (ref.empty()) return fail(what + ": reference decode");
+    for (size_t i=0; i<(size_t)w*h; i++) {
+        const unsigned char *a = s + i*bpp, *b = &ref[i*4];
+        bool same = bpp == 1 ? b[0] == a[0] && b[1] == a[0] && b[2] == a[0] : b[0] == a[2] && b[1] == a[1] && b[2] == a[0];
+        if (!same || b[3] != (bpp == 4 ? a[3] : 255)) return fail(what + ": reference pixels");
+    }
+}
+
+// TGA with and without RLE through the file reader
+void check_tga(TGAImage &img, bool rle, const std::string &what) {
+    const char *filename = "codec_test.tga";
+    int w = img.get_width(), h = img.get_height(), bpp = img.get_bytespp();
+    if (!img.write_tga_file(filename, rle)) return fail(what + ": write");
+    TGAImage back;
+    // the reader reports the dimensions on stderr, keep the output to the failures
+    std::streambuf *log = std::cerr.rdbuf(nullptr);
+    bool read = back.read_tga_file(filename);
+    std::cerr.rdbuf(log);
+    if (!read) return fail(what + ": read");
+    if (back.get_width() != w || back.get_height() != h || back.get_bytespp() != bpp) return fail(what + ": header");
+    if (memcmp(back.buffer(), img.buffer(), (size_t)w*h*bpp)) fail(what + ": pixels");
+}
+
+}
+
+int main() {
+    // odd sizes catch the row tails of the SIMD loops; the two large ones span several 128 KB deflate
+    // chunks, one of them with rows that straddle the chunk boundaries
+    const int sizes[][2] = {{1, 1}, {7, 3}, {33, 17}, {257, 129}, {1000, 300}, {613, 401}};
+    const int bpps[] = {1, 3, 4};
+    unsigned seed = 1;
+    for (const auto &size : sizes) {
+        int w = size[0], h = size[1];
+        for (int bpp : bpps) {
+            for (int kind=0; kind<KINDS; kind++, seed++) {
+                TGAImage img = make_image(w, h, bpp, (Kind)kind, seed);
+                bool large = w*h > 100000;
+                for (int level=0; level<=9; level++) {
+                    // every level on the small images, the named ones on the large
+                    if (large && level != PNG_STORE && level != PNG_FAST && level != 2 && level != PNG_DEFAULT && level != PNG_BEST) continue;
+                    check_png(img, level, name_of("png", w, h, bpp, kind, level));
+                    cases++;
+                }
+                check_qoi(img, name_of("qoi", w, h, bpp, kind));
+                check_tga(img, true, name_of("tga rle", w, h, bpp, kind));
+                check_tga(img, false, name_of("tga", w, h, bpp, kind));
+                cases += 3;
+            }
+        }
+    }
+    std::remove("codec_test.png");
+    std::remove("codec_test.qoi");
+    std::remove("codec_test.tga");
+    std::cout << cases << " round trips, " << failures << " failed" << std::endl;
+    return failures ? 1 : 0;
+}
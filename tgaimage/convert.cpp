@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <vector>
+#include <string.h>
+#include "convert.h"
+#include "parallel.h"
+#include "simd.h"
+
+namespace {
+
+const int ROWS_PER_TASK = 32;
+
+// ---- 24/32-bit layouts, n pixels per row ----
+
+void swap_rb_24(const unsigned char *s, unsigned char *d, int n) {
+    int x = 0;
+#ifdef SIMD_SSSE3
+    // five pixels per 16-byte block; the last byte is copied as is and rewritten by the next block.
+    // a block reads and writes 16 bytes from x*3, which stays inside the row while x+6<=n
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+    for (; x+6<=n; x+=5) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s+x*3));
+        _mm_storeu_si128((__m128i *)(d+x*3), _mm_shuffle_epi8(v, shuffle));
+    }
+#endif
+    for (; x<n; x++) {
+        unsigned char b = s[x*3];
+        d[x*3+1] = s[x*3+1];
+        d[x*3] = s[x*3+2];
+        d[x*3+2] = b;
+    }
+}
+
+void swap_rb_32(const unsigned char *s, unsigned char *d, int n) {
+    int x = 0;
+#ifdef SIMD_SSE2
+    const __m128i ga = _mm_set1_epi32((int)0xFF00FF00), low = _mm_set1_epi32(0xFF);
+    for (; x+4<=n; x+=4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s+x*4));
+        __m128i rb = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low), _mm_slli_epi32(_mm_and_si128(v, low), 16));
+        _mm_storeu_si128((__m128i *)(d+x*4), _mm_or_si128(_mm_and_si128(v, ga), rb));
+    }
+#endif
+    for (; x<n; x++) {
+        unsigned char b = s[x*4];
+        d[x*4+1] = s[x*4+1];
+        d[x*4+3] = s[x*4+3];
+        d[x*4] = s[x*4+2];
+        d[x*4+2] = b;
+    }
+}
+
+void expand_row(const unsigned char *s, unsigned char *d, int n, unsigned char alpha) {
+    int x = 0;
+#ifdef SIMD_SSSE3
+    // four pixels per step from a 16-byte load, which stays inside the row while x+6<=n
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i a = _mm_set1_epi32((int)((unsigned)alpha<<24));
+    for (; x+6<=n; x+=4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s+x*3));
+        _mm_storeu_si128((__m128i *)(d+x*4), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), a));
+    }
+#endif
+    for (; x<n; x++) {
+        memcpy(d+x*4, s+x*3, 3);
+        d[x*4+3] = alpha;
+    }
+}
+
+void pack_row(const unsigned char *s, unsigned char *d, int n) {
+    int x = 0;
+#ifdef SIMD_SSSE3
+    // 12 useful bytes per 16-byte store; the 4 zeros after them are overwritten by the next step
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    for (; x+6<=n; x+=4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s+x*4));
+        _mm_storeu_si128((__m128i *)(d+x*3), _mm_shuffle_epi8(v, shuffle));
+    }
+#endif
+    for (; x<n; x++) memcpy(d+x*3, s+x*4, 3);
+}
+
+// ---- luma and chroma of BGRA rows ----
+
+// BT.601 weights scaled by 256
+struct Luma {
+    int b, g, r, offset;
+};
+
+const Luma FULL_RANGE = {29, 150, 77, 0};
+const Luma LIMITED_RANGE = {25, 129, 66, 16};
+
+inline unsigned char luma(const unsigned char *p, const Luma &c) {
+    return (unsigned char)(((c.b*p[0] + c.g*p[1] + c.r*p[2] + 128) >> 8) + c.offset);
+}
+
+// limited range U and V of averaged channels
+inline void chroma(int b, int g, int r, unsigned char *u, unsigned char *v) {
+    *u = (unsigned char)(((-38*r - 74*g + 112*b + 128) >> 8) + 128);
+    *v = (unsigned char)(((112*r - 94*g - 18*b + 128) >> 8) + 128);
+}
+
+#ifdef SIMD_SSE2
+// the channels of 8 BGRA pixels as 16-bit lanes
+inline void split_bgra(const unsigned char *p, __m128i &b, __m128i &g, __m128i &r) {
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(p+16));
+    b = _mm_packs_epi32(_mm_and_si128(v0, mask), _mm_and_si128(v1, mask));
+    g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(v0, 8), mask), _mm_and_si128(_mm_srli_epi32(v1, 8), mask));
+    r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(v0, 16), mask), _mm_and_si128(_mm_srli_epi32(v1, 16), mask));
+}
+
+// luma of 8 pixels given as 16-bit channels. the weighted sums stay below 65536, so wrapping
+// 16-bit products and a logical shift are exact
+inline __m128i luma8(__m128i b, __m128i g, __m128i r, const Luma &c) {
+    __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(c.b)), _mm_mullo_epi16(g, _mm_set1_epi16(c.g))),
+                                _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(c.r)), _mm_set1_epi16(128)));
+    return _mm_add_epi16(_mm_srli_epi16(sum, 8), _mm_set1_epi16(c.offset));
+}
+#endif
+
+void luma_row(const unsigned char *s, unsigned char *d, int n, const Luma &c) {
+    int x = 0;
+#ifdef SIMD_SSE2
+    for (; x+16<=n; x+=16) {
+        __m128i y[2];
+        for (int h=0; h<2; h++) {
+            __m128i b, g, r;
+            split_bgra(s+(x+8*h)*4, b, g, r);
+            y[h] = luma8(b, g, r, c);
+        }
+        _mm_storeu_si128((__m128i *)(d+x), _mm_packus_epi16(y[0], y[1]));
+    }
+#endif
+    for (; x<n; x++) d[x] = luma(s+x*4, c);
+}
+
+// luma of two BGRA rows and chroma of their 2x2 blocks in one sweep, so every pixel is split into
+// channels once. for an odd last row s1 is s0 and d1 is NULL. block i goes to u[i*step] and
+// v[i*step], so nv12 passes the interleaved plane with v = u+1 and step 2
+void yuv_rows(const unsigned char *s0, const unsigned char *s1, unsigned char *d0, unsigned char *d1,
+              unsigned char *u, unsigned char *v, int step, int n) {
+    int x = 0;
+#ifdef SIMD_SSE2
+    const __m128i ones = _mm_set1_epi16(1), two = _mm_set1_epi16(2), round = _mm_set1_epi16(128);
+    for (; x+16<=n; x+=16) {
+        // c[row][half][channel]: 16 pixels of each row as 16-bit B, G, R
+        __m128i c[2][2][3];
+        for (int h=0; h<2; h++) {
+            split_bgra(s0+(x+8*h)*4, c[0][h][0], c[0][h][1], c[0][h][2]);
+            split_bgra(s1+(x+8*h)*4, c[1][h][0], c[1][h][1], c[1][h][2]);
+        }
+        _mm_storeu_si128((__m128i *)(d0+x), _mm_packus_epi16(luma8(c[0][0][0], c[0][0][1], c[0][0][2], LIMITED_RANGE),
+                                                             luma8(c[0][1][0], c[0][1][1], c[0][1][2], LIMITED_RANGE)));
+        if (d1) {
+            _mm_storeu_si128((__m128i *)(d1+x), _mm_packus_epi16(luma8(c[1][0][0], c[1][0][1], c[1][0][2], LIMITED_RANGE),
+                                                                 luma8(c[1][1][0], c[1][1][1], c[1][1][2], LIMITED_RANGE)));
+        }
+        // eight blocks: add the rows, then neighbouring pixels, then average
+        __m128i avg[3];
+        for (int k=0; k<3; k++) {
+            __m128i lo = _mm_madd_epi16(_mm_add_epi16(c[0][0][k], c[1][0][k]), ones);
+            __m128i hi = _mm_madd_epi16(_mm_add_epi16(c[0][1][k], c[1][1][k]), ones);
+            avg[k] = _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(lo, hi), two), 2);
+        }
+        // |coefficients| add up to at most 224, so the signed 16-bit sums cannot overflow
+        __m128i u16 = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(avg[2], _mm_set1_epi16(-38)), _mm_mullo_epi16(avg[1], _mm_set1_epi16(-74))),
+                                    _mm_add_epi16(_mm_mullo_epi16(avg[0], _mm_set1_epi16(112)), round));
+        __m128i v16 = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(avg[2], _mm_set1_epi16(112)), _mm_mullo_epi16(avg[1], _mm_set1_epi16(-94))),
+                                    _mm_add_epi16(_mm_mullo_epi16(avg[0], _mm_set1_epi16(-18)), round));
+        u16 = _mm_add_epi16(_mm_srai_epi16(u16, 8), round);
+        v16 = _mm_add_epi16(_mm_srai_epi16(v16, 8), round);
+        __m128i u8 = _mm_packus_epi16(u16, u16), v8 = _mm_packus_epi16(v16, v16);
+        if (step==1) {
+            _mm_storel_epi64((__m128i *)(u+x/2), u8);
+            _mm_storel_epi64((__m128i *)(v+x/2), v8);
+        } else {
+            _mm_storeu_si128((__m128i *)(u+x), _mm_unpacklo_epi8(u8, v8));
+        }
+    }
+#endif
+    for (int i=x; i<n; i++) {
+        d0[i] = luma(s0+i*4, LIMITED_RANGE);
+        if (d1) d1[i] = luma(s1+i*4, LIMITED_RANGE);
+    }
+    for (int i=x/2; i<(n+1)/2; i++) {
+        int a = 2*i*4, b = std::min(2*i+1, n-1)*4;
+        int avg[3];
+        for (int k=0; k<3; k++) avg[k] = (s0[a+k] + s0[b+k] + s1[a+k] + s1[b+k] + 2) >> 2;
+        chroma(avg[0], avg[1], avg[2], u+i*step, v+i*step);
+    }
+}
+
+// row y of a 24 or 32-bit view as BGRA: the row itself, or its expansion into buf
+inline const unsigned char *bgra_row(ConstImageView src, int y, int w, unsigned char *buf) {
+    if (src.bytespp==4) return src.row(y);
+    expand_row(src.row(y), buf, w, 255);
+    return buf;
+}
+
+void convert_to_yuv(ConstImageView src, ImageView y, unsigned char *u, long u_stride, unsigned char *v, long v_stride, int step) {
+    const int w = std::min(src.width, y.width), h = std::min(src.height, y.height);
+    parallel_for(0, (h+1)/2, ROWS_PER_TASK/2, [&](int c0, int c1) {
+        std::vector<unsigned char> buf(src.bytespp==4 ? 0 : (size_t)w*8);
+        for (int c=c0; c<c1; c++) {
+            int ya = 2*c, yb = std::min(2*c+1, h-1);
+            const unsigned char *r0 = bgra_row(src, ya, w, buf.data());
+            const unsigned char *r1 = yb==ya ? r0 : bgra_row(src, yb, w, buf.data()+(size_t)w*4);
+            yuv_rows(r0, r1, y.row(ya), yb==ya ? NULL : y.row(yb), u+c*u_stride, v+c*v_stride, step, w);
+        }
+    });
+}
+
+bool color_view(ConstImageView src) {
+    return src.data && (src.bytespp==3 || src.bytespp==4);
+}
+
+}
+
+void swap_red_blue(ConstImageView src, ImageView dst) {
+    if (!color_view(src) || !dst.data || src.bytespp!=dst.bytespp) return;
+    const int w = std::min(src.width, dst.width), h = std::min(src.height, dst.height);
+    parallel_for(0, h, ROWS_PER_TASK, [&](int y0, int y1) {
+        for (int y=y0; y<y1; y++) {
+            if (src.bytespp==3) swap_rb_24(src.row(y), dst.row(y), w);
+            else swap_rb_32(src.row(y), dst.row(y), w);
+        }
+    });
+}
+
+void convert_24_to_32(ConstImageView src, ImageView dst, unsigned char alpha) {
+    if (!src.data || !dst.data || src.bytespp!=3 || dst.bytespp!=4) return;
+    const int w = std::min(src.width, dst.width), h = std::min(src.height, dst.height);
+    parallel_for(0, h, ROWS_PER_TASK, [&](int y0, int y1) {
+        for (int y=y0; y<y1; y++) expand_row(src.row(y), dst.row(y), w, alpha);
+    });
+}
+
+void convert_32_to_24(ConstImageView src, ImageView dst) {
+    if (!src.data || !dst.data || src.bytespp!=4 || dst.bytespp!=3) return;
+    const int w = std::min(src.width, dst.width), h = std::min(src.height, dst.height);
+    parallel_for(0, h, ROWS_PER_TASK, [&](int y0, int y1) {
+        for (int y=y0; y<y1; y++) pack_row(src.row(y), dst.row(y), w);
+    });
+}
+
+void convert_to_gray(ConstImageView src, ImageView dst) {
+    if (!color_view(src) || !dst.data || dst.bytespp!=1) return;
+    const int w = std::min(src.width, dst.width), h = std::min(src.height, dst.height);
+    parallel_for(0, h, ROWS_PER_TASK, [&](int y0, int y1) {
+        std::vector<unsigned char> buf(src.bytespp==4 ? 0 : (size_t)w*4);
+        for (int y=y0; y<y1; y++) luma_row(bgra_row(src, y, w, buf.data()), dst.row(y), w, FULL_RANGE);
+    });
+}
+
+void convert_to_yuv420p(ConstImageView src, ImageView y, ImageView u, ImageView v) {
+    if (!color_view(src) || !y.data || !u.data || !v.data || y.bytespp!=1 || u.bytespp!=1 || v.bytespp!=1) return;
+    const int cw = (std::min(src.width, y.width)+1)/2, ch = (std::min(src.height, y.height)+1)/2;
+    if (u.width<cw || u.height<ch || v.width<cw || v.height<ch) return;
+    convert_to_yuv(src, y, u.data, u.stride, v.data, v.stride, 1);
+}
+
+void convert_to_nv12(ConstImageView src, ImageView y, ImageView uv) {
+    if (!color_view(src) || !y.data || !uv.data || y.bytespp!=1 || uv.bytespp!=2) return;
+    const int cw = (std::min(src.width, y.width)+1)/2, ch = (std::min(src.height, y.height)+1)/2;
+    if (uv.width<cw || uv.height<ch) return;
+    convert_to_yuv(src, y, uv.data, uv.stride, uv.data+1, uv.stride, 2);
+}
@@ -0,0 +1,27 @@
+#ifndef __CONVERT_H__
+#define __CONVERT_H__
+
+#include "tgaimage.h"
+
+// pixel format conversions between views of the same size. rows are split across the thread pool
+// and the inner loops use SSE2 (SSSE3 byte shuffles for the 24-bit layouts when available).
+// colors are stored B,G,R(,A) as in TGA
+
+// swaps the red and blue channels of 24 or 32-bit pixels; src and dst may be the same view
+void swap_red_blue(ConstImageView src, ImageView dst);
+
+// 24-bit pixels to 32-bit ones with a constant alpha, and back, dropping alpha
+void convert_24_to_32(ConstImageView src, ImageView dst, unsigned char alpha=255);
+void convert_32_to_24(ConstImageView src, ImageView dst);
+
+// full range BT.601 luma of 24 or 32-bit pixels into an 8-bit view
+void convert_to_gray(ConstImageView src, ImageView dst);
+
+// limited range BT.601 (Y in 16..235, U and V in 16..240), chroma averaged over 2x2 pixels.
+// the chroma planes are (w+1)/2 x (h+1)/2; an odd last column or row is paired with itself.
+// yuv420p (I420) writes three 8-bit planes, nv12 the luma plane and one plane of U,V pairs
+// (a view with 2 bytes per pixel)
+void convert_to_yuv420p(ConstImageView src, ImageView y, ImageView u, ImageView v);
+void convert_to_nv12(ConstImageView src, ImageView y, ImageView uv);
+
+#endif //__CONVERT_H__
@@ -0,0 +1,160 @@
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "parallel.h"
+
+namespace {
+
+thread_local bool in_pool = false;
+
+class ThreadPool {
+public:
+    ThreadPool() {
+        int n = (int)std::thread::hardware_concurrency();
+        for (int i=1; i<n; i++) {
+            workers.emplace_back([this] { loop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (std::thread &t : workers) t.join();
+    }
+
+    int size() const {
+        return (int)workers.size() + 1;
+    }
+
+    void run(int count, const std::function<void(int)> &job) {
+        if (count <= 0) return;
+        if (in_pool || count == 1 || workers.empty()) {
+            for (int i=0; i<count; i++) job(i);
+            return;
+        }
+        std::lock_guard<std::mutex> batch(run_mutex); // one batch at a time
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current = &job;
+            total = count;
+            next = 0;
+            active = (int)workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        in_pool = true;
+        work();
+        in_pool = false;
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return active == 0; });
+        current = nullptr;
+    }
+
+private:
+    void work() {
+        for (int i=next++; i<total; i=next++) (*current)(i);
+    }
+
+    void loop() {
+        in_pool = true;
+        unsigned long seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return quit || generation != seen; });
+                if (quit) return;
+                seen = generation;
+            }
+            work();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--active == 0) done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex, run_mutex;
+    std::condition_variable wake, done;
+    const std::function<void(int)> *current = nullptr;
+    std::atomic<int> next{0};
+    int total = 0;
+    int active = 0;
+    unsigned long generation = 0;
+    bool quit = false;
+};
+
+ThreadPool &pool() {
+    static ThreadPool instance;
+    return instance;
+}
+
+}
+
+int parallel_threads() {
+    return pool().size();
+}
+
+void parallel_run(int count, const std::function<void(int)> &job) {
+    pool().run(count, job);
+}
+
+namespace {
+
+// a slice of indices packed as (begin << 32 | end) so the owner popping from the front and
+// thieves popping from the back agree through a single compare-exchange
+struct alignas(64) Slice {
+    std::atomic<uint64_t> range;
+};
+
+bool pop_front(Slice &s, int &index) {
+    uint64_t r = s.range.load();
+    for (;;) {
+        uint32_t b = (uint32_t)(r >> 32), e = (uint32_t)r;
+        if (b >= e) return false;
+        if (s.range.compare_exchange_weak(r, (uint64_t)(b+1) << 32 | e)) {
+            index = (int)b;
+            return true;
+        }
+    }
+}
+
+bool pop_back(Slice &s, int &index) {
+    uint64_t r = s.range.load();
+    for (;;) {
+        uint32_t b = (uint32_t)(r >> 32), e = (uint32_t)r;
+        if (b >= e) return false;
+        if (s.range.compare_exchange_weak(r, (uint64_t)b << 32 | (e-1))) {
+            index = (int)(e-1);
+            return true;
+        }
+    }
+}
+
+}
+
+void parallel_steal(int count, const std::function<void(int)> &job) {
+    int slices = std::min(parallel_threads(), count);
+    if (slices <= 1) {
+        for (int i=0; i<count; i++) job(i);
+        return;
+    }
+    std::unique_ptr<Slice[]> slice(new Slice[slices]);
+    for (int s=0; s<slices; s++) {
+        uint64_t b = (uint64_t)count * s / slices, e = (uint64_t)count * (s+1) / slices;
+        slice[s].range.store(b << 32 | e);
+    }
+    parallel_run(slices, [&](int s) {
+        int index;
+        while (pop_front(slice[s], index)) job(index);
+        for (int k=1; k<slices; k++) {
+            Slice &victim = slice[(s+k) % slices];
+            while (pop_back(victim, index)) job(index);
+        }
+    });
+}
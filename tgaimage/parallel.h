@@ -0,0 +1,31 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <algorithm>
+#include <functional>
+
+// number of threads taking part in parallel_run (workers + the calling thread)
+int parallel_threads();
+
+// runs job(i) for every i in [0, count) on the shared thread pool, indices are handed out
+// dynamically so uneven jobs balance themselves; returns when all of them are done.
+// nested calls from inside a job run serially on the calling thread.
+void parallel_run(int count, const std::function<void(int)> &job);
+
+// like parallel_run, but every thread starts on its own contiguous slice of [0, count) and,
+// once that runs dry, steals single indices from the back of the other slices. neighbouring
+// indices (e.g. image tiles) stay on one thread while uneven jobs still balance out.
+void parallel_steal(int count, const std::function<void(int)> &job);
+
+// splits [begin, end) into chunks of `grain` and runs f(chunk_begin, chunk_end) in parallel
+template <class F> void parallel_for(int begin, int end, int grain, F &&f) {
+    if (end <= begin) return;
+    if (grain < 1) grain = 1;
+    int chunks = (end - begin + grain - 1) / grain;
+    parallel_run(chunks, [&](int c) {
+        int lo = begin + c * grain;
+        f(lo, std::min(lo + grain, end));
+    });
+}
+
+#endif //__PARALLEL_H__
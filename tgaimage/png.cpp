@@ -0,0 +1,799 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include <string.h>
+#include "png.h"
+#include "convert.h"
+#include "parallel.h"
+#include "simd.h"
+
+namespace {
+
+// ---- checksums ----
+
+// CRC-32 eight bytes at a time (slicing by 8): table k gives the CRC of a byte followed by k zeros
+struct CrcTables {
+    uint32_t t[8][256];
+    CrcTables() {
+        for (uint32_t n=0; n<256; n++) {
+            uint32_t c = n;
+            for (int k=0; k<8; k++) c = c&1 ? 0xedb88320u^(c>>1) : c>>1;
+            t[0][n] = c;
+        }
+        for (int k=1; k<8; k++) {
+            for (int n=0; n<256; n++) t[k][n] = (t[k-1][n]>>8) ^ t[0][t[k-1][n] & 0xff];
+        }
+    }
+};
+
+uint32_t crc32(uint32_t crc, const unsigned char *p, size_t n) {
+    static const CrcTables tables;
+    const uint32_t (*t)[256] = tables.t;
+    crc = ~crc;
+    for (; n>=8; n-=8, p+=8) {
+        uint32_t a, b;
+        memcpy(&a, p, 4);
+        memcpy(&b, p+4, 4);
+        a ^= crc;
+        crc = t[7][a & 0xff] ^ t[6][a>>8 & 0xff] ^ t[5][a>>16 & 0xff] ^ t[4][a>>24]
+            ^ t[3][b & 0xff] ^ t[2][b>>8 & 0xff] ^ t[1][b>>16 & 0xff] ^ t[0][b>>24];
+    }
+    for (; n>0; n--) crc = t[0][(crc ^ *p++) & 0xff] ^ (crc>>8);
+    return ~crc;
+}
+
+const uint32_t ADLER_BASE = 65521;
+
+uint32_t adler32(uint32_t adler, const unsigned char *p, size_t n) {
+    uint32_t a = adler & 0xffff, b = adler>>16;
+    while (n>0) {
+        // 5552 is the most bytes before b can overflow 32 bits
+        size_t k = std::min(n, (size_t)5552);
+        n -= k;
+        for (; k>0; k--) {
+            a += *p++;
+            b += a;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+    return b<<16 | a;
+}
+
+// the Adler-32 of two pieces concatenated, from their sums and the length of the second
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+    uint32_t rem = (uint32_t)(len2 % ADLER_BASE);
+    uint32_t a1 = adler1 & 0xffff, b1 = adler1>>16, a2 = adler2 & 0xffff, b2 = adler2>>16;
+    uint32_t a = (a1 + a2 + ADLER_BASE - 1) % ADLER_BASE;
+    uint32_t b = (uint32_t)(((uint64_t)rem*a1 + b1 + b2 + ADLER_BASE - rem) % ADLER_BASE);
+    return b<<16 | a;
+}
+
+// ---- filtering ----
+
+enum {
+    PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVERAGE, PNG_FILTER_PAETH
+};
+
+inline unsigned char paeth(int a, int b, int c) {
+    int pa = abs(b-c), pb = abs(a-c), pc = abs(a+b-2*c);
+    return pa<=pb && pa<=pc ? a : (pb<=pc ? b : c);
+}
+
+// a filtered byte read as signed, the usual estimate of how well the row compresses
+inline unsigned cost(unsigned char v) {
+    return v<128 ? v : 256-v;
+}
+
+#ifdef SIMD_SSE2
+// the Paeth predictors of 8 bytes given as 16-bit lanes: pa = |b-c|, pb = |a-c|, pc = |a+b-2c|,
+// and the predictor is the first of a, b, c whose distance is the smallest
+inline __m128i paeth8(__m128i a, __m128i b, __m128i c) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i da = _mm_sub_epi16(b, c), db = _mm_sub_epi16(a, c), dc = _mm_add_epi16(da, db);
+    __m128i pa = _mm_max_epi16(da, _mm_sub_epi16(zero, da));
+    __m128i pb = _mm_max_epi16(db, _mm_sub_epi16(zero, db));
+    __m128i pc = _mm_max_epi16(dc, _mm_sub_epi16(zero, dc));
+    __m128i smallest = _mm_min_epi16(pa, _mm_min_epi16(pb, pc));
+    __m128i is_a = _mm_cmpeq_epi16(pa, smallest), is_b = _mm_cmpeq_epi16(pb, smallest);
+    __m128i bc = _mm_or_si128(_mm_and_si128(is_b, b), _mm_andnot_si128(is_b, c));
+    return _mm_or_si128(_mm_and_si128(is_a, a), _mm_andnot_si128(is_a, bc));
+}
+
+// the cost of 16 filtered bytes, min(v, 256-v) each, summed into the two 64-bit halves
+inline __m128i cost16(__m128i v) {
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_sad_epu8(_mm_min_epu8(v, _mm_sub_epi8(zero, v)), zero);
+}
+#endif
+
+// filters one row of n bytes into out (the filter type, then n bytes); prev is the row above, all
+// zeros for the first one. every filter is tried and the one of the smallest cost kept, candidates
+// go through tmp (4*n bytes). all of them are computed from the unfiltered bytes, so 16 bytes are
+// filtered at once past the first pixel
+void filter_row(const unsigned char *cur, const unsigned char *prev, int n, int bpp, unsigned char *out, unsigned char *tmp) {
+    unsigned char *sub = tmp, *up = tmp+n, *avg = tmp+2*n, *pth = tmp+3*n;
+    unsigned sums[5] = {0, 0, 0, 0, 0};
+    auto filter_byte = [&](int i) {
+        int a = i>=bpp ? cur[i-bpp] : 0;
+        int b = prev[i];
+        int c = i>=bpp ? prev[i-bpp] : 0;
+        sub[i] = cur[i] - a;
+        up[i]  = cur[i] - b;
+        avg[i] = cur[i] - ((a+b)>>1);
+        pth[i] = cur[i] - paeth(a, b, c);
+        sums[0] += cost(cur[i]);
+        sums[1] += cost(sub[i]);
+        sums[2] += cost(up[i]);
+        sums[3] += cost(avg[i]);
+        sums[4] += cost(pth[i]);
+    };
+    int i = 0;
+    for (; i<n && i<bpp; i++) filter_byte(i);
+#ifdef SIMD_SSE2
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+    __m128i acc[5] = {zero, zero, zero, zero, zero};
+    for (; i+16<=n; i+=16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(cur+i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(cur+i-bpp));
+        __m128i b = _mm_loadu_si128((const __m128i *)(prev+i));
+        __m128i c = _mm_loadu_si128((const __m128i *)(prev+i-bpp));
+        // the rounded-up average less the carried low bit is the floor one
+        __m128i mean = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        __m128i predictor = _mm_packus_epi16(
+            paeth8(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+            paeth8(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+        __m128i f[4] = {_mm_sub_epi8(x, a), _mm_sub_epi8(x, b), _mm_sub_epi8(x, mean), _mm_sub_epi8(x, predictor)};
+        acc[0] = _mm_add_epi64(acc[0], cost16(x));
+        for (int k=0; k<4; k++) {
+            _mm_storeu_si128((__m128i *)(tmp+k*n+i), f[k]);
+            acc[k+1] = _mm_add_epi64(acc[k+1], cost16(f[k]));
+        }
+    }
+    for (int k=0; k<5; k++) sums[k] += _mm_cvtsi128_si32(acc[k]) + _mm_cvtsi128_si32(_mm_srli_si128(acc[k], 8));
+#endif
+    for (; i<n; i++) filter_byte(i);
+    int best = PNG_FILTER_NONE;
+    for (int f=1; f<5; f++) if (sums[f]<sums[best]) best = f;
+    out[0] = best;
+    memcpy(out+1, best==PNG_FILTER_NONE ? cur : tmp+(best-1)*n, n);
+}
+
+// ---- deflate ----
+
+const int WINDOW = 32768;
+const int MIN_MATCH = 3;
+const int MAX_MATCH = 258;
+const int HASH_BITS = 15;
+// a chunk of filtered data compressed on its own, and the symbols collected per block
+const size_t CHUNK = 128*1024;
+const int BLOCK_SYMBOLS = 32768;
+// a 3-byte match further back than this costs more than three literals
+const int TOO_FAR = 4096;
+
+// as in zlib: reduce the chain below good, stop looking ahead past lazy (greedy levels: only
+// insert the strings of matches up to lazy), stop searching at nice, follow at most chain links
+struct Config {
+    int good, lazy, nice, chain;
+    bool greedy;
+};
+
+const Config configs[10] = {
+    {0, 0, 0, 0, true},
+    {4, 4, 8, 4, true},
+    {4, 5, 16, 8, true},
+    {4, 6, 32, 32, true},
+    {4, 4, 16, 16, false},
+    {8, 16, 32, 32, false},
+    {8, 16, 128, 128, false},
+    {8, 32, 128, 256, false},
+    {32, 128, 258, 1024, false},
+    {32, 258, 258, 4096, false}
+};
+
+const int LEN_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const int LEN_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const int DIST_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+                           4097, 6145, 8193, 12289, 16385, 24577};
+const int DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// the order the code length code lengths are sent in
+const int CL_ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// length -> length code, distance -> distance code; distances past 256 are looked up by (d-1)>>7
+struct CodeTables {
+    unsigned char len_code[MAX_MATCH+1];
+    unsigned char dist_small[256];
+    unsigned char dist_large[256];
+    CodeTables() {
+        for (int c=0; c<29; c++) {
+            int end = c==28 ? MAX_MATCH+1 : LEN_BASE[c+1];
+            for (int l=LEN_BASE[c]; l<end; l++) len_code[l] = c;
+        }
+        for (int c=0; c<30; c++) {
+            int end = c==29 ? WINDOW+1 : DIST_BASE[c+1];
+            for (int d=DIST_BASE[c]; d<end; d++) {
+                if (d<=256) dist_small[d-1] = c;
+                else dist_large[(d-1)>>7] = c;
+            }
+        }
+    }
+};
+
+const CodeTables &code_tables() {
+    static const CodeTables tables;
+    return tables;
+}
+
+inline int dist_code(const CodeTables &t, int d) {
+    return d<=256 ? t.dist_small[d-1] : t.dist_large[(d-1)>>7];
+}
+
+// code lengths of at most limit bits for the symbols with a nonzero frequency: minimum-redundancy
+// lengths computed in place (Moffat and Katajainen) over the symbols sorted by frequency, then
+// the longest codes folded back into the limit while keeping the code complete
+void code_lengths(const uint32_t *freq, int n, int limit, unsigned char *lens) {
+    memset(lens, 0, n);
+    std::vector<int> syms;
+    for (int i=0; i<n; i++) if (freq[i]) syms.push_back(i);
+    // fewer than two codes would leave an incomplete code, which some inflaters reject
+    if (syms.size()<2) {
+        int used = syms.empty() ? 0 : syms[0];
+        lens[used] = 1;
+        lens[used ? 0 : 1] = 1;
+        return;
+    }
+    std::stable_sort(syms.begin(), syms.end(), [&](int a, int b) { return freq[a]<freq[b]; });
+    int m = (int)syms.size();
+    std::vector<uint32_t> A(m);
+    for (int i=0; i<m; i++) A[i] = freq[syms[i]];
+    A[0] += A[1];
+    int root = 0, leaf = 2;
+    for (int next=1; next<m-1; next++) {
+        if (leaf>=m || A[root]<A[leaf]) {
+            A[next] = A[root];
+            A[root++] = next;
+        } else {
+            A[next] = A[leaf++];
+        }
+        if (leaf>=m || (root<next && A[root]<A[leaf])) {
+            A[next] += A[root];
+            A[root++] = next;
+        } else {
+            A[next] += A[leaf++];
+        }
+    }
+    A[m-2] = 0;
+    for (int next=m-3; next>=0; next--) A[next] = A[A[next]]+1;
+    int avail = 1, used = 0, depth = 0;
+    root = m-2;
+    int next = m-1;
+    while (avail>0) {
+        while (root>=0 && (int)A[root]==depth) {
+            used++;
+            root--;
+        }
+        while (avail>used) {
+            A[next--] = depth;
+            avail--;
+        }
+        avail = 2*used;
+        depth++;
+        used = 0;
+    }
+    // A now holds the lengths, the longest first; count them per length and enforce the limit
+    std::vector<int> count(std::max(depth, limit)+1, 0);
+    for (int i=0; i<m; i++) count[A[i]]++;
+    for (int l=limit+1; l<(int)count.size(); l++) {
+        count[limit] += count[l];
+        count[l] = 0;
+    }
+    uint32_t total = 0;
+    for (int l=limit; l>0; l--) total += (uint32_t)count[l]<<(limit-l);
+    while (total!=(1u<<limit)) {
+        count[limit]--;
+        for (int l=limit-1; l>0; l--) {
+            if (count[l]) {
+                count[l]--;
+                count[l+1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+    int j = 0;
+    for (int l=limit; l>0; l--) {
+        for (int k=count[l]; k>0; k--) lens[syms[j++]] = l;
+    }
+}
+
+// canonical codes for the lengths, bit-reversed since deflate sends Huffman codes from the top bit
+void make_codes(const unsigned char *lens, int n, uint16_t *codes) {
+    int count[16] = {0};
+    for (int i=0; i<n; i++) count[lens[i]]++;
+    count[0] = 0;
+    int next[16] = {0};
+    int code = 0;
+    for (int l=1; l<16; l++) {
+        code = (code + count[l-1])<<1;
+        next[l] = code;
+    }
+    for (int i=0; i<n; i++) {
+        if (!lens[i]) continue;
+        int c = next[lens[i]]++, r = 0;
+        for (int k=0; k<lens[i]; k++) r |= ((c>>k) & 1)<<(lens[i]-1-k);
+        codes[i] = r;
+    }
+}
+
+// LSB-first bit output into a byte vector; callers reserve room before writing
+class BitWriter {
+    std::vector<unsigned char> &out;
+    size_t pos;
+    uint64_t bits;
+    int count;
+public:
+    explicit BitWriter(std::vector<unsigned char> &o) : out(o), pos(o.size()), bits(0), count(0) {}
+    void reserve(size_t nbytes) {
+        if (out.size()<pos+nbytes+8) out.resize(std::max(pos+nbytes+8, out.size()*2));
+    }
+    void put(uint32_t v, int n) {
+        bits |= (uint64_t)v<<count;
+        count += n;
+        if (count>=32) {
+            uint32_t w = (uint32_t)bits;
+            memcpy(&out[pos], &w, 4);
+            pos += 4;
+            bits >>= 32;
+            count -= 32;
+        }
+    }
+    void align() {
+        for (; count>0; count-=8) {
+            out[pos++] = (unsigned char)bits;
+            bits >>= 8;
+        }
+        bits = 0;
+        count = 0;
+    }
+    void bytes(const unsigned char *p, size_t n) {
+        memcpy(&out[pos], p, n);
+        pos += n;
+    }
+    int pending() const { return count; }
+    void finish() {
+        align();
+        out.resize(pos);
+    }
+};
+
+// one chunk through LZ77 and Huffman coding
+class Deflater {
+    const Config &cfg;
+    const CodeTables &tables;
+    BitWriter &bw;
+    std::vector<int> head;      // newest position per hash, -1 when empty
+    std::vector<int> prev;      // the position before, with the same hash, per position mod WINDOW
+    const unsigned char *data;  // the window: the dictionary, then the chunk
+    int end;
+    // the current block: symbols (dist 0 for a literal), frequencies and the raw bytes covered
+    std::vector<uint16_t> lit;
+    std::vector<uint16_t> dist;
+    int nsym;
+    uint32_t lfreq[286];
+    uint32_t dfreq[30];
+    int block_start;
+    int covered;
+
+    static inline uint32_t hash(const unsigned char *p) {
+        uint32_t v = p[0] | p[1]<<8 | p[2]<<16;
+        return (v*0x9e3779b1u)>>(32-HASH_BITS);
+    }
+
+    // adds the string at p to its hash chain and returns the previous head
+    inline int insert(int p) {
+        uint32_t h = hash(data+p);
+        int h0 = head[h];
+        prev[p & (WINDOW-1)] = h0;
+        head[h] = p;
+        return h0;
+    }
+
+    inline int match_length(const unsigned char *a, const unsigned char *b, int max) {
+        int len = 0;
+        for (; len+8<=max; len+=8) {
+            uint64_t x, y;
+            memcpy(&x, a+len, 8);
+            memcpy(&y, b+len, 8);
+            if (x!=y) return len + (std::countr_zero(x^y)>>3);
+        }
+        for (; len<max && a[len]==b[len]; len++) {}
+        return len;
+    }
+
+    // the longest match for p along the chain from cand that beats best; distances stay below
+    // WINDOW, so a chain slot is never one already reused by a newer position
+    int longest_match(int p, int cand, int best, int &match_dist) {
+        int chain = best>=cfg.good ? cfg.chain>>2 : cfg.chain;
+        int max = std::min(MAX_MATCH, end-p);
+        if (best>=max) return best;
+        int nice = std::min(cfg.nice, max);
+        int limit = std::max(p-WINDOW, -1);
+        const unsigned char *s = data+p;
+        for (; cand>limit && chain>0; chain--) {
+            const unsigned char *c = data+cand;
+            if (c[best]==s[best] && c[0]==s[0] && c[1]==s[1]) {
+                int len = match_length(c, s, max);
+                if (len>best) {
+                    best = len;
+                    match_dist = p-cand;
+                    if (len>=nice) break;
+                }
+            }
+            cand = prev[cand & (WINDOW-1)];
+        }
+        return best;
+    }
+
+    void literal(int p) {
+        lit[nsym] = data[p];
+        dist[nsym++] = 0;
+        lfreq[data[p]]++;
+        covered++;
+    }
+
+    void match(int len, int d) {
+        lit[nsym] = len;
+        dist[nsym++] = d;
+        lfreq[257+tables.len_code[len]]++;
+        dfreq[dist_code(tables, d)]++;
+        covered += len;
+    }
+
+    void reset_block() {
+        nsym = 0;
+        memset(lfreq, 0, sizeof(lfreq));
+        memset(dfreq, 0, sizeof(dfreq));
+        block_start += covered;
+        covered = 0;
+    }
+
+    void flush_block(bool final);
+    void write_stored(bool final, const unsigned char *p, int n);
+public:
+    Deflater(const Config &c, BitWriter &w) : cfg(c), tables(code_tables()), bw(w), head(1<<HASH_BITS), prev(WINDOW),
+        data(NULL), end(0), lit(BLOCK_SYMBOLS), dist(BLOCK_SYMBOLS), nsym(0), lfreq(), dfreq(), block_start(0), covered(0) {}
+    // compresses window[dict, n) with window[0, dict) as dictionary
+    void compress(const unsigned char *window, int dict, int n, bool final);
+};
+
+void Deflater::write_stored(bool final, const unsigned char *p, int n) {
+    bw.reserve(n + (n/65535+1)*5 + 8);
+    do {
+        int k = std::min(n, 65535);
+        n -= k;
+        bw.put(final && n==0, 1);
+        bw.put(0, 2);
+        bw.align();
+        unsigned char header[4] = {(unsigned char)k, (unsigned char)(k>>8), (unsigned char)~k, (unsigned char)(~k>>8)};
+        bw.bytes(header, 4);
+        bw.bytes(p, k);
+        p += k;
+    } while (n>0);
+}
+
+// sends the collected symbols as whichever of a dynamic Huffman, static Huffman or stored block
+// is the smallest
+void Deflater::flush_block(bool final) {
+    lfreq[256] = 1;
+    unsigned char llen[286], dlen[30];
+    code_lengths(lfreq, 286, 15, llen);
+    code_lengths(dfreq, 30, 15, dlen);
+    int hlit = 286, hdist = 30;
+    while (hlit>257 && !llen[hlit-1]) hlit--;
+    while (hdist>1 && !dlen[hdist-1]) hdist--;
+
+    // run-length code the lengths of both trees with symbols 16 (repeat), 17 and 18 (zeros)
+    unsigned char lens[316];
+    memcpy(lens, llen, hlit);
+    memcpy(lens+hlit, dlen, hdist);
+    int total = hlit+hdist;
+    std::vector<unsigned char> cl_sym, cl_extra;
+    uint32_t cl_freq[19] = {0};
+    for (int i=0; i<total; ) {
+        int v = lens[i], run = 1;
+        while (i+run<total && lens[i+run]==v) run++;
+        i += run;
+        if (v==0) {
+            while (run>=11) {
+                int k = std::min(run, 138);
+                cl_sym.push_back(18);
+                cl_extra.push_back(k-11);
+                run -= k;
+            }
+            if (run>=3) {
+                cl_sym.push_back(17);
+                cl_extra.push_back(run-3);
+                run = 0;
+            }
+        } else {
+            cl_sym.push_back(v);
+            cl_extra.push_back(0);
+            run--;
+            while (run>=3) {
+                int k = std::min(run, 6);
+                cl_sym.push_back(16);
+                cl_extra.push_back(k-3);
+                run -= k;
+            }
+        }
+        for (; run>0; run--) {
+            cl_sym.push_back(v);
+            cl_extra.push_back(0);
+        }
+    }
+    for (unsigned char s : cl_sym) cl_freq[s]++;
+    unsigned char cl_len[19];
+    code_lengths(cl_freq, 19, 7, cl_len);
+    int hclen = 19;
+    while (hclen>4 && !cl_len[CL_ORDER[hclen-1]]) hclen--;
+
+    // sizes in bits of the three ways to send the block
+    static const int CL_EXTRA_BITS[19] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7};
+    uint64_t extra = 0;
+    for (int c=0; c<29; c++) extra += (uint64_t)lfreq[257+c]*LEN_EXTRA[c];
+    for (int c=0; c<30; c++) extra += (uint64_t)dfreq[c]*DIST_EXTRA[c];
+    uint64_t dynamic_bits = 3 + 5+5+4 + 3*hclen + extra;
+    for (int s=0; s<19; s++) dynamic_bits += (uint64_t)cl_freq[s]*(cl_len[s] + CL_EXTRA_BITS[s]);
+    for (int s=0; s<286; s++) dynamic_bits += (uint64_t)lfreq[s]*llen[s];
+    for (int s=0; s<30; s++) dynamic_bits += (uint64_t)dfreq[s]*dlen[s];
+    unsigned char slen[288], sdlen[30];
+    for (int s=0; s<288; s++) slen[s] = s<144 ? 8 : (s<256 ? 9 : (s<280 ? 7 : 8));
+    memset(sdlen, 5, sizeof(sdlen));
+    uint64_t static_bits = 3 + extra;
+    for (int s=0; s<286; s++) static_bits += (uint64_t)lfreq[s]*slen[s];
+    for (int s=0; s<30; s++) static_bits += (uint64_t)dfreq[s]*sdlen[s];
+    int pad = (8 - (bw.pending()+3)%8) % 8;
+    uint64_t stored_bits = 3 + pad + 32 + 8ull*covered + (uint64_t)(covered/65535)*(8+32);
+
+    if (stored_bits<=dynamic_bits && stored_bits<=static_bits) {
+        write_stored(final, data+block_start, covered);
+        reset_block();
+        return;
+    }
+    bool dynamic = dynamic_bits<static_bits;
+    bw.reserve((std::min(dynamic_bits, static_bits)+7)/8 + 8);
+    uint16_t lcode[288], dcode[30];
+    const unsigned char *L = dynamic ? llen : slen, *D = dynamic ? dlen : sdlen;
+    make_codes(L, dynamic ? 286 : 288, lcode);
+    make_codes(D, 30, dcode);
+    bw.put(final, 1);
+    bw.put(dynamic ? 2 : 1, 2);
+    if (dynamic) {
+        uint16_t cl_code[19];
+        make_codes(cl_len, 19, cl_code);
+        bw.put(hlit-257, 5);
+        bw.put(hdist-1, 5);
+        bw.put(hclen-4, 4);
+        for (int i=0; i<hclen; i++) bw.put(cl_len[CL_ORDER[i]], 3);
+        for (size_t i=0; i<cl_sym.size(); i++) {
+            int s = cl_sym[i];
+            bw.put(cl_code[s], cl_len[s]);
+            if (CL_EXTRA_BITS[s]) bw.put(cl_extra[i], CL_EXTRA_BITS[s]);
+        }
+    }
+    for (int i=0; i<nsym; i++) {
+        int l = lit[i], d = dist[i];
+        if (!d) {
+            bw.put(lcode[l], L[l]);
+            continue;
+        }
+        int lc = tables.len_code[l], dc = dist_code(tables, d);
+        bw.put(lcode[257+lc], L[257+lc]);
+        if (LEN_EXTRA[lc]) bw.put(l-LEN_BASE[lc], LEN_EXTRA[lc]);
+        bw.put(dcode[dc], D[dc]);
+        if (DIST_EXTRA[dc]) bw.put(d-DIST_BASE[dc], DIST_EXTRA[dc]);
+    }
+    bw.put(lcode[256], L[256]);
+    reset_block();
+}
+
+void Deflater::compress(const unsigned char *window, int dict, int n, bool final) {
+    data = window;
+    end = n;
+    std::fill(head.begin(), head.end(), -1);
+    nsym = 0;
+    memset(lfreq, 0, sizeof(lfreq));
+    memset(dfreq, 0, sizeof(dfreq));
+    block_start = dict;
+    covered = 0;
+    if (cfg.chain==0) {
+        write_stored(final, data+dict, n-dict);
+        return;
+    }
+    // prime the hash chains with the dictionary, as deflateSetDictionary does
+    for (int p=0; p<dict && p+MIN_MATCH<=end; p++) insert(p);
+
+    int p = dict;
+    if (cfg.greedy) {
+        while (p<end) {
+            int len = 0, d = 0;
+            if (p+MIN_MATCH<=end) {
+                int cand = insert(p);
+                len = longest_match(p, cand, MIN_MATCH-1, d);
+            }
+            if (len>=MIN_MATCH) {
+                match(len, d);
+                if (len<=cfg.lazy) {
+                    for (int q=p+1; q<p+len && q+MIN_MATCH<=end; q++) insert(q);
+                }
+                p += len;
+            } else {
+                literal(p++);
+            }
+            if (nsym==BLOCK_SYMBOLS) flush_block(false);
+        }
+    } else {
+        // lazy matching: a match is only taken when the string one byte later has no longer one
+        int prev_len = MIN_MATCH-1, prev_dist = 0;
+        bool pending = false;
+        while (p<end) {
+            int len = MIN_MATCH-1, d = 0;
+            if (p+MIN_MATCH<=end) {
+                int cand = insert(p);
+                if (prev_len<cfg.lazy) {
+                    len = longest_match(p, cand, prev_len, d);
+                    if (len<=prev_len) len = MIN_MATCH-1;
+                    else if (len==MIN_MATCH && d>TOO_FAR) len = MIN_MATCH-1;
+                }
+            }
+            if (prev_len>=MIN_MATCH && len<=prev_len) {
+                // the match found at p-1 wins; its strings are inserted up to its end
+                match(prev_len, prev_dist);
+                int match_end = p-1+prev_len;
+                for (int q=p+1; q<match_end && q+MIN_MATCH<=end; q++) insert(q);
+                p = match_end;
+                pending = false;
+                prev_len = MIN_MATCH-1;
+            } else {
+                if (pending) literal(p-1);
+                pending = true;
+                prev_len = len;
+                prev_dist = d;
+                p++;
+            }
+            if (nsym>=BLOCK_SYMBOLS-1) flush_block(false);
+        }
+        if (pending) literal(p-1);
+    }
+    flush_block(final);
+}
+
+// ---- file ----
+
+void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = v>>24;
+    p[1] = v>>16;
+    p[2] = v>>8;
+    p[3] = v;
+}
+
+// a PNG chunk: length, type, data and the CRC of type and data, which is computed by the caller
+// (the IDAT chunks compute theirs on the compressing thread)
+void write_chunk(std::ofstream &out, const char *type, const unsigned char *p, size_t n, uint32_t crc) {
+    unsigned char header[8], trailer[4];
+    put_be32(header, (uint32_t)n);
+    memcpy(header+4, type, 4);
+    put_be32(trailer, crc);
+    out.write((const char *)header, 8);
+    out.write((const char *)p, n);
+    out.write((const char *)trailer, 4);
+}
+
+uint32_t chunk_crc(const char *type, const unsigned char *p, size_t n) {
+    return crc32(crc32(0, (const unsigned char *)type, 4), p, n);
+}
+
+struct Chunk {
+    std::vector<unsigned char> bytes;
+    uint32_t adler;
+    uint32_t crc;
+};
+
+}
+
+bool write_png(const char *filename, ConstImageView src, int level) {
+    const int bpp = src.bytespp;
+    if (!src.data || src.width<=0 || src.height<=0 || (bpp!=1 && bpp!=3 && bpp!=4)) return false;
+    level = std::clamp(level, (int)PNG_STORE, (int)PNG_BEST);
+    const int w = src.width, h = src.height;
+    const size_t line = (size_t)w*bpp + 1;
+    const size_t size = line*h;
+
+    // filter the rows, then put them in R,G,B order: every filter works per channel, so swapping
+    // the filtered bytes is the same as filtering swapped ones
+    std::unique_ptr<unsigned char[]> filtered(new unsigned char[size]);
+    parallel_for(0, h, 16, [&](int y0, int y1) {
+        std::vector<unsigned char> tmp((size_t)w*bpp*4), zero((size_t)w*bpp, 0);
+        for (int y=y0; y<y1; y++) {
+            unsigned char *out = filtered.get() + y*line;
+            if (level==PNG_STORE) {
+                out[0] = PNG_FILTER_NONE;
+                memcpy(out+1, src.row(y), line-1);
+            } else {
+                filter_row(src.row(y), y ? src.row(y-1) : zero.data(), w*bpp, bpp, out, tmp.data());
+            }
+            if (bpp>1) swap_red_blue(ConstImageView(out+1, w, 1, line, bpp), ImageView(out+1, w, 1, line, bpp));
+        }
+    });
+
+    // deflate the chunks independently, each primed with the 32 KB before it
+    const int nchunks = (int)((size + CHUNK - 1)/CHUNK);
+    std::vector<Chunk> chunks(nchunks);
+    parallel_run(nchunks, [&](int c) {
+        size_t start = c*CHUNK, stop = std::min(size, start+CHUNK);
+        size_t dict = std::min(start, (size_t)WINDOW);
+        Chunk &chunk = chunks[c];
+        if (c==0) {
+            // the zlib header: deflate with a 32K window, the level hint, and a check value
+            static const int FLEVEL[10] = {0, 0, 1, 1, 1, 1, 2, 3, 3, 3};
+            unsigned cmf = 0x78, flg = FLEVEL[level]<<6;
+            flg += 31 - (cmf*256 + flg)%31;
+            chunk.bytes.push_back(cmf);
+            chunk.bytes.push_back(flg);
+        }
+        BitWriter bw(chunk.bytes);
+        Deflater deflater(configs[level], bw);
+        bool last = c==nchunks-1;
+        deflater.compress(filtered.get()+start-dict, (int)dict, (int)(stop-start+dict), last);
+        if (!last && level!=PNG_STORE) {
+            // an empty stored block ends the chunk on a byte boundary, as a zlib sync flush does
+            bw.reserve(8);
+            bw.put(0, 3);
+            bw.align();
+            static const unsigned char sync[4] = {0, 0, 0xff, 0xff};
+            bw.bytes(sync, 4);
+        }
+        bw.finish();
+        chunk.adler = adler32(1, filtered.get()+start, stop-start);
+        chunk.crc = chunk_crc("IDAT", chunk.bytes.data(), chunk.bytes.size());
+    });
+    uint32_t adler = chunks[0].adler;
+    for (int c=1; c<nchunks; c++) {
+        size_t len = std::min(size, (c+1)*CHUNK) - c*CHUNK;
+        adler = adler32_combine(adler, chunks[c].adler, len);
+    }
+
+    std::ofstream out;
+    out.open (filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        out.close();
+        return false;
+    }
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    out.write((const char *)signature, 8);
+    unsigned char ihdr[13];
+    put_be32(ihdr, w);
+    put_be32(ihdr+4, h);
+    ihdr[8] = 8;                                    // bits per channel
+    ihdr[9] = bpp==1 ? 0 : (bpp==3 ? 2 : 6);        // gray, RGB, RGBA
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;             // deflate, adaptive filtering, no interlace
+    write_chunk(out, "IHDR", ihdr, 13, chunk_crc("IHDR", ihdr, 13));
+    for (const Chunk &chunk : chunks) write_chunk(out, "IDAT", chunk.bytes.data(), chunk.bytes.size(), chunk.crc);
+    unsigned char trailer[4];
+    put_be32(trailer, adler);
+    write_chunk(out, "IDAT", trailer, 4, chunk_crc("IDAT", trailer, 4));
+    write_chunk(out, "IEND", NULL, 0, chunk_crc("IEND", NULL, 0));
+    if (!out.good()) {
+        std::cerr << "can't dump the png file\n";
+        out.close();
+        return false;
+    }
+    out.close();
+    return true;
+}
@@ -0,0 +1,23 @@
+#ifndef __PNG_H__
+#define __PNG_H__
+
+#include "tgaimage.h"
+
+// compression levels of write_png, as in zlib: 0 stores, 1 is the fast greedy matcher, 6 the
+// default lazy one and 9 searches the longest hash chains
+enum PngLevel {
+    PNG_STORE = 0,
+    PNG_FAST = 1,
+    PNG_DEFAULT = 6,
+    PNG_BEST = 9
+};
+
+// writes src as an 8-bit PNG, row 0 at the top: 1-byte views as gray, 3 and 4-byte ones (B,G,R(,A)
+// as in TGA) as RGB(A). rows are filtered in parallel, each with the filter of the smallest sum of
+// absolute differences. the filtered data is deflated pigz style in independent 128 KB chunks on the
+// thread pool: a chunk is primed with the 32 KB before it as dictionary and ends on a byte boundary
+// with an empty stored block, so the chunks concatenate into one zlib stream. every chunk goes out
+// as its own IDAT whose CRC its thread computes, and the chunk Adler-32 sums are combined at the end
+bool write_png(const char *filename, ConstImageView src, int level=PNG_DEFAULT);
+
+#endif //__PNG_H__
@@ -0,0 +1,287 @@
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <string.h>
+#include "qoi.h"
+#include "simd.h"
+
+namespace {
+
+const unsigned char QOI_OP_INDEX = 0x00;
+const unsigned char QOI_OP_DIFF  = 0x40;
+const unsigned char QOI_OP_LUMA  = 0x80;
+const unsigned char QOI_OP_RUN   = 0xc0;
+const unsigned char QOI_OP_RGB   = 0xfe;
+const unsigned char QOI_OP_RGBA  = 0xff;
+
+const int QOI_HEADER_SIZE = 14;
+const unsigned char QOI_END_MARKER[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+const int QOI_MAX_RUN = 62;
+// the limit of the reference implementation, which keeps width*height*4 within 31 bits
+const size_t QOI_MAX_PIXELS = 400000000;
+const size_t ENCODER_BUFFER = 1<<16;
+
+// pixels are handled as one word holding the B,G,R,A bytes in memory order, which is what a
+// little-endian load of a TGA pixel gives; the file stores literals as R,G,B,A
+
+// (r*3 + g*5 + b*7 + a*11) % 64 with one multiplication: B and R move to bits 0 and 16, G and A to
+// bits 40 and 56, and the multiplier puts the four weighted bytes at bit 56. every other partial
+// product lands at bit 64 or above, or sums to less than 2^56, so the top byte is carry free
+inline uint32_t hash(uint32_t px) {
+    uint64_t v = px;
+    uint64_t spread = (v & 0x00ff00ffu) | (v & 0xff00ff00u)<<32;
+    return (uint32_t)((spread * 0x070003000005000bull)>>56) & 63;
+}
+
+// 24-bit pixels are assembled with shifts: copying 3 bytes into a word goes through memory and
+// stalls the load that follows
+template <int BPP> inline uint32_t load_pixel(const unsigned char *p) {
+    uint32_t px;
+    if (BPP==4) memcpy(&px, p, 4);
+    else if (BPP==3) px = 0xff000000u | (uint32_t)p[2]<<16 | (uint32_t)p[1]<<8 | p[0];
+    else px = 0xff000000u | p[0]*0x010101u;
+    return px;
+}
+
+// adds a signed difference to each byte of px, every byte wrapping on its own
+inline uint32_t add_bytes(uint32_t px, uint32_t d) {
+    return ((px & 0x7f7f7f7fu) + (d & 0x7f7f7f7fu)) ^ ((px ^ d) & 0x80808080u);
+}
+
+inline uint32_t bgr_difference(int vb, int vg, int vr) {
+    return (uint32_t)(unsigned char)vb | (uint32_t)(unsigned char)vg<<8 | (uint32_t)(unsigned char)vr<<16;
+}
+
+inline void put32(unsigned char *p, uint32_t v) {
+    p[0] = v>>24;
+    p[1] = v>>16;
+    p[2] = v>>8;
+    p[3] = v;
+}
+
+inline uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0]<<24 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<8 | p[3];
+}
+
+// pixels of a row equal to the one before, starting at x. 16 bytes from x are compared with the 16
+// bytes one pixel earlier: a match means 16/BPP more pixels repeat the previous one
+template <int BPP> inline int repeats(const unsigned char *row, int x, int n) {
+    int count = 0;
+#ifdef SIMD_SSE2
+    if (x>0) {
+        while ((x+count)*BPP+16<=n*BPP) {
+            const unsigned char *p = row+(x+count)*BPP;
+            __m128i a = _mm_loadu_si128((const __m128i *)p);
+            __m128i b = _mm_loadu_si128((const __m128i *)(p-BPP));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b))!=0xffff) break;
+            count += 16/BPP;
+        }
+    }
+#endif
+    return count;
+}
+
+// stores pixel x of a row. a 24-bit pixel that is not the last one is written as a whole word,
+// the spare byte is overwritten by the next pixel
+template <int BPP> inline void store_pixel(unsigned char *row, int x, int n, uint32_t px) {
+    if (BPP==4 || x+1<n) memcpy(row+x*BPP, &px, 4);
+    else memcpy(row+x*BPP, &px, BPP);
+}
+
+template <int BPP> bool decode_pixels(const unsigned char *in, const unsigned char *end, ImageView dst) {
+    uint32_t index[64] = {};
+    uint32_t px = 0xff000000u;
+    int run = 0;
+    for (int y=0; y<dst.height; y++) {
+        unsigned char *row = dst.row(y);
+        for (int x=0; x<dst.width; ) {
+            if (run>0) {
+                int n = std::min(run, dst.width-x);
+                for (int i=0; i<n; i++) store_pixel<BPP>(row, x+i, dst.width, px);
+                x += n;
+                run -= n;
+                continue;
+            }
+            // the 8-byte end marker is not part of [in, end), so the up to 4 bytes after an op
+            // byte are always inside the buffer
+            if (in>=end) return false;
+            unsigned char b1 = *in++;
+            if (b1==QOI_OP_RGB) {
+                px = (px & 0xff000000u) | (uint32_t)in[0]<<16 | (uint32_t)in[1]<<8 | in[2];
+                in += 3;
+            } else if (b1==QOI_OP_RGBA) {
+                px = (uint32_t)in[3]<<24 | (uint32_t)in[0]<<16 | (uint32_t)in[1]<<8 | in[2];
+                in += 4;
+            } else if ((b1 & 0xc0)==QOI_OP_INDEX) {
+                px = index[b1];
+            } else if ((b1 & 0xc0)==QOI_OP_DIFF) {
+                px = add_bytes(px, bgr_difference((b1 & 3) - 2, ((b1>>2) & 3) - 2, ((b1>>4) & 3) - 2));
+            } else if ((b1 & 0xc0)==QOI_OP_LUMA) {
+                unsigned char b2 = *in++;
+                int vg = (b1 & 0x3f) - 32;
+                px = add_bytes(px, bgr_difference(vg - 8 + (b2 & 0x0f), vg, vg - 8 + ((b2>>4) & 0x0f)));
+            } else {
+                run = (b1 & 0x3f) + 1;
+            }
+            index[hash(px)] = px;
+            if (!run) {
+                store_pixel<BPP>(row, x, dst.width, px);
+                x++;
+            }
+        }
+    }
+    return true;
+}
+
+}
+
+bool qoi_read_header(const unsigned char *in, size_t size, QoiHeader &header) {
+    if (size<(size_t)QOI_HEADER_SIZE+sizeof(QOI_END_MARKER) || memcmp(in, "qoif", 4)) return false;
+    uint32_t w = get32(in+4), h = get32(in+8);
+    header.channels = in[12];
+    header.colorspace = in[13];
+    if (w==0 || h==0 || w>QOI_MAX_PIXELS/h) return false;
+    if ((header.channels!=3 && header.channels!=4) || header.colorspace>1) return false;
+    header.width = (int)w;
+    header.height = (int)h;
+    return true;
+}
+
+bool qoi_decode(const unsigned char *in, size_t size, ImageView dst) {
+    QoiHeader header;
+    if (!dst.data || !qoi_read_header(in, size, header)) return false;
+    if (dst.width!=header.width || dst.height!=header.height) return false;
+    const unsigned char *end = in+size-sizeof(QOI_END_MARKER);
+    if (dst.bytespp==3) return decode_pixels<3>(in+QOI_HEADER_SIZE, end, dst);
+    if (dst.bytespp==4) return decode_pixels<4>(in+QOI_HEADER_SIZE, end, dst);
+    return false;
+}
+
+QoiEncoder::QoiEncoder() : used(0), written(0), index(), prev(0), run(0), width(0), rows_left(0), failed(false) {
+}
+
+QoiEncoder::~QoiEncoder() {
+    if (out.is_open()) close();
+}
+
+bool QoiEncoder::open(const char *filename, int w, int h, int c) {
+    if (out.is_open()) close();
+    if (w<=0 || h<=0 || (size_t)w>QOI_MAX_PIXELS/h || (c!=3 && c!=4)) return false;
+    out.open(filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    // a row codes to at most 5 bytes per pixel plus the run carried in from the row before
+    buf.resize(std::max(ENCODER_BUFFER, (size_t)w*5+1));
+    width = w;
+    rows_left = h;
+    memset(index, 0, sizeof(index));
+    prev = 0xff000000u;
+    run = 0;
+    written = 0;
+    failed = false;
+    unsigned char *header = buf.data();
+    memcpy(header, "qoif", 4);
+    put32(header+4, w);
+    put32(header+8, h);
+    header[12] = c;
+    header[13] = 0;
+    used = QOI_HEADER_SIZE;
+    return true;
+}
+
+void QoiEncoder::flush() {
+    out.write((const char *)buf.data(), used);
+    if (!out.good()) failed = true;
+    written += used;
+    used = 0;
+}
+
+// the state lives in locals while a row is coded: the byte stores through o may alias any member,
+// which would otherwise make the compiler reload index, prev and run after each of them
+template <int BPP> void QoiEncoder::encode_row(const unsigned char *row) {
+    uint32_t seen[64];
+    memcpy(seen, index, sizeof(seen));
+    uint32_t prev = this->prev;
+    int run = this->run;
+    const int width = this->width;
+    unsigned char *o = buf.data()+used;
+    for (int x=0; x<width; x++) {
+        uint32_t px = load_pixel<BPP>(row+x*BPP);
+        if (px==prev) {
+            int n = repeats<BPP>(row, x+1, width);
+            run += 1+n;
+            x += n;
+            for (; run>=QOI_MAX_RUN; run-=QOI_MAX_RUN) *o++ = QOI_OP_RUN | (QOI_MAX_RUN-1);
+            continue;
+        }
+        if (run) {
+            *o++ = QOI_OP_RUN | (run-1);
+            run = 0;
+        }
+        uint32_t h = hash(px);
+        if (seen[h]==px) {
+            *o++ = QOI_OP_INDEX | h;
+        } else {
+            seen[h] = px;
+            unsigned char r = px>>16, g = px>>8, b = px;
+            if ((px ^ prev)>>24) {
+                *o++ = QOI_OP_RGBA;
+                *o++ = r;
+                *o++ = g;
+                *o++ = b;
+                *o++ = px>>24;
+            } else {
+                signed char vr = (signed char)(r - (unsigned char)(prev>>16));
+                signed char vg = (signed char)(g - (unsigned char)(prev>>8));
+                signed char vb = (signed char)(b - (unsigned char)prev);
+                int vg_r = vr - vg, vg_b = vb - vg;
+                if (vr>-3 && vr<2 && vg>-3 && vg<2 && vb>-3 && vb<2) {
+                    *o++ = QOI_OP_DIFF | (vr+2)<<4 | (vg+2)<<2 | (vb+2);
+                } else if (vg_r>-9 && vg_r<8 && vg>-33 && vg<32 && vg_b>-9 && vg_b<8) {
+                    *o++ = QOI_OP_LUMA | (vg+32);
+                    *o++ = (vg_r+8)<<4 | (vg_b+8);
+                } else {
+                    *o++ = QOI_OP_RGB;
+                    *o++ = r;
+                    *o++ = g;
+                    *o++ = b;
+                }
+            }
+        }
+        prev = px;
+    }
+    memcpy(index, seen, sizeof(seen));
+    this->prev = prev;
+    this->run = run;
+    used = o-buf.data();
+}
+
+bool QoiEncoder::write_rows(ConstImageView rows) {
+    if (!out.is_open() || failed || !rows.data || rows.width!=width || rows.height>rows_left) return false;
+    if (rows.bytespp!=1 && rows.bytespp!=3 && rows.bytespp!=4) return false;
+    for (int y=0; y<rows.height; y++) {
+        if (buf.size()-used<(size_t)width*5+1) flush();
+        switch (rows.bytespp) {
+            case 1: encode_row<1>(rows.row(y)); break;
+            case 3: encode_row<3>(rows.row(y)); break;
+            default: encode_row<4>(rows.row(y)); break;
+        }
+    }
+    rows_left -= rows.height;
+    return !failed;
+}
+
+bool QoiEncoder::close() {
+    if (!out.is_open()) return false;
+    if (buf.size()-used<1+sizeof(QOI_END_MARKER)) flush();
+    if (run) buf[used++] = QOI_OP_RUN | (run-1);
+    run = 0;
+    memcpy(buf.data()+used, QOI_END_MARKER, sizeof(QOI_END_MARKER));
+    used += sizeof(QOI_END_MARKER);
+    flush();
+    out.close();
+    if (rows_left) std::cerr << "qoi file closed with " << rows_left << " rows missing\n";
+    return !failed && !rows_left;
+}
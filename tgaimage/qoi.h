@@ -0,0 +1,53 @@
+#ifndef __QOI_H__
+#define __QOI_H__
+
+#include <fstream>
+#include <vector>
+#include "tgaimage.h"
+
+// QOI, the "Quite OK Image" format (qoiformat.org): lossless, one pass, every pixel coded against
+// the previous one as a run, an index into a 64-entry hash of seen colors, a small difference or a
+// literal. rows are stored top-down; colors are converted to and from B,G,R(,A) as in TGA
+
+struct QoiHeader {
+    int width;
+    int height;
+    int channels;       // 3 or 4
+    int colorspace;     // 0 sRGB with linear alpha, 1 all channels linear
+};
+
+// parses the 14-byte header at the start of a file held in memory
+bool qoi_read_header(const unsigned char *in, size_t size, QoiHeader &header);
+
+// decodes a whole file held in memory into dst, which has the size of the header and 3 or 4 bytes
+// per pixel, row 0 at the top. a 3-channel file decoded into 4 bytes per pixel gets alpha 255
+bool qoi_decode(const unsigned char *in, size_t size, ImageView dst);
+
+// streaming encoder: open() writes the header, write_rows() takes the scanlines top-down in as
+// many calls as convenient (e.g. a band at a time as a frame finishes), and close() writes the end
+// marker once all rows are in. rows with 1 byte per pixel are stored as gray RGB
+class QoiEncoder {
+    std::ofstream out;
+    std::vector<unsigned char> buf;
+    size_t used;
+    size_t written;
+    unsigned index[64];     // colors as B,G,R,A bytes in one word, like the pixels in memory
+    unsigned prev;
+    int run;
+    int width;
+    int rows_left;
+    bool failed;
+
+    template <int BPP> void encode_row(const unsigned char *row);
+    void flush();
+public:
+    QoiEncoder();
+    ~QoiEncoder();
+    bool open(const char *filename, int w, int h, int channels);
+    bool write_rows(ConstImageView rows);
+    bool close();
+    // bytes produced so far, header included
+    size_t size() const { return written+used; }
+};
+
+#endif //__QOI_H__
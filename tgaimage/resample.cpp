@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <string.h>
+#include <math.h>
+#include "resample.h"
+#include "parallel.h"
+#include "simd.h"
+
+namespace {
+
+const double PI = 3.14159265358979323846;
+
+// the kernels take a distance in source pixels at scale 1
+
+double box(double x) {
+    return x>-.5 && x<=.5 ? 1. : 0.;
+}
+
+double triangle(double x) {
+    x = fabs(x);
+    return x<1. ? 1.-x : 0.;
+}
+
+// the cubic convolution kernel with a = -0.5
+double catmull_rom(double x) {
+    x = fabs(x);
+    if (x<1.) return (1.5*x - 2.5)*x*x + 1.;
+    if (x<2.) return ((-.5*x + 2.5)*x - 4.)*x + 2.;
+    return 0.;
+}
+
+double sinc(double x) {
+    if (x==0.) return 1.;
+    x *= PI;
+    return sin(x)/x;
+}
+
+double lanczos3(double x) {
+    return fabs(x)<3. ? sinc(x)*sinc(x/3.) : 0.;
+}
+
+struct Kernel {
+    double (*f)(double);
+    double support;     // radius outside of which f is zero
+};
+
+// indexed by ResampleFilter
+const Kernel kernels[4] = {{box, .5}, {triangle, 1.}, {catmull_rom, 2.}, {lanczos3, 3.}};
+
+// one axis of the resampling: output i is the sum over k<count[i] of weight[i*taps+k] times source
+// sample start[i]+k. each row of weights is padded with zeros to taps, a multiple of 4
+struct Coefficients {
+    int taps;
+    std::vector<int> start;
+    std::vector<int> count;
+    std::vector<float> weight;
+};
+
+// taps reaching outside the source are dropped and the rest renormalized, so the borders keep
+// their brightness without replicating edge pixels
+Coefficients coefficients(int n, int m, const Kernel &kernel) {
+    double scale = (double)n/m;
+    double fscale = std::max(scale, 1.);
+    double support = kernel.support*fscale;
+    Coefficients c;
+    c.taps = ((int)ceil(support)*2 + 1 + 3) & ~3;
+    c.start.resize(m);
+    c.count.resize(m);
+    c.weight.assign((size_t)m*c.taps, 0.f);
+    std::vector<double> w(c.taps);
+    for (int i=0; i<m; i++) {
+        double center = (i+.5)*scale;
+        int lo = std::max((int)(center-support+.5), 0);
+        int hi = std::min((int)(center+support+.5), n);
+        double sum = 0.;
+        for (int k=lo; k<hi; k++) sum += w[k-lo] = kernel.f((k+.5-center)/fscale);
+        if (sum==0.) {
+            // cannot happen with these kernels, but never leave a pixel without a source
+            lo = std::min((int)center, n-1);
+            hi = lo+1;
+            w[0] = sum = 1.;
+        }
+        c.start[i] = lo;
+        c.count[i] = hi-lo;
+        for (int k=0; k<hi-lo; k++) c.weight[(size_t)i*c.taps+k] = (float)(w[k]/sum);
+    }
+    return c;
+}
+
+// widens n bytes to floats
+void widen(const unsigned char *src, float *dst, int n) {
+    int i = 0;
+#ifdef SIMD_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; i+16<=n; i+=16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(src+i));
+        __m128i lo = _mm_unpacklo_epi8(b, zero), hi = _mm_unpackhi_epi8(b, zero);
+        _mm_storeu_ps(dst+i,    _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_ps(dst+i+4,  _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_ps(dst+i+8,  _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_ps(dst+i+12, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)));
+    }
+#endif
+    for (; i<n; i++) dst[i] = src[i];
+}
+
+// horizontal pass over one widened row into m pixels of floats. `in` has 4 zeros past its end:
+// the SIMD paths load whole vectors, whose extra lanes meet either zero weights or padding
+template <int BPP> void filter_row(const float *in, float *out, const Coefficients &c, int m) {
+    for (int i=0; i<m; i++) {
+        const float *w = &c.weight[(size_t)i*c.taps];
+        const float *p = in + c.start[i]*BPP;
+        int count = c.count[i];
+#ifdef SIMD_SSE2
+        __m128 acc = _mm_setzero_ps();
+        if (BPP==1) {
+            // four taps per step, then a horizontal sum
+            for (int k=0; k<count; k+=4) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(w+k), _mm_loadu_ps(p+k)));
+            acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+            acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+            out[i] = _mm_cvtss_f32(acc);
+        } else {
+            // one pixel per vector; a 24-bit pixel carries the first channel of the next one along
+            for (int k=0; k<count; k++) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(p+k*BPP)));
+            if (BPP==4 || i+1<m) {
+                // the stray fourth lane of a 24-bit pixel is overwritten by the next one
+                _mm_storeu_ps(out+i*BPP, acc);
+            } else {
+                float t[4];
+                _mm_storeu_ps(t, acc);
+                memcpy(out+i*BPP, t, BPP*sizeof(float));
+            }
+        }
+#else
+        for (int ch=0; ch<BPP; ch++) {
+            float sum = 0.f;
+            for (int k=0; k<count; k++) sum += w[k]*p[k*BPP+ch];
+            out[i*BPP+ch] = sum;
+        }
+#endif
+    }
+}
+
+typedef void (*RowFilter)(const float *in, float *out, const Coefficients &c, int m);
+// indexed by bytes per pixel
+const RowFilter row_filters[5] = {NULL, filter_row<1>, NULL, filter_row<3>, filter_row<4>};
+
+// vertical pass: blends count rows of n floats with the weights, rounds and clamps to bytes
+void blend_rows(const float *const *rows, const float *w, int count, int n, unsigned char *out) {
+    int i = 0;
+#ifdef SIMD_SSE2
+    for (; i+16<=n; i+=16) {
+        __m128 a[4] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+        for (int k=0; k<count; k++) {
+            __m128 wk = _mm_set1_ps(w[k]);
+            const float *r = rows[k]+i;
+            for (int j=0; j<4; j++) a[j] = _mm_add_ps(a[j], _mm_mul_ps(wk, _mm_loadu_ps(r+4*j)));
+        }
+        __m128i q[4];
+        for (int j=0; j<4; j++) q[j] = _mm_cvtps_epi32(a[j]);
+        _mm_storeu_si128((__m128i *)(out+i), _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3])));
+    }
+#endif
+    for (; i<n; i++) {
+        float sum = 0.f;
+        for (int k=0; k<count; k++) sum += w[k]*rows[k][i];
+        long v = lrintf(sum);
+        out[i] = (unsigned char)(v<0 ? 0 : (v>255 ? 255 : v));
+    }
+}
+
+}
+
+void resample(ConstImageView src, ImageView dst, ResampleFilter filter) {
+    const int bpp = src.bytespp;
+    if (!src.data || !dst.data || src.width<=0 || src.height<=0 || dst.width<=0 || dst.height<=0) return;
+    if (bpp!=dst.bytespp || (bpp!=1 && bpp!=3 && bpp!=4)) return;
+    const Kernel &kernel = kernels[filter];
+    Coefficients ch = coefficients(src.width, dst.width, kernel);
+    Coefficients cv = coefficients(src.height, dst.height, kernel);
+
+    // the horizontal pass only covers the source rows the vertical pass reads
+    int y_lo = cv.start[0];
+    int y_hi = cv.start[dst.height-1]+cv.count[dst.height-1];
+    size_t line = (size_t)dst.width*bpp;
+    std::unique_ptr<float[]> tmp(new float[line*(y_hi-y_lo)]);
+    RowFilter filter_row_bpp = row_filters[bpp];
+    parallel_for(y_lo, y_hi, 16, [&](int y0, int y1) {
+        std::vector<float> in((size_t)src.width*bpp+4, 0.f);
+        for (int y=y0; y<y1; y++) {
+            widen(src.row(y), in.data(), src.width*bpp);
+            filter_row_bpp(in.data(), tmp.get()+(y-y_lo)*line, ch, dst.width);
+        }
+    });
+
+    parallel_for(0, dst.height, 16, [&](int y0, int y1) {
+        std::vector<const float *> rows(cv.taps);
+        for (int y=y0; y<y1; y++) {
+            for (int k=0; k<cv.count[y]; k++) rows[k] = tmp.get()+(cv.start[y]+k-y_lo)*line;
+            blend_rows(rows.data(), &cv.weight[(size_t)y*cv.taps], cv.count[y], (int)line, dst.row(y));
+        }
+    });
+}
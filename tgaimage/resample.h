@@ -0,0 +1,12 @@
+#ifndef __RESAMPLE_H__
+#define __RESAMPLE_H__
+
+#include "tgaimage.h"
+
+// resamples src into dst (same bytes per pixel, any sizes) with a separable filter: a horizontal
+// pass over every source row into a float buffer, then a vertical pass into dst. both passes use
+// precomputed coefficient tables, SSE2 inner loops, and split their rows across the thread pool.
+// when downscaling, the filter is widened by the scale factor so every source pixel contributes
+void resample(ConstImageView src, ImageView dst, ResampleFilter filter);
+
+#endif //__RESAMPLE_H__
@@ -0,0 +1,23 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+// SSE2 is part of the x86-64 baseline, so it is assumed there; everything else
+// falls back to the scalar paths. SSSE3 and F16C (half-float conversions) are only
+// used when the compiler targets them.
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(SIMD_SSE2) && (defined(__SSSE3__) || defined(__AVX2__))
+#define SIMD_SSSE3 1
+#include <tmmintrin.h>
+#endif
+
+// MSVC has no __F16C__; every AVX2 target has F16C.
+#if defined(SIMD_SSE2) && (defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__)))
+#define SIMD_F16C 1
+#include <immintrin.h>
+#endif
+
+#endif //__SIMD_H__
@@ -1,45 +1,171 @@
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <new>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
 #include <string.h>
 #include <time.h>
 #include <math.h>
 #include "tgaimage.h"
+#include "simd.h"
+#include "parallel.h"
+#include "resample.h"
+#include "qoi.h"
+#include "png.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0) {
+namespace {
+
+// pixel buffers start on a cache line, so wide loads of the first rows never straddle two
+const std::align_val_t PIXEL_ALIGNMENT = std::align_val_t(64);
+
+unsigned char *alloc_pixels(size_t nbytes) {
+    return (unsigned char *)::operator new[](nbytes, PIXEL_ALIGNMENT);
+}
+
+void free_pixels(unsigned char *p) {
+    ::operator delete[](p, PIXEL_ALIGNMENT);
+}
+
+}
+
+TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0), origin(TOP_LEFT), mapping(NULL), mapping_size(0) {
 }
 
-TGAImage::TGAImage(int w, int h, int bpp) : data(NULL), width(w), height(h), bytespp(bpp) {
+TGAImage::TGAImage(int w, int h, int bpp, Origin o) : data(NULL), width(w), height(h), bytespp(bpp), origin(o), mapping(NULL), mapping_size(0) {
     unsigned long nbytes = width*height*bytespp;
-    data = new unsigned char[nbytes];
+    data = alloc_pixels(nbytes);
     memset(data, 0, nbytes);
 }
 
-TGAImage::TGAImage(const TGAImage &img) : data(NULL), width(img.width), height(img.height), bytespp(img.bytespp) {
-    unsigned long nbytes = width*height*bytespp;
-    data = new unsigned char[nbytes];
-    memcpy(data, img.data, nbytes);
+TGAImage::TGAImage(const TGAImage &img) : data(NULL), width(0), height(0), bytespp(0), origin(TOP_LEFT), mapping(NULL), mapping_size(0) {
+    *this = img;
 }
 
 TGAImage::~TGAImage() {
-    if (data) delete [] data;
+    release();
 }
 
+// copies always own their pixels and keep the origin
 TGAImage & TGAImage::operator =(const TGAImage &img) {
     if (this != &img) {
-        if (data) delete [] data;
+        release();
         width  = img.width;
         height = img.height;
         bytespp = img.bytespp;
-        unsigned long nbytes = width*height*bytespp;
-        data = new unsigned char[nbytes];
-        memcpy(data, img.data, nbytes);
+        origin = img.origin;
+        if (img.data) {
+            unsigned long nbytes = width*height*bytespp;
+            data = alloc_pixels(nbytes);
+            memcpy(data, img.data, nbytes);
+        }
+    }
+    return *this;
+}
+
+TGAImage::TGAImage(TGAImage &&img) noexcept : data(img.data), width(img.width), height(img.height), bytespp(img.bytespp), origin(img.origin), mapping(img.mapping), mapping_size(img.mapping_size) {
+    img.data = NULL;
+    img.mapping = NULL;
+    img.mapping_size = 0;
+}
+
+// takes over the pixels (or the mapping) of img, which is left empty
+TGAImage & TGAImage::operator =(TGAImage &&img) noexcept {
+    if (this != &img) {
+        release();
+        data = img.data;
+        width = img.width;
+        height = img.height;
+        bytespp = img.bytespp;
+        origin = img.origin;
+        mapping = img.mapping;
+        mapping_size = img.mapping_size;
+        img.data = NULL;
+        img.mapping = NULL;
+        img.mapping_size = 0;
     }
     return *this;
 }
 
-bool TGAImage::read_tga_file(const char *filename) {
-    if (data) delete [] data;
+namespace {
+
+// maps the whole file read-only; returns NULL on failure
+unsigned char *map_file(const char *filename, size_t &size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file==INVALID_HANDLE_VALUE) return NULL;
+    LARGE_INTEGER length;
+    void *base = NULL;
+    if (GetFileSizeEx(file, &length) && length.QuadPart>0) {
+        HANDLE view = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (view) {
+            base = MapViewOfFile(view, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(view);
+        }
+        size = (size_t)length.QuadPart;
+    }
+    CloseHandle(file);
+    return (unsigned char *)base;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd<0) return NULL;
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st)==0 && st.st_size>0) {
+        size = (size_t)st.st_size;
+        base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return base==MAP_FAILED ? NULL : (unsigned char *)base;
+#endif
+}
+
+void unmap_file(void *base, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(base);
+#else
+    munmap(base, size);
+#endif
+}
+
+// pixel data follows the image id and the (normally absent) color map
+size_t pixel_offset(const TGA_Header &header) {
+    size_t offset = sizeof(header) + (unsigned char)header.idlength;
+    if (header.colormaptype) offset += (unsigned short)header.colormaplength*(((unsigned char)header.colormapdepth+7)>>3);
+    return offset;
+}
+
+}
+
+void TGAImage::release() {
+    if (mapping) unmap_file(mapping, mapping_size);
+    else if (data) free_pixels(data);
     data = NULL;
+    mapping = NULL;
+    mapping_size = 0;
+}
+
+// turns a mapped view into an owned copy before the pixels are modified or handed out
+bool TGAImage::detach() {
+    if (!mapping) return true;
+    *this = TGAImage(*this);
+    return data!=NULL;
+}
+
+bool TGAImage::read_tga_file(const char *filename) {
+    release();
     std::ifstream in;
     in.open (filename, std::ios::binary);
     if (!in.is_open()) {
@@ -62,8 +188,11 @@ bool TGAImage::read_tga_file(const char *filename) {
         std::cerr << "bad bpp (or width/height) value\n";
         return false;
     }
+    std::streamoff offset = pixel_offset(header);
+    in.seekg(offset);
     unsigned long nbytes = bytespp*width*height;
-    data = new unsigned char[nbytes];
+    data = alloc_pixels(nbytes);
+    origin = (header.imagedescriptor & 0x20) ? TOP_LEFT : BOTTOM_LEFT;
     if (3==header.datatypecode || 2==header.datatypecode) {
         in.read((char *)data, nbytes);
         if (!in.good()) {
@@ -72,7 +201,13 @@ bool TGAImage::read_tga_file(const char *filename) {
             return false;
         }
     } else if (10==header.datatypecode||11==header.datatypecode) {
-        if (!load_rle_data(in)) {
+        // the packets are read with a single call and expanded from memory
+        in.seekg(0, std::ios::end);
+        std::streamoff size = (std::streamoff)in.tellg() - offset;
+        in.seekg(offset);
+        std::unique_ptr<unsigned char[]> packets(new unsigned char[size>0 ? size : 1]);
+        in.read((char *)packets.get(), size);
+        if (size<=0 || !in.good() || !load_rle_data(packets.get(), size)) {
             in.close();
             std::cerr << "an error occured while reading the data\n";
             return false;
@@ -82,9 +217,7 @@ bool TGAImage::read_tga_file(const char *filename) {
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
         return false;
     }
-    if (!(header.imagedescriptor & 0x20)) {
-        flip_vertically();
-    }
+    // scanlines stay in file order, only a right-to-left image is mirrored
     if (header.imagedescriptor & 0x10) {
         flip_horizontally();
     }
@@ -93,55 +226,117 @@ bool TGAImage::read_tga_file(const char *filename) {
     return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream &in) {
-    unsigned long pixelcount = width*height;
-    unsigned long currentpixel = 0;
-    unsigned long currentbyte  = 0;
-    TGAColor colorbuffer;
-    do {
-        unsigned char chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good()) {
+// the pixels of an uncompressed file are used where they lie in the mapping, nothing is copied
+bool TGAImage::map_tga_file(const char *filename) {
+    release();
+    size_t size = 0;
+    unsigned char *base = map_file(filename, size);
+    if (!base) {
+        std::cerr << "can't map file " << filename << "\n";
+        return false;
+    }
+    TGA_Header header;
+    bool raw = size>=sizeof(header);
+    if (raw) {
+        memcpy(&header, base, sizeof(header));
+        int bpp = header.bitsperpixel>>3;
+        raw = (2==header.datatypecode || 3==header.datatypecode) && !(header.imagedescriptor & 0x10)
+            && header.width>0 && header.height>0 && (bpp==GRAYSCALE || bpp==RGB || bpp==RGBA)
+            && pixel_offset(header) + (size_t)header.width*header.height*bpp <= size;
+    }
+    if (!raw) {
+        // compressed or unusual files go through the regular reader, which reports any error
+        unmap_file(base, size);
+        return read_tga_file(filename);
+    }
+    mapping = base;
+    mapping_size = size;
+    width   = header.width;
+    height  = header.height;
+    bytespp = header.bitsperpixel>>3;
+    data = base + pixel_offset(header);
+    origin = (header.imagedescriptor & 0x20) ? TOP_LEFT : BOTTOM_LEFT;
+    std::cerr << width << "x" << height << "/" << bytespp*8 << "\n";
+    return true;
+}
+
+namespace {
+
+// writes count copies of the pixel at px to dst, with 16-byte stores once the run spans a full period
+template <int BPP>
+inline void fill_pixels(unsigned char *dst, const unsigned char *px, int count) {
+    if (BPP==1) {
+        memset(dst, *px, count);
+        return;
+    }
+#ifdef SIMD_SSE2
+    // one period of the pattern: 4 pixels of 32 bits, or 16 pixels of 24 bits in three vectors
+    constexpr int period = BPP==4 ? 16 : 48;
+    size_t bytes = (size_t)count*BPP;
+    if (bytes>=(size_t)period) {
+        alignas(16) unsigned char pattern[48];
+        for (int k=0; k<period; k+=BPP) memcpy(pattern+k, px, BPP);
+        __m128i v[period/16];
+        for (int k=0; k<period/16; k++) v[k] = _mm_load_si128((const __m128i *)(pattern+16*k));
+        size_t i = 0;
+        for (; i+period<=bytes; i+=period) {
+            for (int k=0; k<period/16; k++) _mm_storeu_si128((__m128i *)(dst+i+16*k), v[k]);
+        }
+        memcpy(dst+i, pattern, bytes-i);
+        return;
+    }
+#endif
+    for (int i=0; i<count; i++) memcpy(dst+i*BPP, px, BPP);
+}
+
+// expands the packets in [in, end) into [dst, dst_end). every packet is validated once against
+// the pixels still missing and the bytes left in the input. most packets of a rendered frame are
+// a few pixels long, so short raw packets are copied with one 16-byte move whenever both buffers
+// have room for it; the excess is overwritten by the next packet
+template <int BPP>
+bool expand_rle(const unsigned char *in, const unsigned char *end, unsigned char *dst, unsigned char *dst_end) {
+    while (dst<dst_end) {
+        if (in>=end) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
-        if (chunkheader<128) {
-            chunkheader++;
-            for (int i=0; i<chunkheader; i++) {
-                in.read((char *)colorbuffer.bgra, bytespp);
-                if (!in.good()) {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t=0; t<bytespp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
+        unsigned char chunkheader = *in++;
+        int count = (chunkheader&127)+1;
+        size_t bytes = (size_t)count*BPP;
+        if (bytes>(size_t)(dst_end-dst)) {
+            std::cerr << "Too many pixels read\n";
+            return false;
+        }
+        size_t needed = chunkheader<128 ? bytes : BPP;
+        if (needed>(size_t)(end-in)) {
+            std::cerr << "an error occured while reading the data\n";
+            return false;
+        }
+        if (chunkheader>=128) {
+            fill_pixels<BPP>(dst, in, count);
+        } else if (bytes<=16 && end-in>=16 && dst_end-dst>=16) {
+            memcpy(dst, in, 16);
         } else {
-            chunkheader -= 127;
-            in.read((char *)colorbuffer.bgra, bytespp);
-            if (!in.good()) {
-                std::cerr << "an error occured while reading the header\n";
-                return false;
-            }
-            for (int i=0; i<chunkheader; i++) {
-                for (int t=0; t<bytespp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
+            memcpy(dst, in, bytes);
         }
-    } while (currentpixel < pixelcount);
+        in += needed;
+        dst += bytes;
+    }
     return true;
 }
 
+}
+
+bool TGAImage::load_rle_data(const unsigned char *in, size_t size) {
+    const unsigned char *end = in+size;
+    unsigned char *dst_end = data+(size_t)width*height*bytespp;
+    switch (bytespp) {
+        case GRAYSCALE: return expand_rle<1>(in, end, data, dst_end);
+        case RGB:       return expand_rle<3>(in, end, data, dst_end);
+        default:        return expand_rle<4>(in, end, data, dst_end);
+    }
+}
+
 bool TGAImage::write_tga_file(const char *filename, bool rle) {
     unsigned char developer_area_ref[4] = {0, 0, 0, 0};
     unsigned char extension_area_ref[4] = {0, 0, 0, 0};
@@ -159,7 +354,7 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
     header.width  = width;
     header.height = height;
     header.datatypecode = (bytespp==GRAYSCALE?(rle?11:3):(rle?10:2));
-    header.imagedescriptor = 0x20; // top-left origin
+    header.imagedescriptor = origin;
     out.write((char *)&header, sizeof(header));
     if (!out.good()) {
         out.close();
@@ -202,45 +397,208 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
     return true;
 }
 
-// TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream &out) {
-    const unsigned char max_chunk_length = 128;
-    unsigned long npixels = width*height;
-    unsigned long curpix = 0;
-    while (curpix<npixels) {
-        unsigned long chunkstart = curpix*bytespp;
-        unsigned long curbyte = curpix*bytespp;
-        unsigned char run_length = 1;
-        bool raw = true;
-        while (curpix+run_length<npixels && run_length<max_chunk_length) {
-            bool succ_eq = true;
-            for (int t=0; succ_eq && t<bytespp; t++) {
-                succ_eq = (data[curbyte+t]==data[curbyte+t+bytespp]);
-            }
-            curbyte += bytespp;
-            if (1==run_length) {
-                raw = !succ_eq;
-            }
-            if (raw && succ_eq) {
-                run_length--;
-                break;
+bool TGAImage::read_qoi_file(const char *filename) {
+    release();
+    std::ifstream in;
+    in.open (filename, std::ios::binary | std::ios::ate);
+    if (!in.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        in.close();
+        return false;
+    }
+    std::streamoff size = in.tellg();
+    in.seekg(0);
+    std::unique_ptr<unsigned char[]> file(new unsigned char[size>0 ? size : 1]);
+    in.read((char *)file.get(), size);
+    in.close();
+    QoiHeader header;
+    if (size<=0 || !in.good() || !qoi_read_header(file.get(), size, header)) {
+        width = height = bytespp = 0;
+        std::cerr << "an error occured while reading the header\n";
+        return false;
+    }
+    width   = header.width;
+    height  = header.height;
+    bytespp = header.channels;
+    origin  = TOP_LEFT;
+    data = alloc_pixels((size_t)width*height*bytespp);
+    if (!qoi_decode(file.get(), size, ImageView(data, width, height, (long)width*bytespp, bytespp))) {
+        std::cerr << "an error occured while reading the data\n";
+        return false;
+    }
+    std::cerr << width << "x" << height << "/" << bytespp*8 << "\n";
+    return true;
+}
+
+// qoi rows run top-down, so a bottom-left image is fed through a flipped view
+bool TGAImage::write_qoi_file(const char *filename) const {
+    if (!data) return false;
+    QoiEncoder encoder;
+    if (!encoder.open(filename, width, height, bytespp==RGBA ? 4 : 3)) return false;
+    ConstImageView rows = view();
+    encoder.write_rows(origin==TOP_LEFT ? rows : rows.flipped());
+    if (!encoder.close()) {
+        std::cerr << "can't dump the qoi file\n";
+        return false;
+    }
+    return true;
+}
+
+bool TGAImage::write_png_file(const char *filename, int level) const {
+    if (!data) return false;
+    ConstImageView rows = view();
+    return write_png(filename, origin==TOP_LEFT ? rows : rows.flipped(), level);
+}
+
+namespace {
+
+const int RLE_MAX_PACKET = 128;
+
+// pixels compared per block by neighbour_mask: as many as fit in 16 bytes with a one-pixel offset
+template <int BPP> constexpr int rle_block = BPP==1 ? 16 : (BPP==3 ? 5 : 4);
+
+// shortest run worth a run packet: L equal pixels cost 1+BPP bytes as a run, plus the header of
+// the raw packet that usually follows, against L*BPP bytes when kept raw. for 24/32-bit pixels two
+// equal pixels already pay off; for grayscale a pair is never cheaper than staying raw, three are
+template <int BPP> constexpr int rle_min_run = BPP==1 ? 3 : 2;
+
+template <int BPP> inline bool same_pixel(const unsigned char *a, const unsigned char *b) {
+    if (BPP==4) {
+        uint32_t x, y;
+        memcpy(&x, a, 4);
+        memcpy(&y, b, 4);
+        return x==y;
+    }
+    if (BPP==3) {
+        uint16_t x, y;
+        memcpy(&x, a, 2);
+        memcpy(&y, b, 2);
+        return x==y && a[2]==b[2];
+    }
+    return *a==*b;
+}
+
+// bit k is set when pixel k equals pixel k+1, for the rle_block<BPP> pixels starting at p;
+// reads 16+BPP bytes
+template <int BPP> inline unsigned neighbour_mask(const unsigned char *p) {
+#ifdef SIMD_SSE2
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p+BPP));
+    if (BPP==4) return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b)));
+    unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+    if (BPP==1) return m;
+    // a 24-bit pixel is equal when its three bytes are; gather every third bit
+    m &= (m>>1) & (m>>2);
+    return (m&1) | ((m>>2)&2) | ((m>>4)&4) | ((m>>6)&8) | ((m>>8)&16);
+#else
+    unsigned m = 0;
+    for (int k=0; k<rle_block<BPP>; k++) m |= (unsigned)same_pixel<BPP>(p+k*BPP, p+(k+1)*BPP) << k;
+    return m;
+#endif
+}
+
+// encodes one scanline of n pixels, packets never cross the end of the row (as TGA 2.0 requires);
+// returns the number of bytes written, at most n*BPP + (n+127)/128
+template <int BPP> size_t encode_rle_row(const unsigned char *row, int n, unsigned char *out) {
+    const int K = rle_block<BPP>;
+    // the block compare starting at pixel j stays inside the row
+    auto block_ok = [n](int j) { return j*BPP + 16 + BPP <= n*BPP; };
+
+    // number of pixels equal to pixel i, up to the packet limit
+    const int M = rle_min_run<BPP>;
+    auto run_length = [&](int i) {
+        int limit = std::min(n-1, i+RLE_MAX_PACKET-1);
+        int j = i;
+        while (j<limit) {
+            if (block_ok(j)) {
+                int ones = std::countr_one(neighbour_mask<BPP>(row+j*BPP));
+                j += ones;
+                if (ones<K) break;
+            } else {
+                if (!same_pixel<BPP>(row+j*BPP, row+(j+1)*BPP)) break;
+                j++;
             }
-            if (!raw && !succ_eq) {
-                break;
+        }
+        return std::min(j, limit) - i + 1;
+    };
+
+    // a raw packet starting at i goes on until a run of at least M pixels begins
+    auto raw_length = [&](int i) {
+        int limit = std::min(n, i+RLE_MAX_PACKET);
+        int j = i+1;
+        while (j<limit) {
+            if (block_ok(j)) {
+                // bit k: pixels j+k .. j+k+M-1 are equal; the last M-2 bits of the block are unknown
+                unsigned m = neighbour_mask<BPP>(row+j*BPP), run = m;
+                for (int t=1; t<M-1; t++) run &= m>>t;
+                if (run) {
+                    j += std::countr_zero(run);
+                    break;
+                }
+                j += K-M+2;
+            } else {
+                bool run = j+M<=n;
+                for (int t=0; run && t<M-1; t++) run = same_pixel<BPP>(row+(j+t)*BPP, row+(j+t+1)*BPP);
+                if (run) break;
+                j++;
             }
-            run_length++;
         }
-        curpix += run_length;
-        out.put(raw?run_length-1:run_length+127);
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
+        return std::min(j, limit) - i;
+    };
+
+    unsigned char *o = out;
+    int i = 0;
+    while (i<n) {
+        int len = run_length(i);
+        if (len>=M) {
+            *o++ = (unsigned char)(len+127);
+            memcpy(o, row+i*BPP, BPP);
+            o += BPP;
+        } else {
+            len = raw_length(i);
+            *o++ = (unsigned char)(len-1);
+            memcpy(o, row+i*BPP, len*BPP);
+            o += len*BPP;
         }
-        out.write((char *)(data+chunkstart), (raw?run_length*bytespp:bytespp));
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
+        i += len;
+    }
+    return o-out;
+}
+
+typedef size_t (*RleRowEncoder)(const unsigned char *row, int n, unsigned char *out);
+// indexed by bytes per pixel
+const RleRowEncoder rle_row_encoders[5] = {NULL, encode_rle_row<1>, NULL, encode_rle_row<3>, encode_rle_row<4>};
+
+}
+
+// packets never cross scanlines, so bands of rows are encoded in parallel, each into its own slot
+// of the buffer sized for the worst case; the bands are then packed together and flushed with a
+// single write. the bytes do not depend on the number of threads
+bool TGAImage::unload_rle_data(std::ofstream &out) {
+    const int band_rows = 16;
+    size_t line_bytes = (size_t)width*bytespp;
+    size_t line_bound = line_bytes + (width+RLE_MAX_PACKET-1)/RLE_MAX_PACKET;
+    int nbands = (height+band_rows-1)/band_rows;
+    std::unique_ptr<unsigned char[]> packets(new unsigned char[line_bound*height]);
+    std::unique_ptr<size_t[]> band_size(new size_t[nbands]);
+    RleRowEncoder encode = rle_row_encoders[bytespp];
+    parallel_for(0, height, band_rows, [&](int y0, int y1) {
+        unsigned char *dst = packets.get() + y0*line_bound;
+        size_t size = 0;
+        for (int y=y0; y<y1; y++) {
+            size += encode(data+y*line_bytes, width, dst+size);
         }
+        band_size[y0/band_rows] = size;
+    });
+    size_t size = 0;
+    for (int b=0; b<nbands; b++) {
+        memmove(packets.get()+size, packets.get()+b*band_rows*line_bound, band_size[b]);
+        size += band_size[b];
+    }
+    out.write((char *)packets.get(), size);
+    if (!out.good()) {
+        std::cerr << "can't dump the tga file\n";
+        return false;
     }
     return true;
 }
@@ -253,7 +611,7 @@ TGAColor TGAImage::get(int x, int y) {
 }
 
 bool TGAImage::set(int x, int y, TGAColor &c) {
-    if (!data || x<0 || y<0 || x>=width || y>=height) {
+    if (!detach() || !data || x<0 || y<0 || x>=width || y>=height) {
         return false;
     }
     memcpy(data+(x+y*width)*bytespp, c.bgra, bytespp);
@@ -261,7 +619,7 @@ bool TGAImage::set(int x, int y, TGAColor &c) {
 }
 
 bool TGAImage::set(int x, int y, const TGAColor &c) {
-    if (!data || x<0 || y<0 || x>=width || y>=height) {
+    if (!detach() || !data || x<0 || y<0 || x>=width || y>=height) {
         return false;
     }
     memcpy(data+(x+y*width)*bytespp, c.bgra, bytespp);
@@ -272,6 +630,10 @@ int TGAImage::get_bytespp() {
     return bytespp;
 }
 
+TGAImage::Origin TGAImage::get_origin() {
+    return origin;
+}
+
 int TGAImage::get_width() {
     return width;
 }
@@ -281,77 +643,67 @@ int TGAImage::get_height() {
 }
 
 bool TGAImage::flip_horizontally() {
-    if (!data) return false;
-    int half = width>>1;
-    for (int i=0; i<half; i++) {
-        for (int j=0; j<height; j++) {
-            TGAColor c1 = get(i, j);
-            TGAColor c2 = get(width-1-i, j);
-            set(i, j, c2);
-            set(width-1-i, j, c1);
+    if (!detach() || !data) return false;
+    unsigned long bytes_per_line = width*bytespp;
+    unsigned char pixel[4];
+    for (int j=0; j<height; j++) {
+        unsigned char *l = data+j*bytes_per_line;
+        unsigned char *r = l+bytes_per_line-bytespp;
+        for (; l<r; l+=bytespp, r-=bytespp) {
+            memcpy(pixel, l, bytespp);
+            memcpy(l, r, bytespp);
+            memcpy(r, pixel, bytespp);
         }
     }
     return true;
 }
 
+// the scanlines already run from one edge to the other, so flipping only moves the origin to the
+// opposite corner; get/set and the written file follow it and no pixel is touched
 bool TGAImage::flip_vertically() {
     if (!data) return false;
-    unsigned long bytes_per_line = width*bytespp;
-    unsigned char *line = new unsigned char[bytes_per_line];
-    int half = height>>1;
-    for (int j=0; j<half; j++) {
-        unsigned long l1 = j*bytes_per_line;
-        unsigned long l2 = (height-1-j)*bytes_per_line;
-        memmove((void *)line,      (void *)(data+l1), bytes_per_line);
-        memmove((void *)(data+l1), (void *)(data+l2), bytes_per_line);
-        memmove((void *)(data+l2), (void *)line,      bytes_per_line);
-    }
-    delete [] line;
+    origin = origin==TOP_LEFT ? BOTTOM_LEFT : TOP_LEFT;
     return true;
 }
 
 unsigned char *TGAImage::buffer() {
+    detach();
     return data;
 }
 
+ImageView TGAImage::view() {
+    detach();
+    return ImageView(data, width, height, (long)width*bytespp, bytespp);
+}
+
+ConstImageView TGAImage::view() const {
+    return ConstImageView(data, width, height, (long)width*bytespp, bytespp);
+}
+
 void TGAImage::clear() {
+    if (!detach()) return;
     memset((void *)data, 0, width*height*bytespp);
 }
 
-bool TGAImage::scale(int w, int h) {
-    if (w<=0 || h<=0 || !data) return false;
-    unsigned char *tdata = new unsigned char[w*h*bytespp];
-    int nscanline = 0;
-    int oscanline = 0;
-    int erry = 0;
-    unsigned long nlinebytes = w*bytespp;
-    unsigned long olinebytes = width*bytespp;
-    for (int j=0; j<height; j++) {
-        int errx = width-w;
-        int nx   = -bytespp;
-        int ox   = -bytespp;
-        for (int i=0; i<width; i++) {
-            ox += bytespp;
-            errx += w;
-            while (errx>=(int)width) {
-                errx -= width;
-                nx += bytespp;
-                memcpy(tdata+nscanline+nx, data+oscanline+ox, bytespp);
-            }
-        }
-        erry += h;
-        oscanline += olinebytes;
-        while (erry>=(int)height) {
-            if (erry>=(int)height<<1) // it means we jump over a scanline
-                memcpy(tdata+nscanline+nlinebytes, tdata+nscanline, nlinebytes);
-            erry -= height;
-            nscanline += nlinebytes;
-        }
-    }
-    delete [] data;
-    data = tdata;
-    width = w;
-    height = h;
+bool TGAImage::scale(int w, int h, ResampleFilter filter) {
+    if (w<=0 || h<=0 || !detach() || !data) return false;
+    TGAImage scaled(w, h, bytespp, origin);
+    resample(view(), scaled.view(), filter);
+    *this = std::move(scaled);
     return true;
 }
 
+// the source is read once, for the first level; every further level only reads the previous one
+std::vector<TGAImage> TGAImage::pyramid(int levels, ResampleFilter filter) {
+    std::vector<TGAImage> result;
+    if (!data) return result;
+    result.reserve(std::max(levels, 0));
+    ConstImageView src(data, width, height, (long)width*bytespp, bytespp);
+    for (int l=0; l<levels && (src.width>1 || src.height>1); l++) {
+        result.emplace_back(std::max(src.width/2, 1), std::max(src.height/2, 1), bytespp, origin);
+        ImageView level = result.back().view();
+        resample(src, level, filter);
+        src = level;
+    }
+    return result;
+}
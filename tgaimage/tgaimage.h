@@ -1,7 +1,9 @@
 #ifndef __IMAGE_H__
 #define __IMAGE_H__
 
+#include <cstddef>
 #include <fstream>
+#include <vector>
 
 #pragma pack(push,1)
 struct TGA_Header {
@@ -60,38 +62,97 @@ struct TGAColor {
     }
 };
 
-
-class TGAImage {
-protected:
-    unsigned char* data;
+// non-owning window onto rows of pixels; row y starts at data+y*stride, stride in bytes
+template <class T> struct BasicImageView {
+    T* data;
     int width;
     int height;
+    long stride;
     int bytespp;
 
-    bool   load_rle_data(std::ifstream &in);
-    bool unload_rle_data(std::ofstream &out);
+    BasicImageView() : data(NULL), width(0), height(0), stride(0), bytespp(0) {}
+    BasicImageView(T *d, int w, int h, long s, int bpp) : data(d), width(w), height(h), stride(s), bytespp(bpp) {}
+    // a writable view can be passed wherever a read-only one is expected
+    template <class U> BasicImageView(const BasicImageView<U> &v) : data(v.data), width(v.width), height(v.height), stride(v.stride), bytespp(v.bytespp) {}
+
+    T *row(int y) const { return data+y*stride; }
+    T *pixel(int x, int y) const { return data+y*stride+x*bytespp; }
+    // the w x h rectangle at (x,y), still pointing into the same pixels
+    BasicImageView sub(int x, int y, int w, int h) const { return BasicImageView(pixel(x, y), w, h, stride, bytespp); }
+    // the same pixels with the rows in the opposite order, e.g. top-down rows of a bottom-left image
+    BasicImageView flipped() const { return BasicImageView(row(height-1), width, height, -stride, bytespp); }
+};
+
+typedef BasicImageView<unsigned char> ImageView;
+typedef BasicImageView<const unsigned char> ConstImageView;
+
+// reconstruction filters of the resampler, from the cheapest to the sharpest
+enum ResampleFilter {
+    FILTER_BOX,         // area average, the classic choice for integer downscales
+    FILTER_BILINEAR,    // triangle
+    FILTER_BICUBIC,     // Catmull-Rom
+    FILTER_LANCZOS3     // windowed sinc over three lobes
+};
+
+
+class TGAImage {
 public:
     enum Format {
         GRAYSCALE=1, RGB=3, RGBA=4
     };
 
+    // corner of pixel (0,0); the values are the matching image descriptor bits
+    enum Origin {
+        BOTTOM_LEFT=0, TOP_LEFT=0x20
+    };
+
+protected:
+    unsigned char* data;    // scanlines in file order, starting at the origin
+    int width;
+    int height;
+    int bytespp;
+    Origin origin;
+    void* mapping;          // the mapped file of a read-only view, NULL when data is owned
+    size_t mapping_size;
+
+    bool   load_rle_data(const unsigned char *in, size_t size);
+    bool unload_rle_data(std::ofstream &out);
+    void release();
+    bool detach();
+public:
     TGAImage();
-    TGAImage(int w, int h, int bpp);
+    TGAImage(int w, int h, int bpp, Origin o=TOP_LEFT);
     TGAImage(const TGAImage &img);
+    TGAImage(TGAImage &&img) noexcept;
     bool read_tga_file(const char *filename);
+    // read-only view of an uncompressed file mapped into memory; RLE files are read as usual
+    bool map_tga_file(const char *filename);
     bool write_tga_file(const char *filename, bool rle=true);
+    // QOI files (see qoi.h) hold 3 or 4 bytes per pixel with the origin at the top left; grayscale
+    // images are written as RGB
+    bool read_qoi_file(const char *filename);
+    bool write_qoi_file(const char *filename) const;
+    // PNG with deflate split across the thread pool; level 0 (stored) to 9, 1 is the fast one (see png.h)
+    bool write_png_file(const char *filename, int level=6) const;
     bool flip_horizontally();
     bool flip_vertically();
-    bool scale(int w, int h);
+    bool scale(int w, int h, ResampleFilter filter=FILTER_BILINEAR);
+    // successive halvings down to at most levels images, each filtered from the previous one
+    std::vector<TGAImage> pyramid(int levels, ResampleFilter filter=FILTER_BOX);
     TGAColor get(int x, int y);
     bool set(int x, int y, TGAColor &c);
     bool set(int x, int y, const TGAColor &c);
     ~TGAImage();
     TGAImage & operator =(const TGAImage &img);
+    TGAImage & operator =(TGAImage &&img) noexcept;
     int get_width();
     int get_height();
     int get_bytespp();
+    Origin get_origin();
     unsigned char *buffer();
+    // rows start at the origin; the writable view detaches a mapped file like buffer() does
+    ImageView view();
+    ConstImageView view() const;
     void clear();
 };
 